@@ -16,8 +16,23 @@
 #error "ATOMIC_INT_TYPE not defined"
 #endif
 
-// The maximum number of participating groups
-#define BAR_FLAG_SIZE 1024
+// How DISCOVERY_PROTOCOL decides which groups participate, chosen at
+// build time with -DDISCOVERY_MODE (see DISCOVERY_PROTOCOL in
+// discovery.cl). DISCOVER runs the discovery protocol. SKIP makes every
+// launched group participate and FIXED the first DISCOVERY_FIXED_GROUPS
+// launched groups, without the protocol: the host guarantees that they
+// are co-resident.
+#define DISCOVERY_MODE_DISCOVER 0
+#define DISCOVERY_MODE_SKIP 1
+#define DISCOVERY_MODE_FIXED 2
+
+#ifndef DISCOVERY_MODE
+#define DISCOVERY_MODE DISCOVERY_MODE_DISCOVER
+#endif
+
+#if DISCOVERY_MODE == DISCOVERY_MODE_FIXED && !defined(DISCOVERY_FIXED_GROUPS)
+#error "DISCOVERY_MODE_FIXED needs DISCOVERY_FIXED_GROUPS"
+#endif
 
 /*
   Mutex, discovery protocol, execution environment, and XF barrier data structures
@@ -29,11 +44,17 @@ typedef struct {
   ATOMIC_INT_TYPE now_serving;
 } discovery_mutex;
 
-// Barrier and discovery protocol variables (discovery_kernel_ctx)
+// Barrier and discovery protocol variables (discovery_kernel_ctx).
+// The per-group arrays (e.g. the barrier flags) are not part of the
+// struct: the buffer holding the context has room for `capacity`
+// entries of each after it, so the maximum number of participating
+// groups is chosen at runtime (see create_discovery_kernel_ctx in
+// discovery.h).
 typedef struct {
 
-  // Barrier flags for XF Barrier
-  ATOMIC_INT_TYPE bar_flags[BAR_FLAG_SIZE];
+  // Number of entries in each per-group array stored after the
+  // context, and so the maximum number of participating groups
+  INT_TYPE capacity;
 
   // Discovery protocol variables
   INT_TYPE prot_poll_open;
@@ -42,7 +63,142 @@ typedef struct {
   INT_TYPE kernel_counter;
   discovery_mutex m;
 
-  // Flag to skip the protocol for finding the occupancy bound
+  // Lock-free discovery protocol variables (LOCK_FREE_PROTOCOL). The
+  // poll state packs the poll-closed bit, the number of participating
+  // groups (frozen when the poll closes) and the poll counter.
+  ATOMIC_INT_TYPE prot_state;
+  ATOMIC_INT_TYPE prot_exit_counter;
+
+  // Flag to skip the protocol for finding the occupancy bound. Only
+  // read by kernels built with DISCOVERY_RUNTIME_SKIP.
   INT_TYPE skip;
 
+  // Number of epoch barriers completed (XF_epoch_barrier). Only
+  // initialised by init_discovery_kernel_ctx as it is not reset
+  // between kernels.
+  ATOMIC_INT_TYPE bar_epoch;
+
+  // Logical clock stamping trace events when no device clock is used
+  // (DISCOVERY_TRACE). Only initialised by init_discovery_kernel_ctx.
+  ATOMIC_INT_TYPE trace_clock;
+
+  // Synchronisation counters (DISCOVERY_STATS), accumulated over all
+  // kernels since init_discovery_kernel_ctx or the last read, which
+  // resets them as they are only 32 bits: barriers completed, failed
+  // polls of the groups waiting in them (in total and the longest
+  // single wait) and failed polls of the discovery mutex. See
+  // discovery_stats in discovery.h.
+  ATOMIC_INT_TYPE stat_barriers;
+  ATOMIC_INT_TYPE stat_barrier_spins;
+  ATOMIC_INT_TYPE stat_max_barrier_spins;
+  ATOMIC_INT_TYPE stat_lock_spins;
+
+  // Guided scheduler (DISCOVERY_FOR_EACH): the next unclaimed item of
+  // the loop in progress and the number of groups that have finished
+  // it. The last group to finish resets both.
+  ATOMIC_INT_TYPE sched_next;
+  ATOMIC_INT_TYPE sched_done;
+
+  // Shared phase (DISCOVERY_SHARED_FOR_EACH): the next unclaimed item,
+  // the number of items completed and the number of launched groups
+  // that are done with the phase. The last of those resets all three.
+  ATOMIC_INT_TYPE shared_next;
+  ATOMIC_INT_TYPE shared_done;
+  ATOMIC_INT_TYPE shared_exit;
+
 } discovery_kernel_ctx;
+
+// Distance, in ints, between consecutive entries of the per-group
+// arrays, i.e. between consecutive barrier flags. With the
+// default of 1 the flags are packed; padding them out to a cache line
+// (e.g. 16 for 64 byte lines) stops groups spinning on neighbouring
+// flags from invalidating each other's lines.
+#ifndef BAR_FLAG_STRIDE
+#define BAR_FLAG_STRIDE 1
+#endif
+
+// Offset, in ints from the start of the context, of the first per-group
+// array. The context is rounded up to a whole stride so that padded
+// flags do not share a line with the protocol variables either.
+#define BAR_FLAG_OFFSET \
+  ((sizeof(discovery_kernel_ctx) / sizeof(INT_TYPE) + BAR_FLAG_STRIDE - 1) / BAR_FLAG_STRIDE * BAR_FLAG_STRIDE)
+
+// The per-group arrays, in the order they are stored after the context:
+// the barrier flags, the values combined by discovery_barrier_reduce,
+// with DISCOVERY_STATS the failed barrier polls of each group and with
+// QUEUE_LOCK the slots of the discovery mutex (see locks.cl).
+#define DISCOVERY_BAR_FLAGS 0
+#define DISCOVERY_BAR_VALUES 1
+
+#ifdef DISCOVERY_STATS
+#define DISCOVERY_BAR_SPINS 2
+#define DISCOVERY_STATS_ARRAYS 1
+#else
+#define DISCOVERY_STATS_ARRAYS 0
+#endif
+
+// The arrays of every mutex
+#define DISCOVERY_BASE_GROUP_ARRAYS (2 + DISCOVERY_STATS_ARRAYS)
+
+#ifdef QUEUE_LOCK
+#define DISCOVERY_LOCK_SLOTS DISCOVERY_BASE_GROUP_ARRAYS
+#define DISCOVERY_GROUP_ARRAYS (DISCOVERY_BASE_GROUP_ARRAYS + 1)
+#else
+#define DISCOVERY_GROUP_ARRAYS DISCOVERY_BASE_GROUP_ARRAYS
+#endif
+
+// Trace mode (compile with -DDISCOVERY_TRACE). Each participating group
+// records its protocol and barrier events in a ring buffer of
+// DISCOVERY_TRACE_EVENTS events, stored after the per-group arrays: a
+// count of the events the group has recorded, followed by the ring of
+// (event, timestamp) pairs. See discovery_trace in discovery.cl and
+// discovery_write_trace in discovery.h.
+#ifdef DISCOVERY_TRACE
+
+#ifndef DISCOVERY_TRACE_EVENTS
+#define DISCOVERY_TRACE_EVENTS 256
+#endif
+
+#define DISCOVERY_TRACE_GROUP_INTS (1 + 2 * DISCOVERY_TRACE_EVENTS)
+
+#else
+
+#define DISCOVERY_TRACE_GROUP_INTS 0
+
+#endif
+
+// Trace events
+#define DISCOVERY_TRACE_PROTOCOL_ENTER 0
+#define DISCOVERY_TRACE_PROTOCOL_EXIT 1
+#define DISCOVERY_TRACE_BARRIER_ARRIVE 2
+#define DISCOVERY_TRACE_BARRIER_RELEASE 3
+
+// Ints stored per participating group after the context
+#define DISCOVERY_GROUP_INTS (DISCOVERY_GROUP_ARRAYS * BAR_FLAG_STRIDE + DISCOVERY_TRACE_GROUP_INTS)
+
+// Server mode (see discovery_server_next in discovery.cl). The host
+// submits commands to a ring in fine-grained SVM, which a persistent
+// kernel consumes in order. `head` counts the commands submitted and is
+// only written by the host, `tail` counts the commands completed and is
+// only written by the kernel. Command i is held in entry
+// i % DISCOVERY_SERVER_RING_SIZE until it completes.
+#ifndef DISCOVERY_SERVER_RING_SIZE
+#define DISCOVERY_SERVER_RING_SIZE 64
+#endif
+
+// Command type that makes the kernel exit
+#define DISCOVERY_SERVER_STOP -1
+
+// A command: its type and arguments are defined by the kernel, e.g. a
+// query type, a source vertex and the slot to write the result to
+typedef struct {
+  INT_TYPE type;
+  INT_TYPE arg;
+  INT_TYPE slot;
+} discovery_command;
+
+typedef struct {
+  ATOMIC_INT_TYPE head;
+  ATOMIC_INT_TYPE tail;
+  discovery_command commands[DISCOVERY_SERVER_RING_SIZE];
+} discovery_command_ring;
@@ -11,21 +11,157 @@
 
 #include "../locks/locks.cl"
 
-// The maximum number of participating groups
-#define BAR_FLAG_SIZE 1024
-
 // Discovery execution environment variables can be stored in local
 // memory (discovery_local_ctx)
 typedef struct {
   INT_TYPE participating_group_id;
   INT_TYPE participating_group_size;
   INT_TYPE is_participating;
+  INT_TYPE epoch;
+  INT_TYPE reduce_value;
+  INT_TYPE team_id;
+  INT_TYPE num_teams;
+  INT_TYPE team_first_group;
+  INT_TYPE team_num_groups;
+  INT_TYPE sched_start;
+  INT_TYPE sched_end;
 } discovery_local_ctx;
 
 /*
   Functions for Discovery protocol, execution environment, and XF barrier.
 */
 
+// Work-item and workgroup ids flattened over all dimensions of the
+// NDRange, so that 2D and 3D kernels elect a single representative
+// (local id 0) per group and count every group. Unused dimensions have
+// an id of 0 and a size of 1, so these match dimension 0 in 1D.
+int discovery_local_id() {
+  return get_local_id(0) + get_local_size(0) * (get_local_id(1) + get_local_size(1) * get_local_id(2));
+}
+
+int discovery_local_size() {
+  return get_local_size(0) * get_local_size(1) * get_local_size(2);
+}
+
+int discovery_group_id() {
+  return get_group_id(0) + get_num_groups(0) * (get_group_id(1) + get_num_groups(1) * get_group_id(2));
+}
+
+int discovery_num_groups() {
+  return get_num_groups(0) * get_num_groups(1) * get_num_groups(2);
+}
+
+// The per-group arrays are stored after the discovery_kernel_ctx in
+// the same buffer, one entry per group the context has capacity for,
+// every BAR_FLAG_STRIDE ints. Returns the entry of participating group
+// `id` in per-group array `array` (e.g. DISCOVERY_BAR_FLAGS).
+__global ATOMIC_INT_TYPE *discovery_group_entry(__global discovery_kernel_ctx *gl_ctx, int array, int id) {
+  return (__global ATOMIC_INT_TYPE *) gl_ctx + BAR_FLAG_OFFSET + (array * gl_ctx->capacity + id) * BAR_FLAG_STRIDE;
+}
+
+// Values a slave sets its barrier flag to on arrival. Team barriers
+// use a value of their own so that the master of a barrier over all
+// groups cannot mistake a group still held at its team barrier for
+// one that has arrived, or vice versa. Flags are 0 otherwise.
+#define BAR_FLAG_ARRIVED 1
+#define BAR_FLAG_TEAM_ARRIVED 2
+
+// Returns the barrier flag of participating group `id`
+__global ATOMIC_INT_TYPE *discovery_bar_flag(__global discovery_kernel_ctx *gl_ctx, int id) {
+  return discovery_group_entry(gl_ctx, DISCOVERY_BAR_FLAGS, id);
+}
+
+#ifdef DISCOVERY_TRACE
+
+// Timestamp of a trace event. By default a logical clock shared by all
+// groups, which orders the events but does not measure time. Compile
+// with e.g. -DDISCOVERY_TRACE_CLOCK(gl_ctx)=... to use a device clock.
+#ifndef DISCOVERY_TRACE_CLOCK
+#define DISCOVERY_TRACE_CLOCK(gl_ctx) \
+  atomic_fetch_add_explicit(&((gl_ctx)->trace_clock), 1, memory_order_relaxed, memory_scope_device)
+#endif
+
+// Returns the trace buffer of participating group `id`: its event
+// count followed by its ring of events
+__global INT_TYPE *discovery_trace_buffer(__global discovery_kernel_ctx *gl_ctx, int id) {
+  return (__global INT_TYPE *) gl_ctx + BAR_FLAG_OFFSET + DISCOVERY_GROUP_ARRAYS * gl_ctx->capacity * BAR_FLAG_STRIDE + id * DISCOVERY_TRACE_GROUP_INTS;
+}
+
+// Records `event` at `time` for participating group `id`. Only one
+// thread per group may record events.
+void discovery_trace_at(__global discovery_kernel_ctx *gl_ctx, int id, int event, int time) {
+  __global INT_TYPE *buffer = discovery_trace_buffer(gl_ctx, id);
+  int slot = buffer[0] % DISCOVERY_TRACE_EVENTS;
+  buffer[1 + 2 * slot] = event;
+  buffer[2 + 2 * slot] = time;
+  buffer[0]++;
+}
+
+// Records `event` for the calling group, from its representative thread
+void discovery_trace(__global discovery_kernel_ctx *gl_ctx, __local discovery_local_ctx *local_ctx, int event) {
+  if (discovery_local_id() == 0) {
+    discovery_trace_at(gl_ctx, local_ctx->participating_group_id, event, DISCOVERY_TRACE_CLOCK(gl_ctx));
+  }
+}
+
+#else
+
+#define discovery_trace(gl_ctx, local_ctx, event)
+
+#endif
+
+#ifdef DISCOVERY_STATS
+
+// Atomic max on int. Written with a CAS loop as not all targets have
+// a fetch-max (e.g. CUSTOM_ATOMICS).
+void discovery_stats_max(__global ATOMIC_INT_TYPE *target, int value) {
+  int current = atomic_load_explicit(target, memory_order_relaxed, memory_scope_device);
+  while (current < value &&
+         !atomic_compare_exchange_strong_explicit(target, &current, value, memory_order_relaxed, memory_order_relaxed, memory_scope_device));
+}
+
+// Records that a thread of participating group `id` polled a barrier
+// flag `spins` times without success
+void discovery_stats_wait(__global discovery_kernel_ctx *gl_ctx, int id, int spins) {
+  if (spins == 0) {
+    return;
+  }
+  atomic_fetch_add_explicit(&(gl_ctx->stat_barrier_spins), spins, memory_order_relaxed, memory_scope_device);
+  atomic_fetch_add_explicit(discovery_group_entry(gl_ctx, DISCOVERY_BAR_SPINS, id), spins, memory_order_relaxed, memory_scope_device);
+  discovery_stats_max(&(gl_ctx->stat_max_barrier_spins), spins);
+}
+
+// Records the failed polls of the discovery mutex
+void discovery_stats_lock(__global discovery_kernel_ctx *gl_ctx, int spins) {
+  atomic_fetch_add_explicit(&(gl_ctx->stat_lock_spins), spins, memory_order_relaxed, memory_scope_device);
+}
+
+// Counts a completed barrier, from the representative thread of the
+// group that released it
+void discovery_stats_barrier(__global discovery_kernel_ctx *gl_ctx, int is_master) {
+  if (is_master && discovery_local_id() == 0) {
+    atomic_fetch_add_explicit(&(gl_ctx->stat_barriers), 1, memory_order_relaxed, memory_scope_device);
+  }
+}
+
+#else
+
+#define discovery_stats_wait(gl_ctx, id, spins)
+#define discovery_stats_lock(gl_ctx, spins) (spins)
+#define discovery_stats_barrier(gl_ctx, is_master)
+
+#endif
+
+// The discovery mutex of the context. The queue lock keeps its slots in
+// a per-group array, so it needs at least one group of capacity.
+#ifdef QUEUE_LOCK
+#define discovery_ctx_lock(gl_ctx) discovery_lock(&((gl_ctx)->m), discovery_group_entry(gl_ctx, DISCOVERY_LOCK_SLOTS, 0), (gl_ctx)->capacity)
+#define discovery_ctx_unlock(gl_ctx) discovery_unlock(&((gl_ctx)->m), discovery_group_entry(gl_ctx, DISCOVERY_LOCK_SLOTS, 0), (gl_ctx)->capacity)
+#else
+#define discovery_ctx_lock(gl_ctx) discovery_lock(&((gl_ctx)->m))
+#define discovery_ctx_unlock(gl_ctx) discovery_unlock(&((gl_ctx)->m))
+#endif
+
 // Reset the discovery kernel ctx so that it can be used in
 // subsequent kernels without explicit reset.
 void reset_kernel_context(__global discovery_kernel_ctx *gl_ctx) {
@@ -34,34 +170,102 @@ void reset_kernel_context(__global discovery_kernel_ctx *gl_ctx) {
   atomic_store_explicit(&(gl_ctx->m.counter), 0, memory_order_relaxed, memory_scope_device);
   gl_ctx->kernel_counter = 0;
   atomic_store_explicit(&(gl_ctx->m.now_serving), 0, memory_order_relaxed, memory_scope_device);
+  atomic_store_explicit(&(gl_ctx->prot_state), 0, memory_order_relaxed, memory_scope_device);
+  atomic_store_explicit(&(gl_ctx->prot_exit_counter), 0, memory_order_relaxed, memory_scope_device);
 }
 
+#ifdef LOCK_FREE_PROTOCOL
+
+// Layout of the packed poll state word (prot_state) used by the
+// lock-free protocol. The low bits count the participating groups,
+// the middle bits hold their number once the poll is closed. Groups
+// only increment the counter while the poll is open and the counter
+// is below both the context capacity and PROT_COUNTER_MASK, so it
+// never carries into the size field however many groups are launched.
+#define PROT_POLL_CLOSED (1 << 30)
+#define PROT_SIZE_SHIFT 15
+#define PROT_COUNTER_MASK ((1 << PROT_SIZE_SHIFT) - 1)
+
+// Lock-free variant of the discovery protocol. A group claims its
+// participating id with a CAS on the poll state and the poll is
+// closed with another, so groups never serialise through the
+// discovery mutex. The self-reset behaviour is kept: the last
+// group through the closing phase resets the poll state.
+void discovery_protocol_master(__global discovery_kernel_ctx *gl_ctx, __local discovery_local_ctx *local_ctx) {
+
+  int total_work_groups = discovery_num_groups();
+
+  // Polling phase. Groups arriving after the poll has closed only
+  // need to read the state, which keeps the RMW traffic off the
+  // state word once the participating groups are known. Groups
+  // polling beyond the capacity of the context have no barrier flag
+  // and so cannot participate.
+  int limit = min(gl_ctx->capacity, PROT_COUNTER_MASK);
+  int state = atomic_load_explicit(&(gl_ctx->prot_state), memory_order_relaxed, memory_scope_device);
+
+  local_ctx->is_participating = 0;
+  while (!(state & PROT_POLL_CLOSED) && (state & PROT_COUNTER_MASK) < limit) { // Poll is open
+    if (atomic_compare_exchange_strong_explicit(&(gl_ctx->prot_state), &state, state + 1, memory_order_acq_rel, memory_order_relaxed, memory_scope_device)) {
+      local_ctx->is_participating = 1;
+      local_ctx->participating_group_id = state & PROT_COUNTER_MASK;
+      break;
+    }
+  }
+
+  // Closing phase. The group that closes the poll freezes the poll
+  // counter into the size field of the state word.
+  state = atomic_load_explicit(&(gl_ctx->prot_state), memory_order_acquire, memory_scope_device);
+
+  while (!(state & PROT_POLL_CLOSED)) {
+    int count = state & PROT_COUNTER_MASK;
+    int closed = PROT_POLL_CLOSED | (count << PROT_SIZE_SHIFT) | count;
+
+    if (atomic_compare_exchange_strong_explicit(&(gl_ctx->prot_state), &state, closed, memory_order_acq_rel, memory_order_acquire, memory_scope_device)) {
+      gl_ctx->num_participating = count;
+      state = closed;
+    }
+  }
+
+  local_ctx->participating_group_size = (state >> PROT_SIZE_SHIFT) & PROT_COUNTER_MASK;
+
+  // Last workgroup through resets the protocol so that
+  // it may be used in a subsequent kernel without reset
+  if (atomic_fetch_add_explicit(&(gl_ctx->prot_exit_counter), 1, memory_order_acq_rel, memory_scope_device) == total_work_groups - 1) {
+    atomic_store_explicit(&(gl_ctx->prot_state), 0, memory_order_relaxed, memory_scope_device);
+    atomic_store_explicit(&(gl_ctx->prot_exit_counter), 0, memory_order_relaxed, memory_scope_device);
+  }
+}
+
+#else
+
 // Discovery protocol that is executed by one representative thread per workgroup
 // Has functionality to reset after every use (not discussed in OOPSLA paper).
 // This allows the protocol to be used in succession without any explicit reset.
 void discovery_protocol_master(__global discovery_kernel_ctx *gl_ctx, __local discovery_local_ctx *local_ctx) {
 
   int reset_gl_memory = 0;
-  int total_work_groups = get_num_groups(0);
+  int total_work_groups = discovery_num_groups();
 
   // Polling phase
-  discovery_lock(&(gl_ctx->m));
+  discovery_stats_lock(gl_ctx, discovery_ctx_lock(gl_ctx));
 
-  if (gl_ctx->prot_poll_open) { // Poll is open
+  // The poll is also closed to groups beyond the capacity of the
+  // context, as there is no barrier flag for them
+  if (gl_ctx->prot_poll_open && gl_ctx->prot_counter < gl_ctx->capacity) { // Poll is open
     int id = gl_ctx->prot_counter;
     local_ctx->is_participating = 1;
     local_ctx->participating_group_id = id;
 
     gl_ctx->prot_counter++;
-    discovery_unlock(&(gl_ctx->m));
+    discovery_ctx_unlock(gl_ctx);
   }
   else { // Poll is closed
     local_ctx->is_participating = 0;
-    discovery_unlock(&(gl_ctx->m));
+    discovery_ctx_unlock(gl_ctx);
   }
 
   // Closing phase
-  discovery_lock(&(gl_ctx->m));
+  discovery_stats_lock(gl_ctx, discovery_ctx_lock(gl_ctx));
   gl_ctx->kernel_counter++;
 
   // Last workgroup through resets the protocol so that
@@ -79,28 +283,61 @@ void discovery_protocol_master(__global discovery_kernel_ctx *gl_ctx, __local di
 
   if (reset_gl_memory) {
 
+#ifdef QUEUE_LOCK
+    discovery_reset_lock(discovery_group_entry(gl_ctx, DISCOVERY_LOCK_SLOTS, 0), gl_ctx->capacity);
+#endif
+
     // Contains implicit unlock
     reset_kernel_context(gl_ctx);
   }
   else {
-    discovery_unlock(&(gl_ctx->m));
+    discovery_ctx_unlock(gl_ctx);
   }
 }
 
+#endif
+
 // Top level discovery protocol function
 void discovery_protocol(__global discovery_kernel_ctx *gl_ctx, __local discovery_local_ctx *local_ctx) {
 
   // Only 1 representative thread per workgroup
-  int id_flag = get_local_id(0);
+  int id_flag = discovery_local_id();
 
   if (id_flag == 0) {
+#ifdef DISCOVERY_TRACE
+    // The group only has a trace buffer once it is participating
+    int enter = DISCOVERY_TRACE_CLOCK(gl_ctx);
+    discovery_protocol_master(gl_ctx, local_ctx);
+    if (local_ctx->is_participating) {
+      discovery_trace_at(gl_ctx, local_ctx->participating_group_id, DISCOVERY_TRACE_PROTOCOL_ENTER, enter);
+      discovery_trace_at(gl_ctx, local_ctx->participating_group_id, DISCOVERY_TRACE_PROTOCOL_EXIT, DISCOVERY_TRACE_CLOCK(gl_ctx));
+    }
+#else
     discovery_protocol_master(gl_ctx, local_ctx);
+#endif
   }
 
   // All other threads in the workgroup wait here for the result
   barrier(CLK_LOCAL_MEM_FENCE | CLK_GLOBAL_MEM_FENCE);
 }
 
+// Makes the first `num_groups` launched groups participating without
+// running the protocol, and returns 1 if the calling group is one of
+// them. Only group 0 publishes the number of participating groups.
+int discovery_fixed_protocol(__global discovery_kernel_ctx *gl_ctx, __local discovery_local_ctx *local_ctx, int num_groups) {
+  int group_id = discovery_group_id();
+
+  local_ctx->participating_group_size = num_groups;
+  local_ctx->participating_group_id = group_id;
+  local_ctx->is_participating = group_id < num_groups;
+
+  if (group_id == 0 && discovery_local_id() == 0) {
+    gl_ctx->num_participating = num_groups;
+  }
+
+  return group_id < num_groups;
+}
+
 // Returns 1 if the workgroup was one of the occupant workgroups
 // discovered by the discovery protocol (participating workgroups).
 int is_participating(__global discovery_kernel_ctx *gl_ctx, __local discovery_local_ctx *local_ctx) {
@@ -109,27 +346,294 @@ int is_participating(__global discovery_kernel_ctx *gl_ctx, __local discovery_lo
 
 // Occupancy discovery execution environment functions
 // as described in paper
+// Without the protocol, participating groups are the launched groups
+// in order, so these are known without reading local memory.
 int p_get_num_groups(__global discovery_kernel_ctx *gl_ctx, __local discovery_local_ctx *local_ctx) {
+#if DISCOVERY_MODE == DISCOVERY_MODE_SKIP
+  return discovery_num_groups();
+#elif DISCOVERY_MODE == DISCOVERY_MODE_FIXED
+  return DISCOVERY_FIXED_GROUPS;
+#else
   return local_ctx->participating_group_size;
+#endif
 }
 
 int p_get_group_id(__global discovery_kernel_ctx *gl_ctx, __local discovery_local_ctx *local_ctx) {
+#if DISCOVERY_MODE == DISCOVERY_MODE_SKIP || DISCOVERY_MODE == DISCOVERY_MODE_FIXED
+  return discovery_group_id();
+#else
   return local_ctx->participating_group_id;
+#endif
 }
 
+// Participating groups are numbered in one dimension, whatever the
+// shape of the NDRange. A multi-dimensional kernel maps its tiles onto
+// p_get_group_id and uses discovery_local_id within a tile; the global
+// id and size below are flattened in the same way.
 int p_get_global_id(__global discovery_kernel_ctx *gl_ctx, __local discovery_local_ctx *local_ctx) {
-  return get_local_id(0) + get_local_size(0) * p_get_group_id(gl_ctx, local_ctx);
+  return discovery_local_id() + discovery_local_size() * p_get_group_id(gl_ctx, local_ctx);
 }
 
 int p_get_global_size(__global discovery_kernel_ctx *gl_ctx, __local discovery_local_ctx *local_ctx) {
-  return p_get_num_groups(gl_ctx, local_ctx) * get_local_size(0);
+  return p_get_num_groups(gl_ctx, local_ctx) * discovery_local_size();
+}
+
+// An implementation of the XF barrier over the `num_groups`
+// participating groups starting at participating group `first_group`.
+// The first group of the range is the master. Every group spins on its
+// own flag, so barriers over disjoint ranges do not interfere. Slaves
+// mark arrival by setting their flag to `arrived`.
+void XF_range_barrier(__global discovery_kernel_ctx *gl_ctx, __local discovery_local_ctx *local_ctx, int first_group, int num_groups, int arrived) {
+
+  int id = p_get_group_id(gl_ctx, local_ctx);
+
+  discovery_trace(gl_ctx, local_ctx, DISCOVERY_TRACE_BARRIER_ARRIVE);
+
+  // This barrier actually isn't needed but some GPUs crash if it
+  // isn't included (!!)
+  barrier(CLK_LOCAL_MEM_FENCE | CLK_GLOBAL_MEM_FENCE);
+
+  // Master workgroup goes here
+  if (id == first_group) {
+
+    // Each thread in master is responsible for distinct slave(s)
+    for (int peer_block = first_group + discovery_local_id() + 1;
+         peer_block < first_group + num_groups;
+         peer_block += discovery_local_size()) {
+
+      // Wait for the slave
+      int delay = SPIN_BACKOFF_MIN, spins = 0;
+      while (atomic_load_explicit(discovery_bar_flag(gl_ctx, peer_block), memory_order_relaxed, memory_scope_device) != arrived) {
+        delay = spin_backoff(delay);
+        spins++;
+      }
+      discovery_stats_wait(gl_ctx, id, spins);
+
+      // Synchronise
+      atomic_work_item_fence(CLK_GLOBAL_MEM_FENCE, memory_order_acquire, memory_scope_device);
+    }
+
+    // Wait for all slaves
+    barrier(CLK_LOCAL_MEM_FENCE | CLK_GLOBAL_MEM_FENCE);
+
+    for (int peer_block = first_group + discovery_local_id() + 1;
+         peer_block < first_group + num_groups;
+         peer_block += discovery_local_size()) {
+
+      // Release slaves
+      atomic_store_explicit(discovery_bar_flag(gl_ctx, peer_block), 0, memory_order_release, memory_scope_device);
+    }
+  }
+
+  // Slave workgroups go here
+  else {
+
+    // All threads per slave sync here
+    barrier(CLK_LOCAL_MEM_FENCE | CLK_GLOBAL_MEM_FENCE);
+
+    // One rep per slave
+    if (discovery_local_id() == 0) {
+
+      // Mark arrival
+      atomic_store_explicit(discovery_bar_flag(gl_ctx, id), arrived, memory_order_release, memory_scope_device);
+
+      // Wait to be released by the master
+      int delay = SPIN_BACKOFF_MIN, spins = 0;
+      while (atomic_load_explicit(discovery_bar_flag(gl_ctx, id), memory_order_relaxed, memory_scope_device) == arrived) {
+        delay = spin_backoff(delay);
+        spins++;
+      }
+      discovery_stats_wait(gl_ctx, id, spins);
+
+      // Synchronise
+      atomic_work_item_fence(CLK_GLOBAL_MEM_FENCE, memory_order_acquire, memory_scope_device);
+    }
+
+    // All threads per slave are released here
+    barrier(CLK_LOCAL_MEM_FENCE | CLK_GLOBAL_MEM_FENCE);
+  }
+
+  // This barrier actually isn't needed but some GPUs crash if it
+  // isn't included (!!)
+  barrier(CLK_LOCAL_MEM_FENCE | CLK_GLOBAL_MEM_FENCE);
+
+  discovery_trace(gl_ctx, local_ctx, DISCOVERY_TRACE_BARRIER_RELEASE);
+  discovery_stats_barrier(gl_ctx, id == first_group);
 }
 
 // An implementation of the XF barrier
 void XF_barrier(__global discovery_kernel_ctx *gl_ctx, __local discovery_local_ctx *local_ctx) {
+  XF_range_barrier(gl_ctx, local_ctx, 0, p_get_num_groups(gl_ctx, local_ctx), BAR_FLAG_ARRIVED);
+}
+
+/*
+  Teams: the participating groups split into contiguous ranges of
+  p_get_group_id that synchronise independently.
+*/
+
+// Partitions the participating groups into `num_teams` teams of
+// near-equal size (at most one team per group). Must be called by all
+// threads of every participating group before the team functions below
+// are used, and may be called again to repartition at a point where no
+// team barrier is in progress.
+void discovery_team_init(__global discovery_kernel_ctx *gl_ctx, __local discovery_local_ctx *local_ctx, int num_teams) {
+
+  if (discovery_local_id() == 0) {
+    int groups = p_get_num_groups(gl_ctx, local_ctx);
+    int id = p_get_group_id(gl_ctx, local_ctx);
+    int teams = clamp(num_teams, 1, groups);
+
+    // The first `larger` teams have one group more than the others
+    int base = groups / teams;
+    int larger = groups % teams;
+    int team;
+
+    if (id < larger * (base + 1)) {
+      team = id / (base + 1);
+    }
+    else {
+      team = larger + (id - larger * (base + 1)) / base;
+    }
+
+    local_ctx->team_id = team;
+    local_ctx->num_teams = teams;
+    local_ctx->team_first_group = team * base + min(team, larger);
+    local_ctx->team_num_groups = base + (team < larger ? 1 : 0);
+  }
+
+  barrier(CLK_LOCAL_MEM_FENCE);
+}
+
+int p_get_team_id(__global discovery_kernel_ctx *gl_ctx, __local discovery_local_ctx *local_ctx) {
+  return local_ctx->team_id;
+}
+
+int p_get_num_teams(__global discovery_kernel_ctx *gl_ctx, __local discovery_local_ctx *local_ctx) {
+  return local_ctx->num_teams;
+}
+
+// Execution environment functions relative to the team, analogous
+// to p_get_num_groups, p_get_group_id, etc.
+int p_get_team_num_groups(__global discovery_kernel_ctx *gl_ctx, __local discovery_local_ctx *local_ctx) {
+  return local_ctx->team_num_groups;
+}
+
+int p_get_team_group_id(__global discovery_kernel_ctx *gl_ctx, __local discovery_local_ctx *local_ctx) {
+  return p_get_group_id(gl_ctx, local_ctx) - local_ctx->team_first_group;
+}
+
+int p_get_team_global_id(__global discovery_kernel_ctx *gl_ctx, __local discovery_local_ctx *local_ctx) {
+  return discovery_local_id() + discovery_local_size() * p_get_team_group_id(gl_ctx, local_ctx);
+}
+
+int p_get_team_global_size(__global discovery_kernel_ctx *gl_ctx, __local discovery_local_ctx *local_ctx) {
+  return p_get_team_num_groups(gl_ctx, local_ctx) * discovery_local_size();
+}
+
+// An XF barrier over the groups of the calling group's team only
+void XF_team_barrier(__global discovery_kernel_ctx *gl_ctx, __local discovery_local_ctx *local_ctx) {
+  XF_range_barrier(gl_ctx, local_ctx, local_ctx->team_first_group, local_ctx->team_num_groups, BAR_FLAG_TEAM_ARRIVED);
+}
+
+// The XF barrier split into two phases so that a workgroup can do
+// independent work while the other groups arrive. XF_barrier_arrive
+// signals that the workgroup has finished the current phase, and
+// XF_barrier_wait returns once every participating group has arrived.
+// Between the two, a workgroup must not access memory written by other
+// groups in the current phase, nor write memory that other groups may
+// still read in it. The master gathers the slaves in XF_barrier_wait,
+// so work it does in between delays the release of every group.
+// May be mixed with discovery_barrier.
+void XF_barrier_arrive(__global discovery_kernel_ctx *gl_ctx, __local discovery_local_ctx *local_ctx) {
+
+  int id = p_get_group_id(gl_ctx, local_ctx);
+
+  discovery_trace(gl_ctx, local_ctx, DISCOVERY_TRACE_BARRIER_ARRIVE);
+
+  // All threads of the workgroup have finished the phase
+  barrier(CLK_LOCAL_MEM_FENCE | CLK_GLOBAL_MEM_FENCE);
+
+  // One rep per slave marks arrival. The arrival of the master is
+  // implied by it gathering the slaves in XF_barrier_wait.
+  if (id != 0 && discovery_local_id() == 0) {
+    atomic_store_explicit(discovery_bar_flag(gl_ctx, id), BAR_FLAG_ARRIVED, memory_order_release, memory_scope_device);
+  }
+}
+
+void XF_barrier_wait(__global discovery_kernel_ctx *gl_ctx, __local discovery_local_ctx *local_ctx) {
 
   int id = p_get_group_id(gl_ctx, local_ctx);
 
+  // Master workgroup goes here
+  if (id == 0) {
+
+    // Each thread in master is responsible for distinct slave(s)
+    for (int peer_block = discovery_local_id() + 1;
+         peer_block < p_get_num_groups(gl_ctx, local_ctx);
+         peer_block += discovery_local_size()) {
+
+      // Wait for the slave
+      int delay = SPIN_BACKOFF_MIN, spins = 0;
+      while (atomic_load_explicit(discovery_bar_flag(gl_ctx, peer_block), memory_order_relaxed, memory_scope_device) != BAR_FLAG_ARRIVED) {
+        delay = spin_backoff(delay);
+        spins++;
+      }
+      discovery_stats_wait(gl_ctx, id, spins);
+
+      // Synchronise
+      atomic_work_item_fence(CLK_GLOBAL_MEM_FENCE, memory_order_acquire, memory_scope_device);
+    }
+
+    // Wait for all slaves
+    barrier(CLK_LOCAL_MEM_FENCE | CLK_GLOBAL_MEM_FENCE);
+
+    for (int peer_block = discovery_local_id() + 1;
+         peer_block < p_get_num_groups(gl_ctx, local_ctx);
+         peer_block += discovery_local_size()) {
+
+      // Release slaves
+      atomic_store_explicit(discovery_bar_flag(gl_ctx, peer_block), 0, memory_order_release, memory_scope_device);
+    }
+  }
+
+  // Slave workgroups go here
+  else {
+
+    // One rep per slave waits to be released by the master
+    if (discovery_local_id() == 0) {
+      int delay = SPIN_BACKOFF_MIN, spins = 0;
+      while (atomic_load_explicit(discovery_bar_flag(gl_ctx, id), memory_order_relaxed, memory_scope_device) == BAR_FLAG_ARRIVED) {
+        delay = spin_backoff(delay);
+        spins++;
+      }
+      discovery_stats_wait(gl_ctx, id, spins);
+
+      // Synchronise
+      atomic_work_item_fence(CLK_GLOBAL_MEM_FENCE, memory_order_acquire, memory_scope_device);
+    }
+  }
+
+  // All threads are released here
+  barrier(CLK_LOCAL_MEM_FENCE | CLK_GLOBAL_MEM_FENCE);
+
+  discovery_trace(gl_ctx, local_ctx, DISCOVERY_TRACE_BARRIER_RELEASE);
+  discovery_stats_barrier(gl_ctx, id == 0);
+}
+
+// A variant of the XF barrier that releases the slaves by advancing a
+// shared epoch instead of resetting each flag. The master consumes the
+// arrivals (leaving the flags as XF_barrier leaves them) and, while
+// every group is held at the barrier, sets *reset to 0 if reset is not
+// NULL. Nothing may race with that store: every group has finished the
+// previous phase and none has started the next. This lets a worklist
+// be emptied for reuse without a second barrier. Returns the number of
+// epoch barriers completed since the context was initialised.
+int XF_epoch_barrier(__global discovery_kernel_ctx *gl_ctx, __local discovery_local_ctx *local_ctx, __global int *reset) {
+
+  int id = p_get_group_id(gl_ctx, local_ctx);
+
+  discovery_trace(gl_ctx, local_ctx, DISCOVERY_TRACE_BARRIER_ARRIVE);
+
   // This barrier actually isn't needed but some GPUs crash if it
   // isn't included (!!)
   barrier(CLK_LOCAL_MEM_FENCE | CLK_GLOBAL_MEM_FENCE);
@@ -138,26 +642,37 @@ void XF_barrier(__global discovery_kernel_ctx *gl_ctx, __local discovery_local_c
   if (id == 0) {
 
     // Each thread in master is responsible for distinct slave(s)
-    for (int peer_block = get_local_id(0) + 1;
+    for (int peer_block = discovery_local_id() + 1;
          peer_block < p_get_num_groups(gl_ctx, local_ctx);
-         peer_block += get_local_size(0)) {
+         peer_block += discovery_local_size()) {
 
       // Wait for the slave
-      while (atomic_load_explicit(&(gl_ctx->bar_flags[peer_block]), memory_order_relaxed, memory_scope_device) == 0);
+      int delay = SPIN_BACKOFF_MIN, spins = 0;
+      while (atomic_load_explicit(discovery_bar_flag(gl_ctx, peer_block), memory_order_relaxed, memory_scope_device) != BAR_FLAG_ARRIVED) {
+        delay = spin_backoff(delay);
+        spins++;
+      }
+      discovery_stats_wait(gl_ctx, id, spins);
 
       // Synchronise
       atomic_work_item_fence(CLK_GLOBAL_MEM_FENCE, memory_order_acquire, memory_scope_device);
+
+      // Consume the arrival. The slave cannot arrive again until it
+      // has been released below.
+      atomic_store_explicit(discovery_bar_flag(gl_ctx, peer_block), 0, memory_order_relaxed, memory_scope_device);
     }
 
     // Wait for all slaves
     barrier(CLK_LOCAL_MEM_FENCE | CLK_GLOBAL_MEM_FENCE);
 
-    for (int peer_block = get_local_id(0) + 1;
-         peer_block < p_get_num_groups(gl_ctx, local_ctx);
-         peer_block += get_local_size(0)) {
+    if (discovery_local_id() == 0) {
+
+      if (reset != NULL) {
+        *reset = 0;
+      }
 
       // Release slaves
-      atomic_store_explicit(&(gl_ctx->bar_flags[peer_block]), 0, memory_order_release, memory_scope_device);
+      local_ctx->epoch = atomic_fetch_add_explicit(&(gl_ctx->bar_epoch), 1, memory_order_release, memory_scope_device) + 1;
     }
   }
 
@@ -168,60 +683,637 @@ void XF_barrier(__global discovery_kernel_ctx *gl_ctx, __local discovery_local_c
     barrier(CLK_LOCAL_MEM_FENCE | CLK_GLOBAL_MEM_FENCE);
 
     // One rep per slave
-    if (get_local_id(0) == 0) {
+    if (discovery_local_id() == 0) {
+
+      // The epoch cannot advance until this slave has arrived
+      int epoch = atomic_load_explicit(&(gl_ctx->bar_epoch), memory_order_relaxed, memory_scope_device);
 
       // Mark arrival
-      atomic_store_explicit(&(gl_ctx->bar_flags[id]), 1, memory_order_release, memory_scope_device);
+      atomic_store_explicit(discovery_bar_flag(gl_ctx, id), BAR_FLAG_ARRIVED, memory_order_release, memory_scope_device);
 
       // Wait to be released by the master
-      while (atomic_load_explicit(&(gl_ctx->bar_flags[id]), memory_order_relaxed, memory_scope_device) == 1);
+      int delay = SPIN_BACKOFF_MIN, spins = 0;
+      while (atomic_load_explicit(&(gl_ctx->bar_epoch), memory_order_relaxed, memory_scope_device) == epoch) {
+        delay = spin_backoff(delay);
+        spins++;
+      }
+      discovery_stats_wait(gl_ctx, id, spins);
 
       // Synchronise
       atomic_work_item_fence(CLK_GLOBAL_MEM_FENCE, memory_order_acquire, memory_scope_device);
+
+      local_ctx->epoch = epoch + 1;
     }
+  }
 
-    // All threads per slave are released here
+  // All threads are released here
+  barrier(CLK_LOCAL_MEM_FENCE | CLK_GLOBAL_MEM_FENCE);
+
+  discovery_trace(gl_ctx, local_ctx, DISCOVERY_TRACE_BARRIER_RELEASE);
+  discovery_stats_barrier(gl_ctx, id == 0);
+
+  return local_ctx->epoch;
+}
+
+// Operators for discovery_barrier_reduce
+#define DISCOVERY_REDUCE_SUM 0
+#define DISCOVERY_REDUCE_MIN 1
+#define DISCOVERY_REDUCE_MAX 2
+#define DISCOVERY_REDUCE_OR 3
+
+// The identity of reduction operator `op`
+int discovery_reduce_identity(int op) {
+  switch (op) {
+  case DISCOVERY_REDUCE_MIN:
+    return INT_MAX;
+  case DISCOVERY_REDUCE_MAX:
+    return INT_MIN;
+  default:
+    return 0;
+  }
+}
+
+// Combines `value` into a local memory location with operator `op`
+void discovery_reduce_local(int op, __local volatile int *target, int value) {
+  switch (op) {
+  case DISCOVERY_REDUCE_SUM:
+    atomic_add(target, value);
+    break;
+  case DISCOVERY_REDUCE_MIN:
+    atomic_min(target, value);
+    break;
+  case DISCOVERY_REDUCE_MAX:
+    atomic_max(target, value);
+    break;
+  case DISCOVERY_REDUCE_OR:
+    atomic_or(target, value);
+    break;
+  }
+}
+
+// The XF barrier with a reduction across all threads of all
+// participating groups fused into it. Each thread passes a value,
+// which is combined with operator `op` (e.g. DISCOVERY_REDUCE_OR), and
+// the result is returned to every thread once all groups have arrived.
+// Each slave combines its group's values in local memory and publishes
+// the result alongside its barrier flag. The master combines those
+// while waiting for the slaves and hands the global result back in the
+// same place when releasing them. Uses the XF barrier structure
+// whichever barrier discovery_barrier is, and may be mixed with it.
+int XF_reduce_barrier(__global discovery_kernel_ctx *gl_ctx, __local discovery_local_ctx *local_ctx, int value, int op) {
+
+  int id = p_get_group_id(gl_ctx, local_ctx);
+
+  discovery_trace(gl_ctx, local_ctx, DISCOVERY_TRACE_BARRIER_ARRIVE);
+
+  // Also stops the previous result being overwritten while
+  // some threads are still reading it
+  barrier(CLK_LOCAL_MEM_FENCE | CLK_GLOBAL_MEM_FENCE);
+
+  if (discovery_local_id() == 0) {
+    local_ctx->reduce_value = discovery_reduce_identity(op);
+  }
+  barrier(CLK_LOCAL_MEM_FENCE);
+
+  // Combine the values of the workgroup
+  discovery_reduce_local(op, &(local_ctx->reduce_value), value);
+
+  // Master workgroup goes here
+  if (id == 0) {
+
+    // Each thread in master is responsible for distinct slave(s)
+    for (int peer_block = discovery_local_id() + 1;
+         peer_block < p_get_num_groups(gl_ctx, local_ctx);
+         peer_block += discovery_local_size()) {
+
+      // Wait for the slave
+      int delay = SPIN_BACKOFF_MIN, spins = 0;
+      while (atomic_load_explicit(discovery_bar_flag(gl_ctx, peer_block), memory_order_relaxed, memory_scope_device) != BAR_FLAG_ARRIVED) {
+        delay = spin_backoff(delay);
+        spins++;
+      }
+      discovery_stats_wait(gl_ctx, id, spins);
+
+      // Synchronise
+      atomic_work_item_fence(CLK_GLOBAL_MEM_FENCE, memory_order_acquire, memory_scope_device);
+
+      // Combine the value of the slave
+      discovery_reduce_local(op, &(local_ctx->reduce_value), atomic_load_explicit(discovery_group_entry(gl_ctx, DISCOVERY_BAR_VALUES, peer_block), memory_order_relaxed, memory_scope_device));
+    }
+
+    // Wait for all slaves
     barrier(CLK_LOCAL_MEM_FENCE | CLK_GLOBAL_MEM_FENCE);
+
+    int result = local_ctx->reduce_value;
+
+    for (int peer_block = discovery_local_id() + 1;
+         peer_block < p_get_num_groups(gl_ctx, local_ctx);
+         peer_block += discovery_local_size()) {
+
+      // Hand the result to the slave and release it
+      atomic_store_explicit(discovery_group_entry(gl_ctx, DISCOVERY_BAR_VALUES, peer_block), result, memory_order_relaxed, memory_scope_device);
+      atomic_store_explicit(discovery_bar_flag(gl_ctx, peer_block), 0, memory_order_release, memory_scope_device);
+    }
   }
 
+  // Slave workgroups go here
+  else {
+
+    // All threads per slave sync here
+    barrier(CLK_LOCAL_MEM_FENCE | CLK_GLOBAL_MEM_FENCE);
+
+    // One rep per slave
+    if (discovery_local_id() == 0) {
+
+      // Publish the value of the workgroup and mark arrival
+      atomic_store_explicit(discovery_group_entry(gl_ctx, DISCOVERY_BAR_VALUES, id), local_ctx->reduce_value, memory_order_relaxed, memory_scope_device);
+      atomic_store_explicit(discovery_bar_flag(gl_ctx, id), BAR_FLAG_ARRIVED, memory_order_release, memory_scope_device);
+
+      // Wait to be released by the master
+      int delay = SPIN_BACKOFF_MIN, spins = 0;
+      while (atomic_load_explicit(discovery_bar_flag(gl_ctx, id), memory_order_relaxed, memory_scope_device) == BAR_FLAG_ARRIVED) {
+        delay = spin_backoff(delay);
+        spins++;
+      }
+      discovery_stats_wait(gl_ctx, id, spins);
+
+      // Synchronise
+      atomic_work_item_fence(CLK_GLOBAL_MEM_FENCE, memory_order_acquire, memory_scope_device);
+
+      local_ctx->reduce_value = atomic_load_explicit(discovery_group_entry(gl_ctx, DISCOVERY_BAR_VALUES, id), memory_order_relaxed, memory_scope_device);
+    }
+  }
+
+  // All threads are released here with the result
+  barrier(CLK_LOCAL_MEM_FENCE | CLK_GLOBAL_MEM_FENCE);
+
+  discovery_trace(gl_ctx, local_ctx, DISCOVERY_TRACE_BARRIER_RELEASE);
+  discovery_stats_barrier(gl_ctx, id == 0);
+
+  return local_ctx->reduce_value;
+}
+
+// Fan-in of the combining-tree barrier
+#ifndef BAR_TREE_ARITY
+#define BAR_TREE_ARITY 4
+#endif
+
+// A combining-tree implementation of the inter-workgroup barrier. The
+// participating groups form a BAR_TREE_ARITY-ary tree rooted at group
+// 0. A group waits for its children to arrive before marking its own
+// arrival, and releases its children once its parent has released it.
+// Latency grows with the depth of the tree rather than the number of
+// participating groups, and no single group polls every flag.
+void tree_barrier(__global discovery_kernel_ctx *gl_ctx, __local discovery_local_ctx *local_ctx) {
+
+  int id = p_get_group_id(gl_ctx, local_ctx);
+  int first_child = id * BAR_TREE_ARITY + 1;
+  int last_child = min(first_child + BAR_TREE_ARITY, p_get_num_groups(gl_ctx, local_ctx));
+
+  discovery_trace(gl_ctx, local_ctx, DISCOVERY_TRACE_BARRIER_ARRIVE);
+
   // This barrier actually isn't needed but some GPUs crash if it
   // isn't included (!!)
   barrier(CLK_LOCAL_MEM_FENCE | CLK_GLOBAL_MEM_FENCE);
+
+  // Each thread is responsible for distinct child(ren)
+  for (int child = first_child + discovery_local_id();
+       child < last_child;
+       child += discovery_local_size()) {
+
+    // Wait for the child (and so its whole subtree)
+    int delay = SPIN_BACKOFF_MIN, spins = 0;
+    while (atomic_load_explicit(discovery_bar_flag(gl_ctx, child), memory_order_relaxed, memory_scope_device) != BAR_FLAG_ARRIVED) {
+      delay = spin_backoff(delay);
+      spins++;
+    }
+    discovery_stats_wait(gl_ctx, id, spins);
+
+    // Synchronise
+    atomic_work_item_fence(CLK_GLOBAL_MEM_FENCE, memory_order_acquire, memory_scope_device);
+  }
+
+  // Wait for all children
+  barrier(CLK_LOCAL_MEM_FENCE | CLK_GLOBAL_MEM_FENCE);
+
+  // One rep per non-root group
+  if (id != 0 && discovery_local_id() == 0) {
+
+    // Mark arrival of the subtree
+    atomic_store_explicit(discovery_bar_flag(gl_ctx, id), BAR_FLAG_ARRIVED, memory_order_release, memory_scope_device);
+
+    // Wait to be released by the parent
+    int delay = SPIN_BACKOFF_MIN, spins = 0;
+    while (atomic_load_explicit(discovery_bar_flag(gl_ctx, id), memory_order_relaxed, memory_scope_device) == BAR_FLAG_ARRIVED) {
+      delay = spin_backoff(delay);
+      spins++;
+    }
+    discovery_stats_wait(gl_ctx, id, spins);
+
+    // Synchronise
+    atomic_work_item_fence(CLK_GLOBAL_MEM_FENCE, memory_order_acquire, memory_scope_device);
+  }
+
+  // All threads of the group are released here
+  barrier(CLK_LOCAL_MEM_FENCE | CLK_GLOBAL_MEM_FENCE);
+
+  for (int child = first_child + discovery_local_id();
+       child < last_child;
+       child += discovery_local_size()) {
+
+    // Release children
+    atomic_store_explicit(discovery_bar_flag(gl_ctx, child), 0, memory_order_release, memory_scope_device);
+  }
+
+  // This barrier actually isn't needed but some GPUs crash if it
+  // isn't included (!!)
+  barrier(CLK_LOCAL_MEM_FENCE | CLK_GLOBAL_MEM_FENCE);
+
+  discovery_trace(gl_ctx, local_ctx, DISCOVERY_TRACE_BARRIER_RELEASE);
+  discovery_stats_barrier(gl_ctx, id == 0);
 }
 
-// Explicitly initialise the discovery_kernel_ctx. Should only be
-// needed for the very first time the protocol is used.
-__kernel void init_discovery_kernel_ctx(__global discovery_kernel_ctx *gl_ctx, int skip) {
+/*
+  Guided scheduler. Instead of each thread taking every
+  p_get_global_size-th item, groups repeatedly claim chunks of
+  consecutive items from a shared counter. A chunk is a share of the
+  remaining items (1 / (DISCOVERY_SCHED_FACTOR * groups)), so chunks
+  shrink as the loop runs out and groups that hit expensive items (e.g.
+  hub vertices) are not left with a fixed share of the rest.
+*/
 
-  reset_kernel_context(gl_ctx);
-  gl_ctx->skip = skip;
+#ifndef DISCOVERY_SCHED_FACTOR
+#define DISCOVERY_SCHED_FACTOR 2
+#endif
+
+// Smallest chunk, in multiples of the workgroup size
+#ifndef DISCOVERY_SCHED_MIN_CHUNK
+#define DISCOVERY_SCHED_MIN_CHUNK 1
+#endif
+
+// Claims the next chunk of the `n` items for the calling group into
+// local_ctx->sched_start and sched_end. Returns 0 once the items are
+// exhausted. Must be called by all threads of the group.
+int discovery_sched_next(__global discovery_kernel_ctx *gl_ctx, __local discovery_local_ctx *local_ctx, int n) {
+
+  // Every thread has finished with the previous chunk
+  barrier(CLK_LOCAL_MEM_FENCE);
+
+  if (discovery_local_id() == 0) {
+    int block = discovery_local_size();
+    int remaining = n - atomic_load_explicit(&(gl_ctx->sched_next), memory_order_relaxed, memory_scope_device);
+    int chunk = max(remaining / (DISCOVERY_SCHED_FACTOR * p_get_num_groups(gl_ctx, local_ctx)), DISCOVERY_SCHED_MIN_CHUNK * block);
+
+    // Whole blocks keep every thread of the group busy
+    chunk = (chunk + block - 1) / block * block;
+
+    int start = atomic_fetch_add_explicit(&(gl_ctx->sched_next), chunk, memory_order_relaxed, memory_scope_device);
+    local_ctx->sched_start = start;
+    local_ctx->sched_end = min(start + chunk, n);
+
+    // The last group to finish the loop resets the scheduler for the
+    // next one. No group claims chunks of this loop afterwards.
+    if (start >= n) {
+      if (atomic_fetch_add_explicit(&(gl_ctx->sched_done), 1, memory_order_relaxed, memory_scope_device) == p_get_num_groups(gl_ctx, local_ctx) - 1) {
+        atomic_store_explicit(&(gl_ctx->sched_next), 0, memory_order_relaxed, memory_scope_device);
+        atomic_store_explicit(&(gl_ctx->sched_done), 0, memory_order_relaxed, memory_scope_device);
+      }
+    }
+  }
+
+  barrier(CLK_LOCAL_MEM_FENCE);
+
+  return local_ctx->sched_start < n;
+}
+
+/*
+  Shared phase. Groups that lose the discovery poll have been resident
+  all the same, so instead of exiting at once they help with a phase
+  that needs no inter-workgroup barrier, such as initialising the
+  arrays used by the rest of the kernel. Every launched group claims
+  chunks of the phase's items from a shared counter, then
+  non-participating groups exit and participating groups wait for
+  every item to be completed. A kernel may have one shared phase, run
+  straight after DISCOVERY_PROTOCOL_SHARED (see the macros below).
+*/
 
-  for (int i = 0; i < BAR_FLAG_SIZE; i++) {
-    atomic_store_explicit(&(gl_ctx->bar_flags[i]), 0, memory_order_relaxed, memory_scope_device);
+// Chunk claimed at a time, in multiples of the workgroup size. The
+// number of groups taking part is not known, so the size is fixed.
+#ifndef DISCOVERY_SHARED_CHUNK
+#define DISCOVERY_SHARED_CHUNK 4
+#endif
+
+// Prepares the calling group for discovery_shared_next
+void discovery_shared_begin(__local discovery_local_ctx *local_ctx) {
+  if (discovery_local_id() == 0) {
+    local_ctx->sched_start = 0;
+    local_ctx->sched_end = 0;
   }
 }
 
+// Completes the calling group's previous chunk of the shared phase and
+// claims the next one of the `n` items into local_ctx->sched_start and
+// sched_end. Returns 0 once the items are exhausted. Must be called by
+// all threads of the group, whether it participates or not.
+int discovery_shared_next(__global discovery_kernel_ctx *gl_ctx, __local discovery_local_ctx *local_ctx, int n) {
+
+  // Every thread has finished with the previous chunk
+  barrier(CLK_LOCAL_MEM_FENCE | CLK_GLOBAL_MEM_FENCE);
+
+  if (discovery_local_id() == 0) {
+    int completed = local_ctx->sched_end - local_ctx->sched_start;
+    if (completed > 0) {
+      atomic_fetch_add_explicit(&(gl_ctx->shared_done), completed, memory_order_release, memory_scope_device);
+    }
+
+    int chunk = DISCOVERY_SHARED_CHUNK * discovery_local_size();
+    int start = atomic_fetch_add_explicit(&(gl_ctx->shared_next), chunk, memory_order_relaxed, memory_scope_device);
+    local_ctx->sched_start = min(start, n);
+    local_ctx->sched_end = min(start + chunk, n);
+  }
+
+  barrier(CLK_LOCAL_MEM_FENCE);
+
+  return local_ctx->sched_start < local_ctx->sched_end;
+}
+
+// Ends the shared phase of `n` items for the calling group. A
+// participating group waits until every item has been completed, by
+// any launched group. The last launched group to get here resets the
+// phase for the next kernel.
+void discovery_shared_end(__global discovery_kernel_ctx *gl_ctx, __local discovery_local_ctx *local_ctx, int n) {
+  if (discovery_local_id() == 0) {
+    if (local_ctx->is_participating) {
+      int delay = SPIN_BACKOFF_MIN;
+      while (atomic_load_explicit(&(gl_ctx->shared_done), memory_order_acquire, memory_scope_device) < n) {
+        delay = spin_backoff(delay);
+      }
+    }
+
+    if (atomic_fetch_add_explicit(&(gl_ctx->shared_exit), 1, memory_order_acq_rel, memory_scope_device) == discovery_num_groups() - 1) {
+      atomic_store_explicit(&(gl_ctx->shared_next), 0, memory_order_relaxed, memory_scope_device);
+      atomic_store_explicit(&(gl_ctx->shared_done), 0, memory_order_relaxed, memory_scope_device);
+      atomic_store_explicit(&(gl_ctx->shared_exit), 0, memory_order_relaxed, memory_scope_device);
+    }
+  }
+
+  barrier(CLK_LOCAL_MEM_FENCE | CLK_GLOBAL_MEM_FENCE);
+}
+
+// Initialises the discovery_kernel_ctx and its per-group arrays in a
+// buffer of `size` ints for `capacity` participating groups. If the
+// per-group arrays of this build do not fit in the buffer for that
+// many groups, the host laid it out with other options; the capacity
+// is then cut to what fits, which the host reports as an error (see
+// init_discovery_kernel_ctx_capacity in discovery.h). Work-item `item`
+// of the `items` doing the initialisation zeroes every items-th entry.
+void discovery_init_kernel_ctx(__global discovery_kernel_ctx *gl_ctx, int skip, int size, int capacity, int item, int items) {
+
+  capacity = min(capacity, max(size - (int) BAR_FLAG_OFFSET, 0) / DISCOVERY_GROUP_INTS);
+
+  if (item == 0) {
+    reset_kernel_context(gl_ctx);
+    gl_ctx->skip = skip;
+    gl_ctx->capacity = capacity;
+    atomic_store_explicit(&(gl_ctx->bar_epoch), 0, memory_order_relaxed, memory_scope_device);
+    atomic_store_explicit(&(gl_ctx->trace_clock), 0, memory_order_relaxed, memory_scope_device);
+    atomic_store_explicit(&(gl_ctx->stat_barriers), 0, memory_order_relaxed, memory_scope_device);
+    atomic_store_explicit(&(gl_ctx->stat_barrier_spins), 0, memory_order_relaxed, memory_scope_device);
+    atomic_store_explicit(&(gl_ctx->stat_max_barrier_spins), 0, memory_order_relaxed, memory_scope_device);
+    atomic_store_explicit(&(gl_ctx->stat_lock_spins), 0, memory_order_relaxed, memory_scope_device);
+    atomic_store_explicit(&(gl_ctx->sched_next), 0, memory_order_relaxed, memory_scope_device);
+    atomic_store_explicit(&(gl_ctx->sched_done), 0, memory_order_relaxed, memory_scope_device);
+    atomic_store_explicit(&(gl_ctx->shared_next), 0, memory_order_relaxed, memory_scope_device);
+    atomic_store_explicit(&(gl_ctx->shared_done), 0, memory_order_relaxed, memory_scope_device);
+    atomic_store_explicit(&(gl_ctx->shared_exit), 0, memory_order_relaxed, memory_scope_device);
+  }
+
+  // The entries of all per-group arrays are zeroed. They are indexed
+  // directly as gl_ctx->capacity is being set by another work-item.
+  for (int i = item; i < DISCOVERY_GROUP_ARRAYS * capacity; i += items) {
+    atomic_store_explicit((__global ATOMIC_INT_TYPE *) gl_ctx + BAR_FLAG_OFFSET + i * BAR_FLAG_STRIDE, 0, memory_order_relaxed, memory_scope_device);
+  }
+
+#ifdef DISCOVERY_TRACE
+  // So are the event counts of the trace buffers
+  __global INT_TYPE *traces = (__global INT_TYPE *) gl_ctx + BAR_FLAG_OFFSET + DISCOVERY_GROUP_ARRAYS * capacity * BAR_FLAG_STRIDE;
+  for (int i = item; i < capacity; i += items) {
+    traces[i * DISCOVERY_TRACE_GROUP_INTS] = 0;
+  }
+#endif
+}
+
+// Explicitly initialise the discovery_kernel_ctx and its per-group
+// arrays. Should only be needed for the very first time the protocol
+// is used. `size` is the size of the buffer in ints and `capacity` the
+// number of participating groups it holds.
+// Any number of work-items may be launched; the groups are shared out
+// between them.
+__kernel void init_discovery_kernel_ctx(__global discovery_kernel_ctx *gl_ctx, int skip, int size, int capacity) {
+  discovery_init_kernel_ctx(gl_ctx, skip, size, capacity, get_global_id(0), get_global_size(0));
+}
+
+// Initialises a pool of discovery_kernel_ctx objects stored one after
+// the other, every `slot_size` ints, in a single buffer (see
+// discovery_ctx_pool in discovery.h). Launched in 2D: dimension 1
+// selects the slot, dimension 0 shares out the work within it.
+__kernel void init_discovery_kernel_ctx_pool(__global INT_TYPE *pool, int skip, int slot_size, int capacity) {
+  __global discovery_kernel_ctx *gl_ctx = (__global discovery_kernel_ctx *) (pool + get_global_id(1) * slot_size);
+  discovery_init_kernel_ctx(gl_ctx, skip, slot_size, capacity, get_global_id(0), get_global_size(0));
+}
+
 /*
   Macros for the discovery protocol and barrier
  */
 
-// Use #define in case another barrier wants to be experimented with
+// Use #define in case another barrier wants to be experimented with.
+// Compile with -DTREE_BARRIER to use the combining-tree barrier.
+#if defined(TREE_BARRIER)
+#define discovery_barrier(gl_ctx, local_ctx) tree_barrier(gl_ctx, local_ctx)
+#else
 #define discovery_barrier(gl_ctx, local_ctx) XF_barrier(gl_ctx, local_ctx)
+#endif
+
+// Barrier over the team of the calling group (see discovery_team_init).
+// May be mixed with discovery_barrier.
+#define discovery_team_barrier(gl_ctx, local_ctx) XF_team_barrier(gl_ctx, local_ctx)
+
+// Split-phase barrier (see XF_barrier_arrive). Every arrive must be
+// followed by a wait before the next barrier.
+#define discovery_barrier_arrive(gl_ctx, local_ctx) XF_barrier_arrive(gl_ctx, local_ctx)
+#define discovery_barrier_wait(gl_ctx, local_ctx) XF_barrier_wait(gl_ctx, local_ctx)
 
-// The high level protocol that runs the discovery protocol and
-// forces non participating groups to exit.
+// Barrier that also sets *reset to 0 while all groups are held (see
+// XF_epoch_barrier). May be mixed with discovery_barrier.
+#define discovery_epoch_barrier(gl_ctx, local_ctx, reset) XF_epoch_barrier(gl_ctx, local_ctx, reset)
+
+// Barrier that combines a value from every thread with `op` and
+// returns the result to all of them (see XF_reduce_barrier)
+#define discovery_barrier_reduce(gl_ctx, local_ctx, value, op) XF_reduce_barrier(gl_ctx, local_ctx, value, op)
+
+// Loops `i` over the items 0 to n - 1, sharing them out between the
+// threads of all participating groups. Replaces
+//   for (int i = p_get_global_id(...); i < n; i += p_get_global_size(...))
+// With -DDISCOVERY_GUIDED_SCHEDULE, groups claim chunks of items from
+// the guided scheduler (see discovery_sched_next): every participating
+// group must then run the loop, with all its threads, and consecutive
+// loops must be separated by a barrier. Otherwise the loop is the
+// static one above.
+#if defined(DISCOVERY_GUIDED_SCHEDULE)
+#define DISCOVERY_FOR_EACH(gl_ctx, local_ctx, i, n)                     \
+  while (discovery_sched_next(gl_ctx, local_ctx, n))                    \
+    for (int i = (local_ctx)->sched_start + discovery_local_id();       \
+         i < (local_ctx)->sched_end;                                    \
+         i += discovery_local_size())
+#else
+#define DISCOVERY_FOR_EACH(gl_ctx, local_ctx, i, n)                     \
+  for (int i = p_get_global_id(gl_ctx, local_ctx);                      \
+       i < (n);                                                         \
+       i += p_get_global_size(gl_ctx, local_ctx))
+#endif
+
+// The high level protocol that decides which groups participate, as
+// chosen by DISCOVERY_MODE (see common.h), and forces non participating
+// groups to exit. In DISCOVER mode, kernels built with
+// -DDISCOVERY_RUNTIME_SKIP also check the skip flag of the context so
+// that the occupancy tests can skip the protocol without a rebuild.
+//
+// DISCOVERY_PROTOCOL_SHARED decides the same way but keeps non
+// participating groups for a shared phase, which must follow it:
+//   DISCOVERY_PROTOCOL_SHARED(gl_ctx);
+//   DISCOVERY_SHARED_FOR_EACH(gl_ctx, &local_ctx, i, n) { ... }
+//   DISCOVERY_SHARED_END(gl_ctx, &local_ctx, n);
+// after which only participating groups remain.
+#if defined(DISCOVERY_RUNTIME_SKIP) && DISCOVERY_MODE != DISCOVERY_MODE_DISCOVER
+#error "DISCOVERY_RUNTIME_SKIP needs DISCOVERY_MODE_DISCOVER"
+#endif
+
+#if DISCOVERY_MODE == DISCOVERY_MODE_SKIP
+#define DISCOVERY_PROTOCOL_SHARED(gl_ctx)                               \
+  __local discovery_local_ctx local_ctx;                                \
+  discovery_fixed_protocol(gl_ctx, &local_ctx, discovery_num_groups());
+#define DISCOVERY_PROTOCOL(gl_ctx) DISCOVERY_PROTOCOL_SHARED(gl_ctx)
+#elif DISCOVERY_MODE == DISCOVERY_MODE_FIXED
+#define DISCOVERY_PROTOCOL_SHARED(gl_ctx)                               \
+  __local discovery_local_ctx local_ctx;                                \
+  discovery_fixed_protocol(gl_ctx, &local_ctx, DISCOVERY_FIXED_GROUPS);
 #define DISCOVERY_PROTOCOL(gl_ctx)                                      \
+  __local discovery_local_ctx local_ctx;                                \
+  if (!discovery_fixed_protocol(gl_ctx, &local_ctx, DISCOVERY_FIXED_GROUPS)) { \
+    return;                                                             \
+  }
+#elif defined(DISCOVERY_RUNTIME_SKIP)
+#define DISCOVERY_PROTOCOL_SHARED(gl_ctx)                               \
   __local discovery_local_ctx local_ctx;                                \
   if (gl_ctx->skip) {                                                   \
-    local_ctx.participating_group_size = get_num_groups(0);             \
-    local_ctx.is_participating = 1;                                     \
-    local_ctx.participating_group_id = get_group_id(0);                 \
-    gl_ctx->num_participating = get_num_groups(0);                      \
+    discovery_fixed_protocol(gl_ctx, &local_ctx, discovery_num_groups()); \
   }                                                                     \
   else {                                                                \
     discovery_protocol(gl_ctx, &local_ctx);                             \
-    if (!is_participating(gl_ctx, &local_ctx)) {                        \
-      return;                                                           \
-    }                                                                   \
-  }                                                                     \
-  
+  }
+#define DISCOVERY_PROTOCOL(gl_ctx)                                      \
+  DISCOVERY_PROTOCOL_SHARED(gl_ctx)                                     \
+  if (!is_participating(gl_ctx, &local_ctx)) {                          \
+    return;                                                             \
+  }
+#else
+#define DISCOVERY_PROTOCOL_SHARED(gl_ctx)                               \
+  __local discovery_local_ctx local_ctx;                                \
+  discovery_protocol(gl_ctx, &local_ctx);
+#define DISCOVERY_PROTOCOL(gl_ctx)                                      \
+  DISCOVERY_PROTOCOL_SHARED(gl_ctx)                                     \
+  if (!is_participating(gl_ctx, &local_ctx)) {                          \
+    return;                                                             \
+  }
+#endif
+
+// Loops `i` over the items 0 to n - 1 of the shared phase, sharing them
+// out between the threads of all launched groups
+#define DISCOVERY_SHARED_FOR_EACH(gl_ctx, local_ctx, i, n)              \
+  for (discovery_shared_begin(local_ctx); discovery_shared_next(gl_ctx, local_ctx, n); ) \
+    for (int i = (local_ctx)->sched_start + discovery_local_id();       \
+         i < (local_ctx)->sched_end;                                    \
+         i += discovery_local_size())
+
+// Ends the shared phase and makes non participating groups exit
+#define DISCOVERY_SHARED_END(gl_ctx, local_ctx, n)                      \
+  discovery_shared_end(gl_ctx, local_ctx, n);                           \
+  if (!is_participating(gl_ctx, local_ctx)) {                           \
+    return;                                                             \
+  }
+
+/*
+  Server mode. A persistent kernel keeps its participating groups
+  resident and serves commands the host submits to a
+  discovery_command_ring (see common.h and discovery_server_submit in
+  discovery.h), so that a query costs a push to the ring instead of a
+  kernel launch and a run of the protocol. Only the representative
+  thread of group 0 polls the ring, which lives in host memory; the
+  other groups wait at a barrier. The ring must be fine-grained SVM
+  with atomics, so server mode needs OpenCL 2.0 atomics.
+*/
+
+#ifndef CUSTOM_ATOMICS
+
+// Index of the first command the kernel serves: the commands of
+// previous kernels using the ring have all completed
+int discovery_server_first(__global discovery_command_ring *ring) {
+  return atomic_load_explicit(&(ring->tail), memory_order_acquire, memory_scope_all_svm_devices);
+}
+
+// Waits for command `index` and copies it into *cmd. Returns 0 if it is
+// DISCOVERY_SERVER_STOP, in which case it is also completed. Must be
+// called by all threads of every participating group.
+int discovery_server_next(__global discovery_kernel_ctx *gl_ctx, __local discovery_local_ctx *local_ctx, __global discovery_command_ring *ring, int index, discovery_command *cmd) {
+  int id = p_get_group_id(gl_ctx, local_ctx);
+
+  if (id == 0 && discovery_local_id() == 0) {
+    int delay = SPIN_BACKOFF_MIN;
+    while (atomic_load_explicit(&(ring->head), memory_order_acquire, memory_scope_all_svm_devices) == index) {
+      delay = spin_backoff(delay);
+    }
+  }
+
+  discovery_barrier(gl_ctx, local_ctx);
+
+  // The barrier orders the command after group 0's poll at device
+  // scope; the host wrote it at system scope
+  atomic_work_item_fence(CLK_GLOBAL_MEM_FENCE, memory_order_acquire, memory_scope_all_svm_devices);
+  *cmd = ring->commands[index % DISCOVERY_SERVER_RING_SIZE];
+
+  if (cmd->type != DISCOVERY_SERVER_STOP) {
+    return 1;
+  }
+
+  // Every group has read the command before its entry is handed back
+  discovery_barrier(gl_ctx, local_ctx);
+  if (id == 0 && discovery_local_id() == 0) {
+    atomic_store_explicit(&(ring->tail), index + 1, memory_order_release, memory_scope_all_svm_devices);
+  }
+  return 0;
+}
+
+// Completes command `index` once every participating group has
+// finished it, making the results written by the kernel visible to the
+// host. Must be called by all threads of every participating group.
+void discovery_server_complete(__global discovery_kernel_ctx *gl_ctx, __local discovery_local_ctx *local_ctx, __global discovery_command_ring *ring, int index) {
+  atomic_work_item_fence(CLK_GLOBAL_MEM_FENCE, memory_order_release, memory_scope_all_svm_devices);
+
+  discovery_barrier(gl_ctx, local_ctx);
+
+  if (p_get_group_id(gl_ctx, local_ctx) == 0 && discovery_local_id() == 0) {
+    atomic_store_explicit(&(ring->tail), index + 1, memory_order_release, memory_scope_all_svm_devices);
+  }
+}
+
+// Serves the commands of `ring` until DISCOVERY_SERVER_STOP, running
+// the statement that follows for each with the command in `cmd` (a
+// discovery_command). The statement must not return or break out of
+// the loop, and is followed by a barrier, so one command's phases are
+// separated from the next command's.
+#define DISCOVERY_SERVE(gl_ctx, local_ctx, ring, cmd)                   \
+  for (int discovery_server_index = discovery_server_first(ring);       \
+       discovery_server_next(gl_ctx, local_ctx, ring, discovery_server_index, &(cmd)); \
+       discovery_server_complete(gl_ctx, local_ctx, ring, discovery_server_index++))
+
+#endif
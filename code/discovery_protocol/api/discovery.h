@@ -3,61 +3,305 @@
 
 #pragma once
 
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stddef.h>
+#include <unistd.h>
+
 #include "common.h"
 
-// This function initialises the discovery_kernel_ctx object for regular use.
-// Should be called before a kernel using the discovery protocol.
-int init_discovery_kernel_ctx(cl_program *p, cl_command_queue *q, cl_mem *gl_ctx) {
+// The number of groups per compute unit that the barrier flags are
+// sized for by default. This should be at least the largest number
+// of groups a compute unit can hold at once on the target device.
+#ifndef DISCOVERY_GROUPS_PER_CU
+#define DISCOVERY_GROUPS_PER_CU 64
+#endif
+
+// The number of per-group arrays of the context of kernels built with
+// the host's options, and with QUEUE_LOCK too if `queue_lock` is set,
+// for programs that only pass -DQUEUE_LOCK to some of their kernels
+// (see get_compile_opts_occupancy_tests).
+int discovery_group_arrays(int queue_lock) {
+#ifdef QUEUE_LOCK
+  queue_lock = 1;
+#endif
+  return DISCOVERY_BASE_GROUP_ARRAYS + (queue_lock ? 1 : 0);
+}
+
+// The size in bytes of a discovery_kernel_ctx buffer with room for
+// `capacity` participating groups, i.e. `capacity` entries in each of
+// `arrays` per-group arrays, laid out every BAR_FLAG_STRIDE ints, and
+// the trace buffers in trace mode. `arrays` must be at least the
+// number the kernels' build uses, or their initialisation fails (see
+// init_discovery_kernel_ctx_capacity).
+size_t discovery_kernel_ctx_size_arrays(cl_int capacity, int arrays) {
+  return (BAR_FLAG_OFFSET + capacity * (arrays * BAR_FLAG_STRIDE + DISCOVERY_TRACE_GROUP_INTS)) * sizeof(cl_int);
+}
+
+// The size in bytes of a discovery_kernel_ctx buffer with room for
+// `capacity` participating groups, for kernels built with the host's
+// options
+size_t discovery_kernel_ctx_size(cl_int capacity) {
+  return discovery_kernel_ctx_size_arrays(capacity, DISCOVERY_GROUP_ARRAYS);
+}
+
+// The default capacity for a device: enough participating groups to
+// fill every compute unit with DISCOVERY_GROUPS_PER_CU groups.
+cl_int discovery_default_capacity(cl_device_id device) {
+  cl_uint compute_units = 0;
+  clGetDeviceInfo(device, CL_DEVICE_MAX_COMPUTE_UNITS, sizeof(compute_units), &compute_units, NULL);
+  if (compute_units == 0) {
+    compute_units = 1;
+  }
+  return compute_units * DISCOVERY_GROUPS_PER_CU;
+}
+
+// The number of participating groups a discovery_kernel_ctx buffer of
+// `buffer_size` bytes holds with the host's options, or 0 if it is too
+// small for one (see discovery_kernel_ctx_size)
+cl_int discovery_kernel_ctx_capacity(size_t buffer_size) {
+  if (buffer_size < discovery_kernel_ctx_size(1)) { return 0; }
+  return (buffer_size / sizeof(cl_int) - BAR_FLAG_OFFSET) / DISCOVERY_GROUP_INTS;
+}
+
+// This function initialises the discovery_kernel_ctx object with
+// barrier flags for `capacity` participating groups, skipping the
+// protocol if `skip_arg` is set. Skipping is used to find the occupancy
+// bound N in the occupancy tests; every launched group then takes part
+// in the barrier, so the capacity must cover them all. The flag is only
+// read by kernels built with DISCOVERY_RUNTIME_SKIP (see
+// get_compile_opts_occupancy_tests).
+//
+// The kernel stores the capacity it is given. If its per-group arrays
+// do not fit in the buffer for that many groups, because it was built
+// with other layout options than the buffer was sized for (e.g.
+// QUEUE_LOCK or DISCOVERY_STATS), CL_INVALID_BUFFER_SIZE is returned.
+int init_discovery_kernel_ctx_capacity(cl_program *p, cl_command_queue *q, cl_mem *gl_ctx, int skip_arg, cl_int capacity) {
   cl_kernel kernel;
   int err;
-  cl_int skip = 0;
+  cl_int skip = skip_arg;
+  cl_int size;
+  cl_int stored = 0;
+  size_t buffer_size;
 
-  kernel = clCreateKernel(*p, "init_discovery_kernel_ctx",&err);
-  if (err < 0 ) { return err; }
+  if (capacity < 1) { return CL_INVALID_VALUE; }
 
-  err = clSetKernelArg(kernel, 0, sizeof(cl_mem), gl_ctx);
-  if (err < 0 ) {  return err; }
+  err = clGetMemObjectInfo(*gl_ctx, CL_MEM_SIZE, sizeof(buffer_size), &buffer_size, NULL);
+  if (err < 0) { return err; }
+  size = buffer_size / sizeof(cl_int);
+
+  kernel = clCreateKernel(*p, "init_discovery_kernel_ctx",&err);
+  if (err < 0) { return err; }
 
-  err = clSetKernelArg(kernel, 1, sizeof(cl_int), &skip);
-  if (err < 0 ) {  return err; }
+  // At least one work-item per group; the work-group size is left to the runtime
+  size_t global_size[3] = {(size_t) size, 0, 0};
 
-  size_t global_size[3] = {1, 0, 0}, local_size[3] = {1, 0, 0};
-  err = clEnqueueNDRangeKernel(*q, kernel, 1, NULL, global_size, local_size, 0, NULL, NULL);
-  if (err < 0 ) { return err; }
+  err = clSetKernelArg(kernel, 0, sizeof(cl_mem), gl_ctx);
+  if (err == CL_SUCCESS) { err = clSetKernelArg(kernel, 1, sizeof(cl_int), &skip); }
+  if (err == CL_SUCCESS) { err = clSetKernelArg(kernel, 2, sizeof(cl_int), &size); }
+  if (err == CL_SUCCESS) { err = clSetKernelArg(kernel, 3, sizeof(cl_int), &capacity); }
+  if (err == CL_SUCCESS) { err = clEnqueueNDRangeKernel(*q, kernel, 1, NULL, global_size, NULL, 0, NULL, NULL); }
 
-  clFinish(*q);
+  // The blocking read also waits for the initialisation
+  if (err == CL_SUCCESS) { err = clEnqueueReadBuffer(*q, *gl_ctx, CL_TRUE, offsetof(discovery_kernel_ctx, capacity), sizeof(cl_int), &stored, 0, NULL, NULL); }
   clReleaseKernel(kernel);
+  if (err < 0) { return err; }
 
+  if (stored != capacity) { return CL_INVALID_BUFFER_SIZE; }
   return CL_SUCCESS;
 }
 
-// This function initialises the discovery_kernel_ctx object to skip the protocol.
-// This is used to find the occupancy bound N in the occupancy tests.
+// Initialises the discovery_kernel_ctx object with as many
+// participating groups as its buffer holds with the host's options,
+// skipping the protocol if `skip_arg` is set.
 int init_discovery_kernel_ctx_skip(cl_program *p, cl_command_queue *q, cl_mem *gl_ctx, int skip_arg) {
+  size_t buffer_size;
+  int err = clGetMemObjectInfo(*gl_ctx, CL_MEM_SIZE, sizeof(buffer_size), &buffer_size, NULL);
+  if (err < 0) { return err; }
+
+  cl_int capacity = discovery_kernel_ctx_capacity(buffer_size);
+  if (capacity < 1) { return CL_INVALID_BUFFER_SIZE; }
+
+  return init_discovery_kernel_ctx_capacity(p, q, gl_ctx, skip_arg, capacity);
+}
+
+// This function initialises the discovery_kernel_ctx object for regular use.
+// Should be called before a kernel using the discovery protocol.
+int init_discovery_kernel_ctx(cl_program *p, cl_command_queue *q, cl_mem *gl_ctx) {
+  return init_discovery_kernel_ctx_skip(p, q, gl_ctx, 0);
+}
+
+// Returns CL_INVALID_VALUE if a context with room for `capacity`
+// groups is too small for kernels built with DISCOVERY_MODE_FIXED, in
+// which all DISCOVERY_FIXED_GROUPS groups participate.
+int discovery_check_capacity(cl_int capacity) {
+#if DISCOVERY_MODE == DISCOVERY_MODE_FIXED
+  if (capacity < DISCOVERY_FIXED_GROUPS) { return CL_INVALID_VALUE; }
+#else
+  (void) capacity;
+#endif
+  return CL_SUCCESS;
+}
+
+// Allocates a discovery_kernel_ctx with barrier flags for up to
+// `capacity` participating groups and initialises it for regular use.
+// Groups polling after `capacity` groups have joined do not participate.
+int create_discovery_kernel_ctx_capacity(cl_context *context, cl_program *p, cl_command_queue *q, cl_mem *gl_ctx, cl_int capacity) {
+  int err = discovery_check_capacity(capacity);
+  if (err < 0) { return err; }
+
+  *gl_ctx = clCreateBuffer(*context, CL_MEM_READ_WRITE, discovery_kernel_ctx_size(capacity), NULL, &err);
+  if (err < 0) { return err; }
+
+  return init_discovery_kernel_ctx_capacity(p, q, gl_ctx, 0, capacity);
+}
+
+// Allocates and initialises a discovery_kernel_ctx sized for the
+// compute units of `device` (see discovery_default_capacity).
+int create_discovery_kernel_ctx(cl_context *context, cl_device_id *device, cl_program *p, cl_command_queue *q, cl_mem *gl_ctx) {
+  return create_discovery_kernel_ctx_capacity(context, p, q, gl_ctx, discovery_default_capacity(*device));
+}
+
+/*
+  Context pool: a number of discovery_kernel_ctx objects (slots) in one
+  buffer, initialised with a single launch. Each slot is a sub-buffer
+  that can be passed to a kernel like a regular context, so kernels
+  running concurrently on different command queues each take a slot.
+  The protocol resets a context at the end of every kernel, so a slot
+  can be handed out again once its kernel has completed, without
+  another initialisation.
+*/
+typedef struct {
+  cl_mem buffer;
+  cl_mem *slots;
+  int *in_use;
+  cl_int num_slots;
+  size_t slot_size;
+} discovery_ctx_pool;
+
+int release_discovery_ctx_pool(discovery_ctx_pool *pool);
+
+// Creates a pool of `num_slots` contexts, each with barrier flags for
+// up to `capacity` participating groups, and initialises them all. On
+// failure whatever was created is released again.
+int create_discovery_ctx_pool_capacity(cl_context *context, cl_device_id *device, cl_program *p, cl_command_queue *q, discovery_ctx_pool *pool, cl_int num_slots, cl_int capacity) {
   cl_kernel kernel;
-  int err;
-  cl_int skip = skip_arg;
+  cl_uint align_bits = 0;
+  int err = discovery_check_capacity(capacity);
+  if (err < 0) { return err; }
 
-  kernel = clCreateKernel(*p, "init_discovery_kernel_ctx",&err);
+  // Sub-buffers must start at a multiple of the base address alignment
+  err = clGetDeviceInfo(*device, CL_DEVICE_MEM_BASE_ADDR_ALIGN, sizeof(align_bits), &align_bits, NULL);
   if (err < 0) { return err; }
 
-  err = clSetKernelArg(kernel, 0, sizeof(cl_mem), gl_ctx);
-  if (err < 0 ) { return err; }
+  size_t align = align_bits / 8 > sizeof(cl_int) ? align_bits / 8 : sizeof(cl_int);
+  pool->slot_size = (discovery_kernel_ctx_size(capacity) + align - 1) / align * align;
+  // Counts the slots created so far, for release_discovery_ctx_pool
+  pool->num_slots = 0;
+  pool->slots = NULL;
+  pool->in_use = NULL;
+
+  pool->buffer = clCreateBuffer(*context, CL_MEM_READ_WRITE, pool->slot_size * num_slots, NULL, &err);
+  if (err < 0) { return err; }
 
-  err = clSetKernelArg(kernel, 1, sizeof(cl_int), &skip);
-  if (err < 0 ) { return err; }
+  pool->slots = (cl_mem *) malloc(num_slots * sizeof(cl_mem));
+  pool->in_use = (int *) calloc(num_slots, sizeof(int));
+  if (pool->slots == NULL || pool->in_use == NULL) {
+    release_discovery_ctx_pool(pool);
+    return CL_OUT_OF_HOST_MEMORY;
+  }
 
+  for (int i = 0; i < num_slots; i++) {
+    cl_buffer_region region = {i * pool->slot_size, pool->slot_size};
+    pool->slots[i] = clCreateSubBuffer(pool->buffer, CL_MEM_READ_WRITE, CL_BUFFER_CREATE_TYPE_REGION, &region, &err);
+    if (err < 0) {
+      release_discovery_ctx_pool(pool);
+      return err;
+    }
+    pool->num_slots = i + 1;
+  }
 
-  size_t global_size[3] = {1, 0, 0}, local_size[3] = {1, 0, 0};
-  err = clEnqueueNDRangeKernel(*q, kernel, 1, NULL, global_size, local_size, 0, NULL, NULL);
-  if (err < 0 ) {  return err; }
+  // One launch initialises every slot
+  kernel = clCreateKernel(*p, "init_discovery_kernel_ctx_pool", &err);
+  if (err < 0) {
+    release_discovery_ctx_pool(pool);
+    return err;
+  }
 
-  clFinish(*q);
+  cl_int skip = 0;
+  cl_int slot_ints = pool->slot_size / sizeof(cl_int);
+  cl_int stored = 0;
+  size_t global_size[3] = {(size_t) slot_ints, (size_t) num_slots, 0};
+
+  err = clSetKernelArg(kernel, 0, sizeof(cl_mem), &(pool->buffer));
+  if (err == CL_SUCCESS) { err = clSetKernelArg(kernel, 1, sizeof(cl_int), &skip); }
+  if (err == CL_SUCCESS) { err = clSetKernelArg(kernel, 2, sizeof(cl_int), &slot_ints); }
+  if (err == CL_SUCCESS) { err = clSetKernelArg(kernel, 3, sizeof(cl_int), &capacity); }
+  if (err == CL_SUCCESS) { err = clEnqueueNDRangeKernel(*q, kernel, 2, NULL, global_size, NULL, 0, NULL, NULL); }
+
+  // Slots may be used on other queues, so wait for the initialisation.
+  // The blocking read does, and checks that the kernels' per-group
+  // arrays fit in a slot (see init_discovery_kernel_ctx_capacity).
+  if (err == CL_SUCCESS) { err = clEnqueueReadBuffer(*q, pool->buffer, CL_TRUE, offsetof(discovery_kernel_ctx, capacity), sizeof(cl_int), &stored, 0, NULL, NULL); }
+  if (err == CL_SUCCESS && stored != capacity) { err = CL_INVALID_BUFFER_SIZE; }
   clReleaseKernel(kernel);
 
+  if (err < 0) {
+    release_discovery_ctx_pool(pool);
+    return err;
+  }
+
   return CL_SUCCESS;
 }
 
+// Creates a pool of `num_slots` contexts sized for the compute units of
+// `device` (see discovery_default_capacity).
+int create_discovery_ctx_pool(cl_context *context, cl_device_id *device, cl_program *p, cl_command_queue *q, discovery_ctx_pool *pool, cl_int num_slots) {
+  return create_discovery_ctx_pool_capacity(context, device, p, q, pool, num_slots, discovery_default_capacity(*device));
+}
+
+// Hands out a free context of the pool, or NULL if all are in use.
+// The pool is not thread safe; slots should be handed out from one
+// host thread.
+cl_mem *discovery_ctx_pool_acquire(discovery_ctx_pool *pool) {
+  for (int i = 0; i < pool->num_slots; i++) {
+    if (!pool->in_use[i]) {
+      pool->in_use[i] = 1;
+      return &(pool->slots[i]);
+    }
+  }
+  return NULL;
+}
+
+// Returns a context to the pool. The kernel that used it must have
+// completed.
+void discovery_ctx_pool_release(discovery_ctx_pool *pool, cl_mem *slot) {
+  pool->in_use[slot - pool->slots] = 0;
+}
+
+// Releases the contexts and the buffer of the pool. Returns the first
+// error, if any.
+int release_discovery_ctx_pool(discovery_ctx_pool *pool) {
+  int err = CL_SUCCESS, ret;
+
+  // Sub-buffers go before the buffer they are part of
+  for (int i = 0; i < pool->num_slots; i++) {
+    ret = clReleaseMemObject(pool->slots[i]);
+    if (err == CL_SUCCESS) { err = ret; }
+  }
+  ret = clReleaseMemObject(pool->buffer);
+  if (err == CL_SUCCESS) { err = ret; }
+
+  free(pool->slots);
+  free(pool->in_use);
+  pool->slots = NULL;
+  pool->in_use = NULL;
+  pool->num_slots = 0;
+
+  return err;
+}
+
 // After a kernel has run using the discovery protocol, this reports how many
 // groups were discovered and determined to be participating.
 int number_of_participating_groups(cl_command_queue *queue, cl_mem *gl_ctx) {
@@ -67,11 +311,528 @@ int number_of_participating_groups(cl_command_queue *queue, cl_mem *gl_ctx) {
   return h_gl_ctx.num_participating;
 }
 
-// Code used in the occupancy_test experiments to time the discovery protocol
-int time_protocol(cl_program *p, cl_command_queue *q, cl_kernel *k, int upper_bound, int wgs, cl_mem *gl_ctx, double *time) {
+#ifdef DISCOVERY_STATS
+
+// Synchronisation counters of the kernels run with a context since it
+// was initialised or its counters were last read (see DISCOVERY_STATS
+// in common.h). Waits are counted in failed polls of a flag or of the
+// discovery mutex.
+typedef struct {
+  cl_int participating_groups;
+  cl_int barriers;
+  cl_int barrier_spins;
+  cl_int max_barrier_spins;
+  cl_int max_group_spins;
+  double mean_barrier_spins;
+  cl_int lock_spins;
+} discovery_run_stats;
+
+// Reads the counters of `gl_ctx` into `stats`. mean_barrier_spins is
+// the mean over the barriers of the polls spent waiting in each, and
+// max_group_spins the total of the group that waited the most. The
+// counters are 32-bit, so they are reset after being read; read them
+// after each kernel (or every few) on long runs to keep them from
+// overflowing. No kernel may be running with the context.
+int discovery_stats(cl_command_queue *queue, cl_mem *gl_ctx, discovery_run_stats *stats) {
+  size_t buffer_size;
+  int err;
+
+  err = clGetMemObjectInfo(*gl_ctx, CL_MEM_SIZE, sizeof(buffer_size), &buffer_size, NULL);
+  if (err < 0) { return err; }
+
+  cl_int *buffer = (cl_int *) malloc(buffer_size);
+  if (buffer == NULL) { return CL_OUT_OF_HOST_MEMORY; }
+
+  err = clEnqueueReadBuffer(*queue, *gl_ctx, CL_TRUE, 0, buffer_size, buffer, 0, NULL, NULL);
+  if (err < 0) {
+    free(buffer);
+    return err;
+  }
+
+  discovery_kernel_ctx *h_gl_ctx = (discovery_kernel_ctx *) buffer;
+  stats->participating_groups = h_gl_ctx->num_participating;
+  stats->barriers = h_gl_ctx->stat_barriers;
+  stats->barrier_spins = h_gl_ctx->stat_barrier_spins;
+  stats->max_barrier_spins = h_gl_ctx->stat_max_barrier_spins;
+  stats->mean_barrier_spins = stats->barriers > 0 ? (double) stats->barrier_spins / stats->barriers : 0;
+  stats->lock_spins = h_gl_ctx->stat_lock_spins;
+
+  stats->max_group_spins = 0;
+  cl_int *group_spins = buffer + BAR_FLAG_OFFSET + DISCOVERY_BAR_SPINS * h_gl_ctx->capacity * BAR_FLAG_STRIDE;
+  for (int i = 0; i < h_gl_ctx->capacity; i++) {
+    if (group_spins[i * BAR_FLAG_STRIDE] > stats->max_group_spins) {
+      stats->max_group_spins = group_spins[i * BAR_FLAG_STRIDE];
+    }
+  }
+
+  // Reset the counters, including the per-group totals
+  size_t group_spins_offset = (group_spins - buffer) * sizeof(cl_int);
+  size_t group_spins_size = h_gl_ctx->capacity * BAR_FLAG_STRIDE * sizeof(cl_int);
+  memset(buffer, 0, buffer_size);
+  err = clEnqueueWriteBuffer(*queue, *gl_ctx, CL_TRUE, offsetof(discovery_kernel_ctx, stat_barriers),
+                             4 * sizeof(cl_int), buffer, 0, NULL, NULL);
+  if (err == CL_SUCCESS && group_spins_size > 0) {
+    err = clEnqueueWriteBuffer(*queue, *gl_ctx, CL_TRUE, group_spins_offset,
+                               group_spins_size, buffer, 0, NULL, NULL);
+  }
+
+  free(buffer);
+  return err;
+}
+
+// Prints the counters read by discovery_stats. The last line is the
+// total time lost in global synchronisation, in failed polls.
+void print_discovery_stats(discovery_run_stats *stats) {
+  printf("\tbarriers = %d\n", stats->barriers);
+  printf("\tbarrier spins = %d\n", stats->barrier_spins);
+  printf("\tmean barrier spins = %f\n", stats->mean_barrier_spins);
+  printf("\tmax barrier spins = %d\n", stats->max_barrier_spins);
+  printf("\tmax group barrier spins = %d\n", stats->max_group_spins);
+  printf("\tlock spins = %d\n", stats->lock_spins);
+  printf("\tsynchronisation spins = %d\n", stats->barrier_spins + stats->lock_spins);
+}
+
+#endif
+
+/*
+  Static occupancy estimate: a bound on the number of groups of a
+  kernel that can be resident at once, from the device and kernel
+  resource limits OpenCL reports. It only seeds the launch size; the
+  discovery protocol still finds the exact number of participating
+  groups. OpenCL does not report the threads or registers per compute
+  unit, so typical GPU values are assumed, erring high so that
+  launches cover the real occupancy.
+*/
+
+// Threads resident per compute unit
+#ifndef DISCOVERY_ESTIMATE_THREADS_PER_CU
+#define DISCOVERY_ESTIMATE_THREADS_PER_CU 2048
+#endif
+
+// Bytes of private memory (registers) per compute unit
+#ifndef DISCOVERY_ESTIMATE_PRIVATE_PER_CU
+#define DISCOVERY_ESTIMATE_PRIVATE_PER_CU 262144
+#endif
+
+// Estimates how many groups of `wgs` threads of `kernel` can be
+// resident on `device`, or returns 0 if the device cannot be queried.
+// The kernel's __local arguments should be set first, as for the
+// occupancy cache. A CPU device runs one group per compute unit.
+size_t discovery_estimate_groups(cl_device_id *device, cl_kernel *kernel, size_t wgs) {
+  cl_device_type type;
+  cl_uint compute_units;
+  cl_ulong device_local_mem, local_mem = 0, private_mem = 0;
+  size_t multiple = 1;
+  int err;
+
+  err = clGetDeviceInfo(*device, CL_DEVICE_TYPE, sizeof(type), &type, NULL);
+  err |= clGetDeviceInfo(*device, CL_DEVICE_MAX_COMPUTE_UNITS, sizeof(compute_units), &compute_units, NULL);
+  err |= clGetDeviceInfo(*device, CL_DEVICE_LOCAL_MEM_SIZE, sizeof(device_local_mem), &device_local_mem, NULL);
+  if (err != CL_SUCCESS || wgs == 0) { return 0; }
+
+  if (type & CL_DEVICE_TYPE_CPU) { return compute_units; }
+
+  clGetKernelWorkGroupInfo(*kernel, *device, CL_KERNEL_LOCAL_MEM_SIZE, sizeof(local_mem), &local_mem, NULL);
+  clGetKernelWorkGroupInfo(*kernel, *device, CL_KERNEL_PRIVATE_MEM_SIZE, sizeof(private_mem), &private_mem, NULL);
+  clGetKernelWorkGroupInfo(*kernel, *device, CL_KERNEL_PREFERRED_WORK_GROUP_SIZE_MULTIPLE, sizeof(multiple), &multiple, NULL);
+
+  // Threads are allocated in whole multiples (e.g. warps)
+  if (multiple > 1) { wgs = (wgs + multiple - 1) / multiple * multiple; }
+
+  size_t per_cu = DISCOVERY_GROUPS_PER_CU;
+
+  if (DISCOVERY_ESTIMATE_THREADS_PER_CU / wgs < per_cu) {
+    per_cu = DISCOVERY_ESTIMATE_THREADS_PER_CU / wgs;
+  }
+  if (local_mem > 0 && device_local_mem / local_mem < per_cu) {
+    per_cu = device_local_mem / local_mem;
+  }
+  if (private_mem > 0 && DISCOVERY_ESTIMATE_PRIVATE_PER_CU / (private_mem * wgs) < per_cu) {
+    per_cu = DISCOVERY_ESTIMATE_PRIVATE_PER_CU / (private_mem * wgs);
+  }
+
+  // At least one group of a kernel that builds fits
+  if (per_cu == 0) { per_cu = 1; }
+
+  return per_cu * compute_units;
+}
+
+/*
+  Occupancy cache: the number of participating groups found for a
+  kernel, recorded in a file so that later runs can launch about that
+  many groups instead of a fixed upper bound. Entries are keyed by the
+  device (and its compute units), driver, kernel, workgroup size and
+  the kernel's local and private memory use, one "groups key" entry
+  per line.
+*/
+
+// The cache file, unless overridden by the DISCOVERY_OCCUPANCY_CACHE
+// environment variable
+#ifndef DISCOVERY_OCCUPANCY_CACHE_FILE
+#define DISCOVERY_OCCUPANCY_CACHE_FILE "discovery_occupancy.txt"
+#endif
+
+// Groups launched on top of the cached occupancy, as a percentage
+// of it (at least one group is always added)
+#ifndef DISCOVERY_OCCUPANCY_MARGIN
+#define DISCOVERY_OCCUPANCY_MARGIN 10
+#endif
+
+#define DISCOVERY_OCCUPANCY_KEY_SIZE 1024
+
+const char *discovery_occupancy_cache_file() {
+  const char *file = getenv("DISCOVERY_OCCUPANCY_CACHE");
+  if (file == NULL || file[0] == '\0') {
+    return DISCOVERY_OCCUPANCY_CACHE_FILE;
+  }
+  return file;
+}
+
+// Writes the cache key of `kernel` launched with workgroups of `wgs`
+// threads on `device` to `key`. The kernel's local memory use includes
+// the __local arguments set so far, so they should be set first. The
+// compute units tell the sub-devices of a partitioned device apart.
+int discovery_occupancy_key(cl_device_id *device, cl_kernel *kernel, size_t wgs, char *key) {
+  char device_name[256], driver_version[256], kernel_name[256];
+  cl_ulong local_mem = 0, private_mem = 0;
+  cl_uint compute_units;
+  int err;
+
+  err = clGetDeviceInfo(*device, CL_DEVICE_NAME, sizeof(device_name), device_name, NULL);
+  if (err < 0) { return err; }
+
+  err = clGetDeviceInfo(*device, CL_DRIVER_VERSION, sizeof(driver_version), driver_version, NULL);
+  if (err < 0) { return err; }
+
+  err = clGetDeviceInfo(*device, CL_DEVICE_MAX_COMPUTE_UNITS, sizeof(compute_units), &compute_units, NULL);
+  if (err < 0) { return err; }
+
+  err = clGetKernelInfo(*kernel, CL_KERNEL_FUNCTION_NAME, sizeof(kernel_name), kernel_name, NULL);
+  if (err < 0) { return err; }
+
+  err = clGetKernelWorkGroupInfo(*kernel, *device, CL_KERNEL_LOCAL_MEM_SIZE, sizeof(local_mem), &local_mem, NULL);
+  if (err < 0) { return err; }
+
+  err = clGetKernelWorkGroupInfo(*kernel, *device, CL_KERNEL_PRIVATE_MEM_SIZE, sizeof(private_mem), &private_mem, NULL);
+  if (err < 0) { return err; }
+
+  snprintf(key, DISCOVERY_OCCUPANCY_KEY_SIZE, "%s|%s|%u|%s|%lu|%lu|%lu", device_name, driver_version,
+           (unsigned int) compute_units, kernel_name, (unsigned long) wgs, (unsigned long) local_mem, (unsigned long) private_mem);
+
+  // Keep an entry on one line
+  for (char *c = key; *c != '\0'; c++) {
+    if (*c == '\n' || *c == '\r') { *c = ' '; }
+  }
+
+  return CL_SUCCESS;
+}
+
+// Returns the number of groups recorded for `key` in the cache, or 0
+// if there is no entry. Lines of other entries are appended to `others`
+// when it is not NULL (it must then hold the whole file).
+int discovery_occupancy_lookup(const char *key, char *others) {
+  char line[DISCOVERY_OCCUPANCY_KEY_SIZE + 32];
+  int groups = 0;
+
+  FILE *fp = fopen(discovery_occupancy_cache_file(), "r");
+  if (fp == NULL) { return 0; }
+
+  while (fgets(line, sizeof(line), fp) != NULL) {
+    char *entry_key;
+    int entry_groups = strtol(line, &entry_key, 10);
+    if (*entry_key == ' ') { entry_key++; }
+    entry_key[strcspn(entry_key, "\n")] = '\0';
+
+    if (strcmp(entry_key, key) == 0) {
+      groups = entry_groups;
+    }
+    else if (others != NULL && entry_key[0] != '\0') {
+      sprintf(others + strlen(others), "%d %s\n", entry_groups, entry_key);
+    }
+  }
+
+  fclose(fp);
+  return groups;
+}
+
+// The number of groups to launch `kernel` with: the cached occupancy,
+// or the static estimate if it has not been recorded yet, plus
+// DISCOVERY_OCCUPANCY_MARGIN. `fallback` groups are launched if
+// neither is known.
+//
+// Without the protocol every launched group must be co-resident and
+// have room in the context, so kernels built with DISCOVERY_MODE_FIXED
+// are launched with exactly their fixed groups (create_discovery_kernel_ctx
+// checks that they fit). Those built with DISCOVERY_MODE_SKIP are
+// launched with the occupancy a DISCOVERY_MODE_DISCOVER build of the
+// kernel recorded, at most the default capacity. The estimate errs
+// high and the margin and fallback over-launch, so none is used: a
+// single group is launched until the occupancy has been recorded.
+size_t discovery_launch_groups(cl_device_id *device, cl_kernel *kernel, size_t wgs, size_t fallback) {
+#if DISCOVERY_MODE == DISCOVERY_MODE_FIXED
+  (void) device;
+  (void) kernel;
+  (void) wgs;
+  (void) fallback;
+  return DISCOVERY_FIXED_GROUPS;
+#else
+  char key[DISCOVERY_OCCUPANCY_KEY_SIZE];
+  int groups = 0;
+  if (discovery_occupancy_key(device, kernel, wgs, key) == CL_SUCCESS) {
+    groups = discovery_occupancy_lookup(key, NULL);
+  }
+
+#if DISCOVERY_MODE == DISCOVERY_MODE_SKIP
+  (void) fallback;
+  cl_int capacity = discovery_default_capacity(*device);
+  if (groups > capacity) { groups = capacity; }
+  if (groups <= 0) { groups = 1; }
+  return groups;
+#else
+  if (groups <= 0) { groups = discovery_estimate_groups(device, kernel, wgs); }
+  if (groups <= 0) { return fallback; }
+
+  return groups + groups * DISCOVERY_OCCUPANCY_MARGIN / 100 + 1;
+#endif
+#endif
+}
+
+// Records that `groups` groups participated in a run of `kernel`.
+// Keeps the largest occupancy seen. A launch that was capped by the
+// number of groups launched is recorded too: the next launch adds the
+// margin, so the entry grows until it reaches the real occupancy.
+// Nothing is recorded unless the groups were discovered by the
+// protocol (DISCOVERY_MODE_DISCOVER).
+//
+// The cache is rewritten in a temporary file that is renamed over it,
+// so runs side by side never read a truncated or partly written file.
+// An entry recorded by another run at the same time may still be
+// dropped; it is then found again by a later run.
+int discovery_record_occupancy(cl_device_id *device, cl_kernel *kernel, size_t wgs, int groups) {
+#if DISCOVERY_MODE != DISCOVERY_MODE_DISCOVER
+  (void) device;
+  (void) kernel;
+  (void) wgs;
+  (void) groups;
+  return CL_SUCCESS;
+#else
+  char key[DISCOVERY_OCCUPANCY_KEY_SIZE];
+  int err;
+
+  err = discovery_occupancy_key(device, kernel, wgs, key);
+  if (err < 0) { return err; }
+
+  // Room for the file as it is and the new entry
+  long file_size = 0;
+  FILE *fp = fopen(discovery_occupancy_cache_file(), "r");
+  if (fp != NULL) {
+    fseek(fp, 0, SEEK_END);
+    file_size = ftell(fp);
+    fclose(fp);
+  }
+
+  char *contents = (char *) calloc(2 * file_size + DISCOVERY_OCCUPANCY_KEY_SIZE + 32, 1);
+  if (contents == NULL) { return CL_OUT_OF_HOST_MEMORY; }
+
+  int cached = discovery_occupancy_lookup(key, contents);
+  if (cached >= groups) {
+    free(contents);
+    return CL_SUCCESS;
+  }
+
+  const char *file = discovery_occupancy_cache_file();
+  char *tmp_file = (char *) malloc(strlen(file) + 32);
+  if (tmp_file == NULL) {
+    free(contents);
+    return CL_OUT_OF_HOST_MEMORY;
+  }
+  sprintf(tmp_file, "%s.%ld.tmp", file, (long) getpid());
+
+  err = CL_INVALID_VALUE;
+  fp = fopen(tmp_file, "w");
+  if (fp != NULL) {
+    int ok = fprintf(fp, "%s%d %s\n", contents, groups, key) > 0;
+    ok = (fclose(fp) == 0) && ok;
+    if (ok && rename(tmp_file, file) == 0) {
+      err = CL_SUCCESS;
+    }
+    else {
+      remove(tmp_file);
+    }
+  }
+
+  free(tmp_file);
+  free(contents);
+  return err;
+#endif
+}
+
+#ifdef DISCOVERY_TRACE
+
+// Writes one Chrome trace event of group `group` lasting from `start` to `end`
+void discovery_trace_event(FILE *fp, int *first, const char *name, int group, int start, int end) {
+  fprintf(fp, "%s  {\"name\": \"%s\", \"ph\": \"X\", \"pid\": 0, \"tid\": %d, \"ts\": %d, \"dur\": %d}",
+          *first ? "" : ",\n", name, group, start, end - start);
+  *first = 0;
+}
+
+// Writes the events recorded in trace mode (see DISCOVERY_TRACE in
+// common.h) to `file` in the Chrome trace JSON format (chrome://tracing
+// or Perfetto). Each participating group is a thread of the trace with
+// "protocol", "work" and "barrier" slices, so stragglers show up as
+// groups whose work ends late and idle time as long barrier slices.
+// The trace holds the last DISCOVERY_TRACE_EVENTS events of every group
+// since the context was initialised. Timestamps are those of
+// DISCOVERY_TRACE_CLOCK: logical clock ticks by default.
+int discovery_write_trace(cl_command_queue *q, cl_mem *gl_ctx, const char *file) {
+  size_t buffer_size;
+  int err;
+
+  err = clGetMemObjectInfo(*gl_ctx, CL_MEM_SIZE, sizeof(buffer_size), &buffer_size, NULL);
+  if (err < 0) { return err; }
+
+  cl_int *buffer = (cl_int *) malloc(buffer_size);
+  if (buffer == NULL) { return CL_OUT_OF_HOST_MEMORY; }
+
+  err = clEnqueueReadBuffer(*q, *gl_ctx, CL_TRUE, 0, buffer_size, buffer, 0, NULL, NULL);
+  if (err < 0) {
+    free(buffer);
+    return err;
+  }
+
+  FILE *fp = fopen(file, "w");
+  if (fp == NULL) {
+    free(buffer);
+    return CL_INVALID_VALUE;
+  }
+
+  discovery_kernel_ctx *h_gl_ctx = (discovery_kernel_ctx *) buffer;
+  cl_int *traces = buffer + BAR_FLAG_OFFSET + DISCOVERY_GROUP_ARRAYS * h_gl_ctx->capacity * BAR_FLAG_STRIDE;
+  int first = 1;
+
+  fprintf(fp, "{\"traceEvents\": [\n");
+
+  for (int group = 0; group < h_gl_ctx->capacity; group++) {
+    cl_int *trace = traces + group * DISCOVERY_TRACE_GROUP_INTS;
+    int count = trace[0];
+
+    // Start of the slice in progress and end of the previous one
+    int start = -1, end = -1;
+
+    // Older events have been overwritten in the ring
+    for (int i = count > DISCOVERY_TRACE_EVENTS ? count - DISCOVERY_TRACE_EVENTS : 0; i < count; i++) {
+      int slot = i % DISCOVERY_TRACE_EVENTS;
+      int event = trace[1 + 2 * slot];
+      int time = trace[2 + 2 * slot];
+
+      switch (event) {
+      case DISCOVERY_TRACE_PROTOCOL_ENTER:
+        // A new kernel: the time since the previous event was not
+        // spent in this group
+        start = time;
+        break;
+      case DISCOVERY_TRACE_BARRIER_ARRIVE:
+        if (end >= 0) {
+          discovery_trace_event(fp, &first, "work", group, end, time);
+        }
+        start = time;
+        break;
+      case DISCOVERY_TRACE_PROTOCOL_EXIT:
+      case DISCOVERY_TRACE_BARRIER_RELEASE:
+        if (start >= 0) {
+          discovery_trace_event(fp, &first, event == DISCOVERY_TRACE_PROTOCOL_EXIT ? "protocol" : "barrier", group, start, time);
+        }
+        start = -1;
+        end = time;
+        break;
+      }
+    }
+  }
+
+  fprintf(fp, "\n]}\n");
+  fclose(fp);
+  free(buffer);
+
+  return CL_SUCCESS;
+}
+
+#endif
+
+#ifdef CL_VERSION_2_0
+
+// Allocates a command ring for a server kernel (see DISCOVERY_SERVE in
+// discovery.cl) in fine-grained SVM, which the host and a running
+// kernel can both access atomically. Fails with CL_INVALID_OPERATION if
+// the device does not support it. Pass the ring to the kernel with
+// clSetKernelArgSVMPointer.
+int create_discovery_command_ring(cl_context *context, cl_device_id *device, discovery_command_ring **ring) {
+  cl_device_svm_capabilities caps = 0;
+  int err;
+
+  err = clGetDeviceInfo(*device, CL_DEVICE_SVM_CAPABILITIES, sizeof(caps), &caps, NULL);
+  if (err < 0) { return err; }
+  if (!(caps & CL_DEVICE_SVM_FINE_GRAIN_BUFFER) || !(caps & CL_DEVICE_SVM_ATOMICS)) {
+    return CL_INVALID_OPERATION;
+  }
+
+  *ring = (discovery_command_ring *) clSVMAlloc(*context, CL_MEM_READ_WRITE | CL_MEM_SVM_FINE_GRAIN_BUFFER | CL_MEM_SVM_ATOMICS, sizeof(discovery_command_ring), 0);
+  if (*ring == NULL) { return CL_OUT_OF_HOST_MEMORY; }
+
+  memset(*ring, 0, sizeof(discovery_command_ring));
+  return CL_SUCCESS;
+}
+
+void release_discovery_command_ring(cl_context *context, discovery_command_ring *ring) {
+  clSVMFree(*context, ring);
+}
+
+// Submits a command to the ring and returns its index, or -1 if the
+// ring is full. The kernel may already be running. Commands should be
+// submitted from one host thread. Uses the GCC atomic builtins, which
+// match the device's release and acquire on the ring at system scope.
+int discovery_server_submit(discovery_command_ring *ring, cl_int type, cl_int arg, cl_int slot) {
+  cl_int head = ring->head;
+
+  if (head - __atomic_load_n(&(ring->tail), __ATOMIC_ACQUIRE) == DISCOVERY_SERVER_RING_SIZE) {
+    return -1;
+  }
+
+  discovery_command *cmd = &(ring->commands[head % DISCOVERY_SERVER_RING_SIZE]);
+  cmd->type = type;
+  cmd->arg = arg;
+  cmd->slot = slot;
+
+  __atomic_store_n(&(ring->head), head + 1, __ATOMIC_RELEASE);
+  return head;
+}
+
+// Returns 1 if command `index` has completed, after which the results
+// the kernel wrote for it may be read
+int discovery_server_done(discovery_command_ring *ring, cl_int index) {
+  return __atomic_load_n(&(ring->tail), __ATOMIC_ACQUIRE) > index;
+}
+
+// Waits for command `index` to complete
+void discovery_server_wait(discovery_command_ring *ring, cl_int index) {
+  while (!discovery_server_done(ring, index));
+}
+
+// Submits DISCOVERY_SERVER_STOP once there is room in the ring. The
+// kernel exits after serving the commands before it.
+int discovery_server_stop(discovery_command_ring *ring) {
+  int index;
+  while ((index = discovery_server_submit(ring, DISCOVERY_SERVER_STOP, 0, 0)) < 0);
+  return index;
+}
+
+#endif
+
+// Code used in the occupancy_test experiments to time the discovery
+// protocol, with a context for `capacity` participating groups
+int time_protocol(cl_program *p, cl_command_queue *q, cl_kernel *k, int upper_bound, int wgs, cl_mem *gl_ctx, cl_int capacity, double *time) {
   int err;
 
-  err = init_discovery_kernel_ctx(p, q, gl_ctx);
+  err = init_discovery_kernel_ctx_capacity(p, q, gl_ctx, 0, capacity);
   if (err < 0) { return err; }
 
 
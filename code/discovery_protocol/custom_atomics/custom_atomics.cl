@@ -7,39 +7,84 @@
 // load(relaxed, device
 // store(release, device)
 // memfence(acquire)
-// atomic_fetch_add_explicit(seq_cst, device)
-// exchange(seq_cst, device)
+// atomic_fetch_add_explicit(any order, device)
+// atomic_fetch_sub_explicit(any order, device)
+// atomic_fetch_or_explicit(any order, device)
+// atomic_fetch_min_explicit(any order, device)
+// atomic_fetch_max_explicit(any order, device)
+// exchange(any order, device)
+// compare_exchange_strong(any order, device)
+//
+// The read-modify-writes are the legacy atomics with a fence before
+// them for release orders and a fence after them for acquire orders,
+// so relaxed ones cost no more than the plain atomic_add etc. Only the
+// int versions are provided, so unsigned data must stay below INT_MAX
+// for min and max.
 
 #pragma once
 
 typedef int atomic_int;
 
 typedef enum {memory_scope_device} memory_scope;
-typedef enum {memory_order_relaxed, memory_order_release, memory_order_acquire, memory_order_acq_rel} memory_order;
+typedef enum {memory_order_relaxed, memory_order_release, memory_order_acquire, memory_order_acq_rel, memory_order_seq_cst} memory_order;
 
-// Only use add in sequential consistency mode for device scope
-int atomic_fetch_add_explicit(__global volatile atomic_int* target, int operand, memory_order mo, memory_scope ms) {
-
-  int ret = 0;
+// Device scope fence used by the emulated atomics
+void custom_atomic_fence() {
+#ifdef NVIDIA
+  asm volatile ("membar.gl;\n");
+#endif
 
 #ifdef ARM
   mem_fence(CLK_GLOBAL_MEM_FENCE);
 #endif
+}
 
-#ifdef NVIDIA
-  asm volatile ("membar.gl;\n");
-#endif
+// Fence to execute before a read-modify-write with order `mo`
+void custom_atomic_fence_before(const memory_order mo) {
+  if (mo == memory_order_release || mo == memory_order_acq_rel || mo == memory_order_seq_cst) {
+    custom_atomic_fence();
+  }
+}
 
-  ret =  atomic_add(target, operand);
+// Fence to execute after a read-modify-write with order `mo`
+void custom_atomic_fence_after(const memory_order mo) {
+  if (mo == memory_order_acquire || mo == memory_order_acq_rel || mo == memory_order_seq_cst) {
+    custom_atomic_fence();
+  }
+}
 
-#ifdef NVIDIA
-  asm volatile ("membar.gl;\n");
-#endif
+int atomic_fetch_add_explicit(__global volatile atomic_int* target, int operand, memory_order mo, memory_scope ms) {
+  custom_atomic_fence_before(mo);
+  int ret = atomic_add(target, operand);
+  custom_atomic_fence_after(mo);
+  return ret;
+}
 
-#ifdef ARM
-  mem_fence(CLK_GLOBAL_MEM_FENCE);
-#endif
+int atomic_fetch_sub_explicit(__global volatile atomic_int* target, int operand, memory_order mo, memory_scope ms) {
+  custom_atomic_fence_before(mo);
+  int ret = atomic_sub(target, operand);
+  custom_atomic_fence_after(mo);
+  return ret;
+}
 
+int atomic_fetch_or_explicit(__global volatile atomic_int* target, int operand, memory_order mo, memory_scope ms) {
+  custom_atomic_fence_before(mo);
+  int ret = atomic_or(target, operand);
+  custom_atomic_fence_after(mo);
+  return ret;
+}
+
+int atomic_fetch_min_explicit(__global volatile atomic_int* target, int operand, memory_order mo, memory_scope ms) {
+  custom_atomic_fence_before(mo);
+  int ret = atomic_min(target, operand);
+  custom_atomic_fence_after(mo);
+  return ret;
+}
+
+int atomic_fetch_max_explicit(__global volatile atomic_int* target, int operand, memory_order mo, memory_scope ms) {
+  custom_atomic_fence_before(mo);
+  int ret = atomic_max(target, operand);
+  custom_atomic_fence_after(mo);
   return ret;
 }
 
@@ -90,27 +135,25 @@ void atomic_work_item_fence(const cl_mem_fence_flags flags, const memory_order m
 #endif
 }
 
-// Only used with seq_cst at the device scope. These fences should be okay.
 int atomic_exchange_explicit(__global volatile atomic_int* target, const int desired, const memory_order mo, const memory_scope ms) {
-  int old = 0;
-
-#ifdef NVIDIA
-  asm volatile ("membar.cta;\n");
-#endif
-
-#ifdef ARM
-  mem_fence(CLK_GLOBAL_MEM_FENCE);
-#endif
-
-  old = atomic_xchg(target, desired);
+  custom_atomic_fence_before(mo);
+  int old = atomic_xchg(target, desired);
+  custom_atomic_fence_after(mo);
+  return old;
+}
 
-#ifdef NVIDIA
-  asm volatile ("membar.gl;\n");
-#endif
+// The fence after the cmpxchg follows the order of whichever of
+// success or failure happened.
+bool atomic_compare_exchange_strong_explicit(__global volatile atomic_int* target, int *expected, const int desired, const memory_order success, const memory_order failure, const memory_scope ms) {
+  custom_atomic_fence_before(success);
+  int old = atomic_cmpxchg(target, *expected, desired);
 
-#ifdef ARM
-  mem_fence(CLK_GLOBAL_MEM_FENCE);
-#endif
+  if (old == *expected) {
+    custom_atomic_fence_after(success);
+    return true;
+  }
 
-  return old;
+  custom_atomic_fence_after(failure);
+  *expected = old;
+  return false;
 }
@@ -1,5 +1,6 @@
 // Simple lock implementations to use in the discovery protocol.
-// Either an unfair spin lock can be used or a fair ticket lock.
+// Either an unfair spin lock can be used, a fair ticket lock or a fair
+// queue lock.
 
 #pragma once
 
@@ -7,24 +8,98 @@
 #include "../custom_atomics/custom_atomics.cl"
 #endif
 
+#include "spin_policy.cl"
+
+#if defined(SPIN_LOCK) && defined(QUEUE_LOCK)
+#error "SPIN_LOCK and QUEUE_LOCK are exclusive"
+#endif
+
 // Spin lock (unfair)
 #ifdef SPIN_LOCK
 
-void discovery_lock(__global discovery_mutex *m) {
+// Both locks return the number of failed polls before the lock was taken
+int discovery_lock(__global discovery_mutex *m) {
 
-  while(atomic_exchange_explicit(&(m->counter), 1, memory_order_acq_rel, memory_scope_device) == 1);
+  int delay = SPIN_BACKOFF_MIN, spins = 0;
+
+  while(atomic_exchange_explicit(&(m->counter), 1, memory_order_acq_rel, memory_scope_device) == 1) {
+    delay = spin_backoff(delay);
+    spins++;
+  }
+
+  return spins;
 }
 
 void discovery_unlock(__global discovery_mutex *m) {
   atomic_store_explicit(&(m->counter), 0, memory_order_release, memory_scope_device);
 }
 
+// Queue lock (fair), after Anderson's array lock. Like the ticket lock
+// it hands out tickets, but each waiter spins on a slot of its own,
+// every BAR_FLAG_STRIDE ints in `slots`, which holds the ticket
+// allowed in, rather than all waiters spinning on now_serving. A
+// handoff then only disturbs the next waiter. Waiters more than
+// `num_slots` tickets from the holder wait on now_serving until their
+// slot is free, so any number of groups may take the lock. now_serving
+// holds the holder's ticket. Zeroed slots are a valid initial state;
+// discovery_reset_lock restores one after the counters are reset.
+#elif defined(QUEUE_LOCK)
+
+__global ATOMIC_INT_TYPE *discovery_lock_slot(__global ATOMIC_INT_TYPE *slots, int num_slots, int ticket) {
+  return slots + (ticket % num_slots) * BAR_FLAG_STRIDE;
+}
+
+int discovery_lock(__global discovery_mutex *m, __global ATOMIC_INT_TYPE *slots, int num_slots) {
+  int ticket = atomic_fetch_add_explicit(&(m->counter), 1, memory_order_acq_rel, memory_scope_device);
+  __global ATOMIC_INT_TYPE *slot = discovery_lock_slot(slots, num_slots, ticket);
+  int delay = SPIN_BACKOFF_MIN, spins = 0;
+
+  while (ticket - atomic_load_explicit(&(m->now_serving), memory_order_acquire, memory_scope_device) >= num_slots) {
+    delay = spin_backoff(delay);
+    spins++;
+  }
+
+  while (atomic_load_explicit(slot, memory_order_acquire, memory_scope_device) != ticket) {
+    delay = spin_backoff(delay);
+    spins++;
+  }
+
+  return spins;
+}
+
+void discovery_unlock(__global discovery_mutex *m, __global ATOMIC_INT_TYPE *slots, int num_slots) {
+  int next = atomic_load_explicit(&(m->now_serving), memory_order_relaxed, memory_scope_device) + 1;
+  atomic_store_explicit(&(m->now_serving), next, memory_order_release, memory_scope_device);
+  atomic_store_explicit(discovery_lock_slot(slots, num_slots, next), next, memory_order_release, memory_scope_device);
+}
+
+// Clears the slots for a lock whose counters have been reset to 0. The
+// lock must be free with no waiters.
+void discovery_reset_lock(__global ATOMIC_INT_TYPE *slots, int num_slots) {
+  for (int i = 1; i < num_slots; i++) {
+    atomic_store_explicit(discovery_lock_slot(slots, num_slots, i), -1, memory_order_relaxed, memory_scope_device);
+  }
+  atomic_store_explicit(slots, 0, memory_order_relaxed, memory_scope_device);
+}
+
 // Ticket lock (fair)
 #else
 
-void discovery_lock(__global discovery_mutex *m) {
+int discovery_lock(__global discovery_mutex *m) {
   int ticket = atomic_fetch_add_explicit(&(m->counter), 1, memory_order_acq_rel, memory_scope_device);
-  while (atomic_load_explicit(&(m->now_serving), memory_order_acquire, memory_scope_device) != ticket);
+  int delay = SPIN_BACKOFF_MIN, spins = 0;
+  int serving;
+
+  while ((serving = atomic_load_explicit(&(m->now_serving), memory_order_acquire, memory_scope_device)) != ticket) {
+#if SPIN_POLICY == SPIN_PROPORTIONAL
+    spin_pause((ticket - serving) * SPIN_PROPORTIONAL_DELAY);
+#else
+    delay = spin_backoff(delay);
+#endif
+    spins++;
+  }
+
+  return spins;
 }
 
 void discovery_unlock(__global discovery_mutex *m) {
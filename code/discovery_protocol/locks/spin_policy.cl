@@ -0,0 +1,57 @@
+// The spin policies used by the lock and barrier spin loops. Kept
+// apart from the locks so that code without a discovery context (e.g.
+// the non-portable gbar) can use them.
+
+#pragma once
+
+/*
+  Spin policies. SPIN_POLICY selects what a spin loop does between two
+  polls of the location it waits on:
+    SPIN_PLAIN:        poll again straight away
+    SPIN_BACKOFF:      pause, doubling the pause after every failed
+                       poll up to SPIN_BACKOFF_MAX
+    SPIN_PROPORTIONAL: as SPIN_BACKOFF, except that the ticket lock
+                       pauses in proportion to the number of tickets
+                       ahead of it
+  Pausing keeps the waiting groups off the memory system while the
+  groups they wait for are trying to make progress.
+*/
+#define SPIN_PLAIN 0
+#define SPIN_BACKOFF 1
+#define SPIN_PROPORTIONAL 2
+
+#ifndef SPIN_POLICY
+#define SPIN_POLICY SPIN_PLAIN
+#endif
+
+// Bounds of the exponential backoff, in iterations of spin_pause
+#ifndef SPIN_BACKOFF_MIN
+#define SPIN_BACKOFF_MIN 4
+#endif
+
+#ifndef SPIN_BACKOFF_MAX
+#define SPIN_BACKOFF_MAX 1024
+#endif
+
+// Pause per ticket ahead for SPIN_PROPORTIONAL, in iterations of
+// spin_pause
+#ifndef SPIN_PROPORTIONAL_DELAY
+#define SPIN_PROPORTIONAL_DELAY 64
+#endif
+
+// Busy waits without touching global memory
+void spin_pause(int iterations) {
+  for (volatile int i = 0; i < iterations; i++);
+}
+
+// Called after a failed poll with the current pause (starting at
+// SPIN_BACKOFF_MIN). Pauses according to SPIN_POLICY and returns the
+// pause to use after the next failed poll.
+int spin_backoff(int delay) {
+#if SPIN_POLICY == SPIN_PLAIN
+  return delay;
+#else
+  spin_pause(delay);
+  return min(delay * 2, SPIN_BACKOFF_MAX);
+#endif
+}
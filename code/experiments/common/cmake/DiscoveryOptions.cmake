@@ -0,0 +1,90 @@
+# Build options for the discovery protocol and the inter-workgroup
+# barriers. They are defined for the host code, which forwards them
+# to the kernel compiler in get_compile_opts (my_opencl.h).
+
+# Barrier flags allocated per compute unit for the discovery context
+# (host only, see create_discovery_kernel_ctx in discovery.h)
+set(DISCOVERY_GROUPS_PER_CU 64 CACHE STRING "Maximum participating groups per compute unit")
+add_definitions(-DDISCOVERY_GROUPS_PER_CU=${DISCOVERY_GROUPS_PER_CU})
+
+# Distance, in ints, between barrier flags (discovery_kernel_ctx and
+# the non-portable gbar). 16 pads each flag to a 64 byte cache line.
+set(BAR_FLAG_STRIDE 1 CACHE STRING "Distance in ints between barrier flags")
+add_definitions(-DBAR_FLAG_STRIDE=${BAR_FLAG_STRIDE})
+
+# Barrier used by the discovery_barrier macro
+option(TREE_BARRIER "Use the combining-tree barrier for discovery_barrier" OFF)
+set(BAR_TREE_ARITY 4 CACHE STRING "Fan-in of the combining-tree barrier")
+
+if(TREE_BARRIER)
+  add_definitions(-DTREE_BARRIER)
+endif()
+add_definitions(-DBAR_TREE_ARITY=${BAR_TREE_ARITY})
+
+# Mutex of the discovery protocol: the ticket lock unless this is set
+# (see locks.cl). The queue lock adds a per-group array to the context,
+# so it is defined for the host code as well.
+option(QUEUE_LOCK "Use the queue lock for the discovery protocol" OFF)
+
+if(QUEUE_LOCK)
+  add_definitions(-DQUEUE_LOCK)
+endif()
+
+# Discover the participating groups with the lock-free protocol, which
+# claims ids with atomics on one state word instead of taking the
+# mutex (see discovery.cl)
+option(LOCK_FREE_PROTOCOL "Use the lock-free discovery protocol" OFF)
+
+if(LOCK_FREE_PROTOCOL)
+  add_definitions(-DLOCK_FREE_PROTOCOL)
+endif()
+
+# Groups launched on top of the occupancy cached by previous runs, as
+# a percentage (see discovery_launch_groups in discovery.h)
+set(DISCOVERY_OCCUPANCY_MARGIN 10 CACHE STRING "Extra groups launched over the cached occupancy, in percent")
+add_definitions(-DDISCOVERY_OCCUPANCY_MARGIN=${DISCOVERY_OCCUPANCY_MARGIN})
+
+# What lock and barrier spin loops do between polls (see spin_policy.cl):
+# 0 polls again at once, 1 backs off exponentially, 2 is 1 with a
+# backoff proportional to the queue position for the ticket lock
+set(SPIN_POLICY 0 CACHE STRING "Spin policy: 0 plain, 1 exponential backoff, 2 proportional backoff")
+add_definitions(-DSPIN_POLICY=${SPIN_POLICY})
+
+# Record protocol and barrier events in per-group ring buffers (see
+# discovery_write_trace in discovery.h)
+option(DISCOVERY_TRACE "Record a trace of protocol and barrier events" OFF)
+set(DISCOVERY_TRACE_EVENTS 256 CACHE STRING "Events kept per group in trace mode")
+
+if(DISCOVERY_TRACE)
+  add_definitions(-DDISCOVERY_TRACE -DDISCOVERY_TRACE_EVENTS=${DISCOVERY_TRACE_EVENTS})
+endif()
+
+# Count barriers and the failed polls spent waiting in barriers and in
+# the discovery mutex (see discovery_stats in discovery.h)
+option(DISCOVERY_STATS "Gather synchronisation counters" OFF)
+
+if(DISCOVERY_STATS)
+  add_definitions(-DDISCOVERY_STATS)
+endif()
+
+# Share out the items of DISCOVERY_FOR_EACH loops with the guided
+# scheduler rather than statically (see discovery.cl)
+option(DISCOVERY_GUIDED_SCHEDULE "Use the guided scheduler for DISCOVERY_FOR_EACH loops" OFF)
+
+if(DISCOVERY_GUIDED_SCHEDULE)
+  add_definitions(-DDISCOVERY_GUIDED_SCHEDULE)
+endif()
+
+# How DISCOVERY_PROTOCOL picks the participating groups (see common.h):
+# 0 runs the discovery protocol, 1 makes every launched group
+# participate and 2 the first DISCOVERY_FIXED_GROUPS groups
+set(DISCOVERY_MODE 0 CACHE STRING "Protocol mode: 0 discover, 1 skip, 2 fixed number of groups")
+add_definitions(-DDISCOVERY_MODE=${DISCOVERY_MODE})
+
+if(DISCOVERY_MODE EQUAL 2)
+  set(DISCOVERY_FIXED_GROUPS 0 CACHE STRING "Participating groups in the fixed protocol mode")
+  if(NOT DISCOVERY_FIXED_GROUPS GREATER 0)
+    message(FATAL_ERROR "DISCOVERY_MODE 2 needs DISCOVERY_FIXED_GROUPS")
+  endif()
+  add_definitions(-DDISCOVERY_FIXED_GROUPS=${DISCOVERY_FIXED_GROUPS})
+endif()
@@ -7,20 +7,15 @@
 #include "stdio.h"
 #include <stdlib.h>
 #include "string.h"
+#include <unistd.h>
 
 #define STRINGIFY_INNER(X) #X
 #define STRINGIFY(X) STRINGIFY_INNER(X)
 
 typedef cl_int my_int;
 
-// Define these using -D if you have more than 2 devices
-// on your platform
-#ifndef MAX_DEVICES
-#define MAX_DEVICES 2
-#endif
-
-// Define these using -D if you want to use a device other
-// than device 0
+// Define this using -D if you want to use a device other
+// than device 0 by default (see get_opencl_runtime)
 #ifndef REQUESTED_DEVICE
 #define REQUESTED_DEVICE 0
 #endif
@@ -34,48 +29,563 @@ typedef cl_int my_int;
       exit(EXIT_FAILURE);			\
     } } while (0)
 
-// Creates a device from platform 0 and using REQUESTED_DEVICE.
-// Probably should be made more modular to select particular
-// platforms and devices.
-cl_device_id create_device() {
+// Parses a device type name: "gpu", "cpu", "accelerator" or "all".
+// Anything else selects a GPU.
+cl_device_type parse_device_type(const char *type) {
+  if (strcmp(type, "cpu") == 0) { return CL_DEVICE_TYPE_CPU; }
+  if (strcmp(type, "accelerator") == 0) { return CL_DEVICE_TYPE_ACCELERATOR; }
+  if (strcmp(type, "all") == 0) { return CL_DEVICE_TYPE_ALL; }
+  return CL_DEVICE_TYPE_GPU;
+}
+
+// Maximum number of queues of the runtime (see opencl_runtime_queue_index)
+#define RUNTIME_MAX_QUEUES 8
 
+// Size of the buffers that hold compile options, which programs pass
+// to get_compile_opts and its variants
+#define COMPILE_OPTS_SIZE 1000
+
+// The OpenCL objects shared by everything in a program, created once
+// by get_opencl_runtime for the device selected by, in order of
+// precedence, the command line (opencl_runtime_args), the environment
+// and the defaults:
+//   --platform N       DISCOVERY_PLATFORM      platform 0
+//   --device N         DISCOVERY_DEVICE        REQUESTED_DEVICE
+//   --device-type T    DISCOVERY_DEVICE_TYPE   gpu
+//   --partition P      DISCOVERY_PARTITION     none
+//   --sub-device N     DISCOVERY_SUB_DEVICE    0
+// where T is one of the names of parse_device_type, e.g. to run the
+// benchmarks on a CPU OpenCL implementation without a GPU. The context
+// and queues are created on first use (opencl_runtime_context and
+// opencl_runtime_queue_index) and released by release_opencl_runtime.
+//
+// A partition P splits the device with clCreateSubDevices and the
+// runtime uses sub-device N of it, so that several instances of a
+// program can share a big CPU device, each with its own discovery
+// context and occupancy. P is one of (see runtime_partition_device):
+//   equally:K          sub-devices of K compute units each
+//   affinity:D         one sub-device per affinity domain D: numa, l4,
+//                      l3, l2, l1 or next (next partitionable, the
+//                      default for a bare "affinity")
+typedef struct {
   cl_platform_id platform;
-  cl_device_id dev[MAX_DEVICES];
-  cl_uint num_devices;
+  cl_device_id device;
+
+  // The number of sub-devices the selected device was split into and
+  // the index of `device` among them, or 0 and 0 without a partition
+  cl_uint num_sub_devices;
+  int sub_device;
+
+  cl_context context;
+  cl_command_queue queues[RUNTIME_MAX_QUEUES];
+  cl_command_queue_properties queue_properties[RUNTIME_MAX_QUEUES];
+  int queue_index[RUNTIME_MAX_QUEUES];
+  int num_queues;
+
+  // Device info, queried once so that it outlives the device
+  char device_name[512];
+  char device_vendor[512];
+  char device_version[512];
+  char driver_version[512];
+  cl_uint max_compute_units;
+  cl_uint max_clock_frequency;
+  cl_ulong global_mem_size;
+  cl_ulong local_mem_size;
+  size_t max_work_group_size;
+
+  // Compile options common to every program (see get_compile_opts),
+  // empty until first asked for
+  char compile_opts[COMPILE_OPTS_SIZE];
+} opencl_runtime;
+
+static opencl_runtime runtime_instance;
+static int runtime_created = 0;
+
+// Selection from the command line, -1 (NULL for the type) if not given
+static int runtime_platform_arg = -1;
+static int runtime_device_arg = -1;
+static const char *runtime_device_type_arg = NULL;
+static const char *runtime_partition_arg = NULL;
+static int runtime_sub_device_arg = -1;
+
+// Reads the device selection options of get_opencl_runtime from the
+// command line and removes them from argv, so that programs parse
+// their own arguments as before. Call before anything uses the device.
+void opencl_runtime_args(int *argc, char **argv) {
+  int i, kept = 1;
+  for (i = 1; i < *argc; i++) {
+    if (i + 1 < *argc && strcmp(argv[i], "--platform") == 0) {
+      runtime_platform_arg = atoi(argv[++i]);
+    }
+    else if (i + 1 < *argc && strcmp(argv[i], "--device") == 0) {
+      runtime_device_arg = atoi(argv[++i]);
+    }
+    else if (i + 1 < *argc && strcmp(argv[i], "--device-type") == 0) {
+      runtime_device_type_arg = argv[++i];
+    }
+    else if (i + 1 < *argc && strcmp(argv[i], "--partition") == 0) {
+      runtime_partition_arg = argv[++i];
+    }
+    else if (i + 1 < *argc && strcmp(argv[i], "--sub-device") == 0) {
+      runtime_sub_device_arg = atoi(argv[++i]);
+    }
+    else {
+      argv[kept++] = argv[i];
+    }
+  }
+  *argc = kept;
+  argv[kept] = NULL;
+}
+
+// Returns the command line value if given, else that of the environment
+// variable `name` if set, else `def`
+int runtime_selection(int arg, const char *name, int def) {
+  const char *env = getenv(name);
+  if (arg >= 0) { return arg; }
+  if (env != NULL) { return atoi(env); }
+  return def;
+}
+
+// Splits the runtime device as described by `partition` (see
+// opencl_runtime) and makes sub-device `index` the runtime device
+void runtime_partition_device(opencl_runtime *runtime, const char *partition, int index) {
+#ifdef CL_VERSION_1_2
+  cl_device_partition_property properties[3] = {0, 0, 0};
+  const char *domain = strchr(partition, ':');
+  domain = (domain == NULL) ? "next" : domain + 1;
 
-  SAFE_CALL(clGetPlatformIDs(1, &platform, NULL));
-  SAFE_CALL(clGetDeviceIDs(platform, CL_DEVICE_TYPE_GPU, MAX_DEVICES, dev, &num_devices));
+  if (strncmp(partition, "equally:", 8) == 0 && atoi(domain) > 0) {
+    properties[0] = CL_DEVICE_PARTITION_EQUALLY;
+    properties[1] = atoi(domain);
+  }
+  else if (strncmp(partition, "affinity", 8) == 0) {
+    properties[0] = CL_DEVICE_PARTITION_BY_AFFINITY_DOMAIN;
+    if (strcmp(domain, "numa") == 0) { properties[1] = CL_DEVICE_AFFINITY_DOMAIN_NUMA; }
+    if (strcmp(domain, "l4") == 0) { properties[1] = CL_DEVICE_AFFINITY_DOMAIN_L4_CACHE; }
+    if (strcmp(domain, "l3") == 0) { properties[1] = CL_DEVICE_AFFINITY_DOMAIN_L3_CACHE; }
+    if (strcmp(domain, "l2") == 0) { properties[1] = CL_DEVICE_AFFINITY_DOMAIN_L2_CACHE; }
+    if (strcmp(domain, "l1") == 0) { properties[1] = CL_DEVICE_AFFINITY_DOMAIN_L1_CACHE; }
+    if (strcmp(domain, "next") == 0) { properties[1] = CL_DEVICE_AFFINITY_DOMAIN_NEXT_PARTITIONABLE; }
+  }
+  if (properties[1] == 0) {
+    printf("error: unknown device partition %s\n", partition);
+    exit(1);
+  }
 
-  if(REQUESTED_DEVICE >= num_devices) {
+  cl_uint num_sub_devices;
+  if (clCreateSubDevices(runtime->device, properties, 0, NULL, &num_sub_devices) < 0) {
+    printf("error: the device can't be partitioned as %s\n", partition);
+    exit(1);
+  }
+  if (index < 0 || index >= (int) num_sub_devices) {
+    printf("error: sub-device %d requested, the partition has %u\n", index, num_sub_devices);
+    exit(1);
+  }
+
+  cl_device_id *sub_devices = (cl_device_id *) malloc(num_sub_devices * sizeof(cl_device_id));
+  SAFE_CALL(clCreateSubDevices(runtime->device, properties, num_sub_devices, sub_devices, NULL));
+  for (cl_uint i = 0; i < num_sub_devices; i++) {
+    if ((int) i != index) {
+      clReleaseDevice(sub_devices[i]);
+    }
+  }
+
+  runtime->device = sub_devices[index];
+  runtime->num_sub_devices = num_sub_devices;
+  runtime->sub_device = index;
+  free(sub_devices);
+#else
+  printf("error: device partitions need OpenCL 1.2\n");
+  exit(1);
+#endif
+}
+
+// Returns the runtime, selecting the platform and device the first time
+opencl_runtime * get_opencl_runtime() {
+  opencl_runtime *runtime = &runtime_instance;
+  if (runtime_created) {
+    return runtime;
+  }
+
+  int platform_index = runtime_selection(runtime_platform_arg, "DISCOVERY_PLATFORM", 0);
+  int device_index = runtime_selection(runtime_device_arg, "DISCOVERY_DEVICE", REQUESTED_DEVICE);
+  const char *type = runtime_device_type_arg;
+  if (type == NULL) {
+    type = getenv("DISCOVERY_DEVICE_TYPE");
+  }
+  cl_device_type device_type = (type == NULL) ? CL_DEVICE_TYPE_GPU : parse_device_type(type);
+
+  cl_uint num_platforms, num_devices;
+  SAFE_CALL(clGetPlatformIDs(0, NULL, &num_platforms));
+  if (platform_index < 0 || platform_index >= (int) num_platforms) {
+    perror("Requested platform not available.");
+    exit(1);
+  }
+  cl_platform_id *platforms = (cl_platform_id *) malloc(num_platforms * sizeof(cl_platform_id));
+  SAFE_CALL(clGetPlatformIDs(num_platforms, platforms, NULL));
+  runtime->platform = platforms[platform_index];
+  free(platforms);
+
+  SAFE_CALL(clGetDeviceIDs(runtime->platform, device_type, 0, NULL, &num_devices));
+  if (device_index < 0 || device_index >= (int) num_devices) {
     perror("Requested device not available.");
     exit(1);
   }
+  cl_device_id *devices = (cl_device_id *) malloc(num_devices * sizeof(cl_device_id));
+  SAFE_CALL(clGetDeviceIDs(runtime->platform, device_type, num_devices, devices, NULL));
+  runtime->device = devices[device_index];
+  free(devices);
 
-  return dev[REQUESTED_DEVICE];
+  runtime->num_sub_devices = 0;
+  runtime->sub_device = 0;
+  const char *partition = runtime_partition_arg;
+  if (partition == NULL) {
+    partition = getenv("DISCOVERY_PARTITION");
+  }
+  if (partition != NULL && partition[0] != '\0') {
+    runtime_partition_device(runtime, partition,
+                             runtime_selection(runtime_sub_device_arg, "DISCOVERY_SUB_DEVICE", 0));
+  }
+
+  clGetDeviceInfo(runtime->device, CL_DEVICE_NAME, sizeof(runtime->device_name), runtime->device_name, NULL);
+  clGetDeviceInfo(runtime->device, CL_DEVICE_VENDOR, sizeof(runtime->device_vendor), runtime->device_vendor, NULL);
+  clGetDeviceInfo(runtime->device, CL_DEVICE_VERSION, sizeof(runtime->device_version), runtime->device_version, NULL);
+  clGetDeviceInfo(runtime->device, CL_DRIVER_VERSION, sizeof(runtime->driver_version), runtime->driver_version, NULL);
+  clGetDeviceInfo(runtime->device, CL_DEVICE_MAX_COMPUTE_UNITS, sizeof(cl_uint), &runtime->max_compute_units, NULL);
+  clGetDeviceInfo(runtime->device, CL_DEVICE_MAX_CLOCK_FREQUENCY, sizeof(cl_uint), &runtime->max_clock_frequency, NULL);
+  clGetDeviceInfo(runtime->device, CL_DEVICE_GLOBAL_MEM_SIZE, sizeof(cl_ulong), &runtime->global_mem_size, NULL);
+  clGetDeviceInfo(runtime->device, CL_DEVICE_LOCAL_MEM_SIZE, sizeof(cl_ulong), &runtime->local_mem_size, NULL);
+  clGetDeviceInfo(runtime->device, CL_DEVICE_MAX_WORK_GROUP_SIZE, sizeof(size_t), &runtime->max_work_group_size, NULL);
+
+  runtime->context = NULL;
+  runtime->num_queues = 0;
+  runtime->compile_opts[0] = '\0';
+  runtime_created = 1;
+  return runtime;
+}
+
+// Returns the context of the runtime device, creating it the first time
+cl_context opencl_runtime_context() {
+  opencl_runtime *runtime = get_opencl_runtime();
+  if (runtime->context == NULL) {
+    int err;
+    runtime->context = clCreateContext(NULL, 1, &runtime->device, NULL, NULL, &err);
+    if (err < 0) { perror("Couldn't create OpenCL context"); exit(1); }
+  }
+  return runtime->context;
+}
+
+// Returns queue `index` of those with `properties` (e.g.
+// CL_QUEUE_PROFILING_ENABLE) on the runtime context, creating it the
+// first time. Queues with different indices are independent, e.g. for
+// kernels that run at the same time, each with a slot of a
+// discovery_ctx_pool.
+cl_command_queue opencl_runtime_queue_index(cl_command_queue_properties properties, int index) {
+  opencl_runtime *runtime = get_opencl_runtime();
+  int i;
+  for (i = 0; i < runtime->num_queues; i++) {
+    if (runtime->queue_properties[i] == properties && runtime->queue_index[i] == index) {
+      return runtime->queues[i];
+    }
+  }
+  if (runtime->num_queues == RUNTIME_MAX_QUEUES) {
+    printf("error: too many command queues\n");
+    exit(1);
+  }
+
+  int err;
+  cl_command_queue queue = clCreateCommandQueue(opencl_runtime_context(), runtime->device, properties, &err);
+  if (err < 0) { perror("failed create command queue"); exit(1); }
+  runtime->queues[runtime->num_queues] = queue;
+  runtime->queue_properties[runtime->num_queues] = properties;
+  runtime->queue_index[runtime->num_queues] = index;
+  runtime->num_queues++;
+  return queue;
+}
+
+// Returns the first queue with `properties` (see opencl_runtime_queue_index)
+cl_command_queue opencl_runtime_queue(cl_command_queue_properties properties) {
+  return opencl_runtime_queue_index(properties, 0);
+}
+
+// Releases the queues and context of the runtime, and the sub-device
+// it created if the device was partitioned. The device info stays
+// available, e.g. for print_device_info, but nothing else can be
+// created on the runtime afterwards.
+void release_opencl_runtime() {
+  if (!runtime_created) {
+    return;
+  }
+  opencl_runtime *runtime = &runtime_instance;
+  int i;
+  for (i = 0; i < runtime->num_queues; i++) {
+    SAFE_CALL(clReleaseCommandQueue(runtime->queues[i]));
+  }
+  runtime->num_queues = 0;
+  if (runtime->context != NULL) {
+    SAFE_CALL(clReleaseContext(runtime->context));
+    runtime->context = NULL;
+  }
+#ifdef CL_VERSION_1_2
+  if (runtime->num_sub_devices > 0 && runtime->device != NULL) {
+    SAFE_CALL(clReleaseDevice(runtime->device));
+    runtime->device = NULL;
+  }
+#endif
+}
+
+// Returns the device selected for the runtime (see get_opencl_runtime)
+cl_device_id create_device() {
+  return get_opencl_runtime()->device;
+}
+
+// Reads a whole file into a NUL-terminated buffer that the caller
+// frees. Returns NULL if the file can't be opened.
+char * read_file(const char* filename, size_t *size) {
+  FILE *handle = fopen(filename, "rb");
+  if (handle == NULL) {
+    return NULL;
+  }
+  fseek(handle, 0, SEEK_END);
+  *size = ftell(handle);
+  rewind(handle);
+  char *buffer = (char*)malloc(*size + 1);
+  *size = fread(buffer, sizeof(char), *size, handle);
+  buffer[*size] = '\0';
+  fclose(handle);
+  return buffer;
+}
+
+// Program binary cache used by build_program. Set the
+// DISCOVERY_CL_CACHE environment variable to a directory to enable
+// it. Entries are keyed by the device, its driver version, the build
+// options and a hash of the source and every file it includes, so
+// changing any of those builds from source again.
+#define CL_CACHE_MAX_FILES 64
+#define CL_CACHE_PATH_SIZE 1024
+#define CL_CACHE_KEY_SIZE 2048
+
+// Files already hashed for a program
+typedef struct {
+  char files[CL_CACHE_MAX_FILES][CL_CACHE_PATH_SIZE];
+  int num_files;
+} cl_cache_files;
+
+// 64-bit FNV-1a
+unsigned long long cl_cache_hash(unsigned long long hash, const char *data, size_t size) {
+  size_t i;
+  for (i = 0; i < size; i++) {
+    hash ^= (unsigned char) data[i];
+    hash *= 1099511628211ULL;
+  }
+  return hash;
+}
+
+// Returns 1 if the file does exist
+int cl_cache_file_exists(const char *path) {
+  FILE *handle = fopen(path, "rb");
+  if (handle == NULL) {
+    return 0;
+  }
+  fclose(handle);
+  return 1;
+}
+
+// Finds the file for an #include "name" in `from` the way the kernel
+// compiler does: next to `from`, then in each -I directory of
+// `options`. Returns 0 if there is no such file.
+int cl_cache_find_include(const char *from, const char *name, const char *options, char *path) {
+  const char *slash = strrchr(from, '/');
+  int len = (slash == NULL) ? 0 : (int) (slash - from + 1);
+  snprintf(path, CL_CACHE_PATH_SIZE, "%.*s%s", len, from, name);
+  if (cl_cache_file_exists(path)) {
+    return 1;
+  }
+
+  const char *dir = options;
+  while ((dir = strstr(dir, "-I")) != NULL) {
+    dir += 2;
+    while (*dir == ' ') {
+      dir++;
+    }
+    len = (int) strcspn(dir, " ");
+    snprintf(path, CL_CACHE_PATH_SIZE, "%.*s%s%s", len, dir,
+             (len > 0 && dir[len - 1] != '/') ? "/" : "", name);
+    if (cl_cache_file_exists(path)) {
+      return 1;
+    }
+    dir += len;
+  }
+  return 0;
+}
+
+// Adds `filename` and, recursively, every file it includes with quotes
+// to `hash`. Each file is hashed once, as the kernel headers are all
+// #pragma once. An include that can't be found adds its name only.
+// Returns 0 if a file can't be read or there are too many to track.
+int cl_cache_hash_source(const char *filename, const char *options, cl_cache_files *seen, unsigned long long *hash) {
+  int i;
+  for (i = 0; i < seen->num_files; i++) {
+    if (strcmp(seen->files[i], filename) == 0) {
+      return 1;
+    }
+  }
+  if (seen->num_files == CL_CACHE_MAX_FILES) {
+    return 0;
+  }
+  snprintf(seen->files[seen->num_files++], CL_CACHE_PATH_SIZE, "%s", filename);
+
+  size_t size;
+  char *source = read_file(filename, &size);
+  if (source == NULL) {
+    return 0;
+  }
+  *hash = cl_cache_hash(*hash, source, size);
+
+  int ok = 1;
+  char name[CL_CACHE_PATH_SIZE];
+  char path[CL_CACHE_PATH_SIZE];
+  const char *line = source;
+  while (ok && line != NULL) {
+    const char *p = line + strspn(line, " \t");
+    if (*p == '#') {
+      p += 1 + strspn(p + 1, " \t");
+      if (strncmp(p, "include", 7) == 0) {
+        p += 7 + strspn(p + 7, " \t");
+        if (*p == '"') {
+          int len = (int) strcspn(p + 1, "\"\n");
+          snprintf(name, sizeof(name), "%.*s", len, p + 1);
+          if (cl_cache_find_include(filename, name, options, path)) {
+            ok = cl_cache_hash_source(path, options, seen, hash);
+          }
+          else {
+            *hash = cl_cache_hash(*hash, name, strlen(name));
+          }
+        }
+      }
+    }
+    line = strchr(line, '\n');
+    if (line != NULL) {
+      line++;
+    }
+  }
+
+  free(source);
+  return ok;
+}
+
+// Writes the cache key of a program into `key` and the path of its
+// entry into `path`. Returns 0 if the cache is disabled or the source
+// can't be hashed.
+int cl_cache_entry(cl_device_id dev, const char* filename, const char* options, char *key, char *path) {
+  const char *dir = getenv("DISCOVERY_CL_CACHE");
+  if (dir == NULL || dir[0] == '\0') {
+    return 0;
+  }
+
+  unsigned long long hash = 14695981039346656037ULL;
+  cl_cache_files *seen = (cl_cache_files *) malloc(sizeof(cl_cache_files));
+  seen->num_files = 0;
+  int ok = cl_cache_hash_source(filename, options, seen, &hash);
+  free(seen);
+  if (!ok) {
+    return 0;
+  }
+
+  char name[512], version[512], driver[512];
+  clGetDeviceInfo(dev, CL_DEVICE_NAME, sizeof(name), name, NULL);
+  clGetDeviceInfo(dev, CL_DEVICE_VERSION, sizeof(version), version, NULL);
+  clGetDeviceInfo(dev, CL_DRIVER_VERSION, sizeof(driver), driver, NULL);
+  snprintf(key, CL_CACHE_KEY_SIZE, "%s\n%s\n%s\n%s\n%016llx", name, version, driver, options, hash);
+
+  snprintf(path, CL_CACHE_PATH_SIZE, "%s/%016llx.bin", dir, cl_cache_hash(14695981039346656037ULL, key, strlen(key)));
+  return 1;
+}
+
+// Builds the program from the cache entry at `path`. An entry holds its
+// key, to tell hash collisions apart, followed by the binary. Returns
+// NULL if there is no entry for `key` or the driver rejects the binary.
+cl_program cl_cache_load(cl_context ctx, cl_device_id dev, const char* options, const char *key, const char *path) {
+  size_t size;
+  char *entry = read_file(path, &size);
+  if (entry == NULL) {
+    return NULL;
+  }
+
+  size_t key_size = strlen(key) + 1;
+  if (size <= key_size || memcmp(entry, key, key_size) != 0) {
+    free(entry);
+    return NULL;
+  }
+
+  const unsigned char *binary = (const unsigned char *) entry + key_size;
+  size_t binary_size = size - key_size;
+  cl_int status, err;
+  cl_program program = clCreateProgramWithBinary(ctx, 1, &dev, &binary_size, &binary, &status, &err);
+  free(entry);
+  if (err < 0 || status < 0) {
+    return NULL;
+  }
+
+  if (clBuildProgram(program, 1, &dev, options, NULL, NULL) < 0) {
+    clReleaseProgram(program);
+    return NULL;
+  }
+  return program;
+}
+
+// Stores the binary of a built program in the cache entry at `path`
+void cl_cache_store(cl_program program, const char *key, const char *path) {
+  size_t binary_size = 0;
+  if (clGetProgramInfo(program, CL_PROGRAM_BINARY_SIZES, sizeof(size_t), &binary_size, NULL) < 0 || binary_size == 0) {
+    return;
+  }
+
+  unsigned char *binary = (unsigned char *) malloc(binary_size);
+  if (clGetProgramInfo(program, CL_PROGRAM_BINARIES, sizeof(unsigned char *), &binary, NULL) >= 0) {
+    // Write a temporary file next to the entry and rename it into place,
+    // so that concurrent runs never read a partly written entry
+    char tmp_path[CL_CACHE_PATH_SIZE + 32];
+    snprintf(tmp_path, sizeof(tmp_path), "%s.%ld.tmp", path, (long) getpid());
+    FILE *handle = fopen(tmp_path, "wb");
+    if (handle != NULL) {
+      int ok = fwrite(key, sizeof(char), strlen(key) + 1, handle) == strlen(key) + 1;
+      ok = ok && fwrite(binary, sizeof(unsigned char), binary_size, handle) == binary_size;
+      ok = (fclose(handle) == 0) && ok;
+      if (!ok || rename(tmp_path, path) != 0) {
+        remove(tmp_path);
+      }
+    }
+  }
+  free(binary);
 }
 
 // Given a file name, options, and an OpenCL context and device: build the program.
-// Outputs compilation errors if they are encountered
+// Outputs compilation errors if they are encountered. Uses the binary
+// cache (see DISCOVERY_CL_CACHE above) when it is enabled, falling back
+// to compiling the source if there is no usable entry.
 cl_program build_program(cl_context ctx, cl_device_id dev, const char* filename, const char* options) {
 
   cl_program program;
-  FILE *program_handle;
   char *program_buffer, *program_log;
   size_t program_size, log_size;
   int err = 0;
 
-  program_handle = fopen(filename, "r");
-  if(program_handle == NULL) {
+  char key[CL_CACHE_KEY_SIZE];
+  char path[CL_CACHE_PATH_SIZE];
+  int cached = cl_cache_entry(dev, filename, options, key, path);
+  if (cached) {
+    program = cl_cache_load(ctx, dev, options, key, path);
+    if (program != NULL) {
+      return program;
+    }
+  }
+
+  program_buffer = read_file(filename, &program_size);
+  if(program_buffer == NULL) {
     perror("Couldn't find the program file");
     exit(1);
   }
-  fseek(program_handle, 0, SEEK_END);
-  program_size = ftell(program_handle);
-  rewind(program_handle);
-  program_buffer = (char*)malloc(program_size + 1);
-  program_buffer[program_size] = '\0';
-  fread(program_buffer, sizeof(char), program_size, program_handle);
-  fclose(program_handle);
 
   program = clCreateProgramWithSource(ctx, 1,
 				      (const char** )&program_buffer, &program_size, &err);
@@ -101,6 +611,10 @@ cl_program build_program(cl_context ctx, cl_device_id dev, const char* filename,
     exit(1);
   }
 
+  if (cached) {
+    cl_cache_store(program, key, path);
+  }
+
   free(program_buffer);
   return program;
 }
@@ -118,20 +632,25 @@ int parse_int(char *p) {
 // Get compile options. If OpenCL 2.0 is available, then the
 // built-in atomics are used. Otherwise use custom atomics.
 // Additionally some compiler bugs (??) require a different
-// loop structure to be used. We define them here.
+// loop structure to be used. We define them here. The options are
+// worked out once and kept in the runtime.
 void get_compile_opts(char * opts) {
-  cl_device_id device = create_device();
-  char buffer[512];
+  opencl_runtime *runtime = get_opencl_runtime();
+  const char *buffer;
+
+  if (runtime->compile_opts[0] != '\0') {
+    strcpy(opts, runtime->compile_opts);
+    return;
+  }
 
   opts[0] = '\0';
   
-  clGetDeviceInfo(device, CL_DEVICE_VERSION, sizeof(buffer), buffer, NULL);
-  if (strstr(buffer, "OpenCL 2.0") != 0) {
+  if (strstr(runtime->device_version, "OpenCL 2.0") != 0) {
     strcat(opts, "-cl-std=CL2.0");
   }
   else {
     strcat(opts, "-DCUSTOM_ATOMICS");
-    clGetDeviceInfo(device, CL_DEVICE_VENDOR, sizeof(buffer), buffer, NULL);
+    buffer = runtime->device_vendor;
     if (strcmp("NVIDIA Corporation", buffer) == 0) {
       strcat(opts, " -DNVIDIA");
     }    
@@ -147,7 +666,7 @@ void get_compile_opts(char * opts) {
   strcat(opts, " -I");
   strcat(opts, STRINGIFY(CL_ACTIVE_GROUP_PATH));
 
-  clGetDeviceInfo(device, CL_DEVICE_NAME, sizeof(buffer), buffer, NULL);
+  buffer = runtime->device_name;
   if (strcmp("Quadro K5200", buffer) == 0) {
     strcat(opts, " -DNO_MIS_LOOP");
   }
@@ -161,6 +680,45 @@ void get_compile_opts(char * opts) {
   strcat(opts, " -DINT_TYPE=int");
   strcat(opts, " -DATOMIC_INT_TYPE=atomic_int");
 
+  // Forward the discovery protocol and barrier build options
+  // (DiscoveryOptions.cmake) to the kernel compiler
+#if defined(TREE_BARRIER)
+  strcat(opts, " -DTREE_BARRIER");
+#endif
+#if defined(BAR_TREE_ARITY)
+  strcat(opts, " -DBAR_TREE_ARITY=" STRINGIFY(BAR_TREE_ARITY));
+#endif
+#if defined(BAR_FLAG_STRIDE)
+  strcat(opts, " -DBAR_FLAG_STRIDE=" STRINGIFY(BAR_FLAG_STRIDE));
+#endif
+#if defined(SPIN_POLICY)
+  strcat(opts, " -DSPIN_POLICY=" STRINGIFY(SPIN_POLICY));
+#endif
+#if defined(DISCOVERY_TRACE)
+  strcat(opts, " -DDISCOVERY_TRACE");
+#endif
+#if defined(DISCOVERY_TRACE_EVENTS)
+  strcat(opts, " -DDISCOVERY_TRACE_EVENTS=" STRINGIFY(DISCOVERY_TRACE_EVENTS));
+#endif
+#if defined(DISCOVERY_STATS)
+  strcat(opts, " -DDISCOVERY_STATS");
+#endif
+#if defined(DISCOVERY_GUIDED_SCHEDULE)
+  strcat(opts, " -DDISCOVERY_GUIDED_SCHEDULE");
+#endif
+#if defined(QUEUE_LOCK)
+  strcat(opts, " -DQUEUE_LOCK");
+#endif
+#if defined(LOCK_FREE_PROTOCOL)
+  strcat(opts, " -DLOCK_FREE_PROTOCOL");
+#endif
+#if defined(DISCOVERY_MODE)
+  strcat(opts, " -DDISCOVERY_MODE=" STRINGIFY(DISCOVERY_MODE));
+#endif
+#if defined(DISCOVERY_FIXED_GROUPS)
+  strcat(opts, " -DDISCOVERY_FIXED_GROUPS=" STRINGIFY(DISCOVERY_FIXED_GROUPS));
+#endif
+
 #if defined(LONESTAR_CL_INCLUDE)
   strcat(opts, " -I");
   strcat(opts, STRINGIFY(LONESTAR_CL_INCLUDE));
@@ -169,6 +727,7 @@ void get_compile_opts(char * opts) {
   strcat(opts, STRINGIFY(KERNEL_DIR));
 #endif
 
+  strcpy(runtime->compile_opts, opts);
 }
 
 // Get compiler options for when the workgroup
@@ -181,37 +740,40 @@ void get_compile_opts_wgs(char * opts, int wgs) {
 }
 
 // Get the compile options for testing different mutex
-// implementations for occupancy_tests
+// implementations for occupancy_tests. 0 selects the spin lock,
+// 1 the ticket lock, 2 the lock-free protocol and 3 the queue lock. The kernels check
+// the skip flag of the context (see init_discovery_kernel_ctx_skip)
+// unless the build chose a protocol mode other than discover.
 void get_compile_opts_occupancy_tests(char * opts, int bak) {
   get_compile_opts(opts);
+#if !defined(DISCOVERY_MODE) || DISCOVERY_MODE == 0
+  strcat(opts, " -DDISCOVERY_RUNTIME_SKIP");
+#endif
   if (bak == 0) {
     strcat(opts, " -DSPIN_LOCK");
   }
+  if (bak == 2) {
+    strcat(opts, " -DLOCK_FREE_PROTOCOL");
+  }
+  if (bak == 3) {
+    strcat(opts, " -DQUEUE_LOCK");
+  }
 }
 
 // Print useful information about the device. 
 void print_device_info() {
-  cl_device_id device = create_device();
-  char buffer[512];
-  cl_uint buf_uint;
-  cl_ulong buf_ulong;
+  opencl_runtime *runtime = get_opencl_runtime();
   printf("\n  -- device info --\n");
-  clGetDeviceInfo(device, CL_DEVICE_NAME, sizeof(buffer), buffer, NULL);
-  printf("DEVICE_NAME:                %s\n", buffer);
-  clGetDeviceInfo(device, CL_DEVICE_VENDOR, sizeof(buffer), buffer, NULL);
-  printf("DEVICE_VENDOR:              %s\n", buffer);
-  clGetDeviceInfo(device, CL_DEVICE_VERSION, sizeof(buffer), buffer, NULL);
-  printf("DEVICE_VERSION:             %s\n", buffer);
-  clGetDeviceInfo(device, CL_DRIVER_VERSION, sizeof(buffer), buffer, NULL);
-  printf("DRIVER_VERSION:             %s\n", buffer);
-  clGetDeviceInfo(device, CL_DEVICE_MAX_COMPUTE_UNITS, sizeof(buf_uint), &buf_uint, NULL);
-  printf("DEVICE_MAX_COMPUTE_UNITS:   %u\n", (unsigned int)buf_uint);
-  clGetDeviceInfo(device, CL_DEVICE_MAX_CLOCK_FREQUENCY, sizeof(buf_uint), &buf_uint, NULL);
-  printf("DEVICE_MAX_CLOCK_FREQUENCY: %u\n", (unsigned int)buf_uint);
-  clGetDeviceInfo(device, CL_DEVICE_GLOBAL_MEM_SIZE, sizeof(buf_ulong), &buf_ulong, NULL);
-  printf("DEVICE_GLOBAL_MEM_SIZE:     %llu\n", (unsigned long long)buf_ulong);
-  clGetDeviceInfo(device, CL_DEVICE_LOCAL_MEM_SIZE, sizeof(buf_ulong), &buf_ulong, NULL);
-  printf("DEVICE_LOCAL_MEM_SIZE:      %llu\n", (unsigned long long)buf_ulong);
-  clGetDeviceInfo(device, CL_DEVICE_MAX_WORK_GROUP_SIZE, sizeof(buf_ulong), &buf_ulong, NULL);
-  printf("DEVICE_MAX_WORK_GROUP_SIZE: %llu\n", (unsigned long long)buf_ulong);
+  printf("DEVICE_NAME:                %s\n", runtime->device_name);
+  printf("DEVICE_VENDOR:              %s\n", runtime->device_vendor);
+  printf("DEVICE_VERSION:             %s\n", runtime->device_version);
+  printf("DRIVER_VERSION:             %s\n", runtime->driver_version);
+  if (runtime->num_sub_devices > 0) {
+    printf("SUB_DEVICE:                 %d of %u\n", runtime->sub_device, runtime->num_sub_devices);
+  }
+  printf("DEVICE_MAX_COMPUTE_UNITS:   %u\n", (unsigned int)runtime->max_compute_units);
+  printf("DEVICE_MAX_CLOCK_FREQUENCY: %u\n", (unsigned int)runtime->max_clock_frequency);
+  printf("DEVICE_GLOBAL_MEM_SIZE:     %llu\n", (unsigned long long)runtime->global_mem_size);
+  printf("DEVICE_LOCAL_MEM_SIZE:      %llu\n", (unsigned long long)runtime->local_mem_size);
+  printf("DEVICE_MAX_WORK_GROUP_SIZE: %llu\n", (unsigned long long)runtime->max_work_group_size);
 }
@@ -64,22 +64,18 @@ void write_solution(const char *fname, Graph *hgraph, cl_mem *dist) {
 
 // Init OpenCL utilities
 void init_opencl() {
-  int err;
   device = create_device();
-  context = clCreateContext(NULL, 1, &device, NULL, NULL, &err);
-  CHECK_ERR(err);
-  queue = clCreateCommandQueue(context, device, 0, &err);
-  CHECK_ERR(err);
-  char opts[500];
+  context = opencl_runtime_context();
+  queue = opencl_runtime_queue(0);
+  char opts[COMPILE_OPTS_SIZE];
   get_compile_opts_wgs(opts, wgs);
   prog = build_program(context, device, CL_FILE, opts);
 }
 
 // Clean OpenCL utilities
 void clean_opencl() {
-  clReleaseCommandQueue(queue);
   clReleaseProgram(prog);
-  clReleaseContext(context);
+  release_opencl_runtime();
 }
 
 // Simple function to check if a value is a power of 2
@@ -226,6 +226,7 @@ int main(int argc, char *argv[]) {
   cl_kernel verify;
 
   // Parse and verify args
+  opencl_runtime_args(&argc, argv);
   if (argc != 4) {
     printf("Usage: %s <graph> <workgroup size> <workgroup number>\n", argv[0]);
     exit(1);
@@ -174,18 +174,14 @@ __kernel void drelax2(__global foru *dist,
 
       drelax(dist, graph, gerrno, in, out, gather_offsets, &queue_index, scan_arr, &loc_tmp, iteration, gl_ctx, &local_ctx);
 
-      discovery_barrier(gl_ctx, &local_ctx);
+      // Inter-workgroup barrier, emptying `in` for the next iteration
+      discovery_epoch_barrier(gl_ctx, &local_ctx, in->dindex);
 
       tmp = in;
       in = out;
       out = tmp;
 
-      *(out->dindex) = 0;
-
       iteration++;
-
-      // Tyler: Added to avoid a data-race present in the original code
-      discovery_barrier(gl_ctx, &local_ctx);
     }
   }
 
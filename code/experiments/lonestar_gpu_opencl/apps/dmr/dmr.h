@@ -34,20 +34,16 @@
 
 // Clean up OpenCL utilities
 void clean_opencl() {
-  clReleaseCommandQueue(queue);
   clReleaseProgram(prog);
-  clReleaseContext(context);
+  release_opencl_runtime();
 }
 
 // Initialise OpenCL utilities
 void init_opencl() {
-  int err;
   device = create_device();
-  context = clCreateContext(NULL, 1, &device, NULL, NULL, &err);
-  CHECK_ERR(err);
-  queue = clCreateCommandQueue(context, device, 0, &err);
-  CHECK_ERR(err);
-  char opts[500];
+  context = opencl_runtime_context();
+  queue = opencl_runtime_queue(0);
+  char opts[COMPILE_OPTS_SIZE];
   get_compile_opts(opts);
   prog = build_program(context, device, CL_FILE, opts);
 }
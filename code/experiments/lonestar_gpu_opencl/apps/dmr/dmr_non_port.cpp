@@ -391,6 +391,7 @@ int main(int argc, char *argv[]) {
   int mesh_nodes, mesh_elements;
 
   // Check and parse command line args
+  opencl_runtime_args(&argc, argv);
   if(argc != 5) {
       printf("Usage: %s basefile <workgroup size> <workgroup number> <maxfactor>\n", argv[0]);
       exit(0);
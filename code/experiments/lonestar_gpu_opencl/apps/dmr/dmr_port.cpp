@@ -94,8 +94,7 @@ void refine_mesh(ShMesh &mesh) {
   CHECK_ERR(err);
 
   // Create and initialise discovery protocol context
-  d_gl_ctx = clCreateBuffer(context, CL_MEM_READ_WRITE, sizeof(discovery_kernel_ctx), NULL ,&err);
-  err = init_discovery_kernel_ctx(&prog, &queue, &d_gl_ctx);
+  err = create_discovery_kernel_ctx(&context, &device, &prog, &queue, &d_gl_ctx);
   CHECK_ERR(err);
 
   // Initialise some of the other device buffers
@@ -167,6 +166,10 @@ void refine_mesh(ShMesh &mesh) {
   // Set kernel dimensions
   size_t global_size[3] = {WGN, 0, 0}, local_size[3] = {WGS, 0, 0};
 
+  // refine only needs the groups that participate, so it is sized to
+  // the occupancy recorded by previous runs
+  size_t refine_global_size[3] = {WGS * discovery_launch_groups(&device, &refine, WGS, WGN / WGS), 0, 0};
+
   // Start computation
   starttime = rtclock();
 
@@ -205,7 +208,7 @@ void refine_mesh(ShMesh &mesh) {
                                  refine,
                                  1,
                                  NULL,
-                                 global_size,
+                                 refine_global_size,
                                  local_size,
                                  0,
                                  0,
@@ -323,6 +326,14 @@ void refine_mesh(ShMesh &mesh) {
   printf("\tapp runtime = %f ms.\n", 1000.0f * (endtime - starttime));
   int participating_wgs = number_of_participating_groups(&queue, &d_gl_ctx);
   printf("\tnumber of participating groups = %d\n", participating_wgs);
+  discovery_record_occupancy(&device, &refine, WGS, participating_wgs);
+
+#ifdef DISCOVERY_STATS
+  discovery_run_stats stats;
+  if (discovery_stats(&queue, &d_gl_ctx, &stats) == CL_SUCCESS) {
+    print_discovery_stats(&stats);
+  }
+#endif
 
   // Here we verify that there are no bad triangles in the mesh.  This
   // isn't enough for robust verification of the solution, but it is a
@@ -393,6 +404,7 @@ int main(int argc, char *argv[]) {
   int mesh_nodes, mesh_elements;
 
   // Check and parse command line args
+  opencl_runtime_args(&argc, argv);
   if(argc != 4) {
       printf("Usage: %s basefile <workgroup size> <maxfactor>\n", argv[0]);
       exit(0);
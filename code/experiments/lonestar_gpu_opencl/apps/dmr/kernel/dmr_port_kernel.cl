@@ -57,10 +57,16 @@ __kernel void refine(__global Mesh *mesh,
   int stage = 0;
   int x = 0;
 
+  // The input worklist is not written by this kernel, so the next
+  // item is popped while waiting at the barrier ending each item
+  int next_ele;
+  int has_next = wl_pop_id(wl, id * perthread, &next_ele);
+
   for (eleit = id * perthread; eleit < (id * perthread + perthread) && eleit < ulimit; eleit++, x++) {
 
     FORD cx, cy;
-    haselem = wl_pop_id(wl, eleit, &ele);
+    haselem = has_next;
+    ele = next_ele;
     nc = 0;
     bc = 0;
     stage = 0;
@@ -179,8 +185,11 @@ __kernel void refine(__global Mesh *mesh,
       wl_push(owl, ele);
     }
 
-    // Inter-workgroup barrier
-    discovery_barrier(gl_ctx, &local_ctx);
+    // Inter-workgroup barrier, split so that the next item is popped
+    // while the other groups arrive
+    discovery_barrier_arrive(gl_ctx, &local_ctx);
+    has_next = wl_pop_id(wl, eleit + 1, &next_ele);
+    discovery_barrier_wait(gl_ctx, &local_ctx);
   }
   mesh->nnodes = *nnodes;
   mesh->nelements = *nelements;
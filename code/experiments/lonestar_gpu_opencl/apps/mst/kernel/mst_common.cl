@@ -33,8 +33,8 @@ typedef uint foru;
 #define MYINFINITY 1000000000
 
 #include "graph_cl.h"
-#include "component_cl.h"
 #include "discovery.cl"
+#include "component_cl.h"
 #include "gbar_cl.h"
 
 // Kernel it initialise device side buffers
@@ -104,7 +104,7 @@ __kernel void dfindelemin(__global unsigned *mstwt,             // 0
     if (minwt < minwtcomponent[srcboss] && srcboss != dstboss) {
 
       // Inform boss.
-      foru oldminwt = atomic_min(&(minwtcomponent[srcboss]), minwt);
+      foru oldminwt = atomic_fetch_min_explicit((__global atomic_int *) &(minwtcomponent[srcboss]), minwt, memory_order_relaxed, memory_scope_device);
     }
   }
 }
@@ -136,7 +136,7 @@ __kernel void dfindelemin2(__global unsigned *mstwt,             // 0
           unsigned tempdstboss = cs_find(cs, dst);
 
           if (tempdstboss == partners[id]) { // Cross-component edge.
-            atomic_min(&goaheadnodeofcomponent[srcboss], id);
+            atomic_fetch_min_explicit((__global atomic_int *) &goaheadnodeofcomponent[srcboss], id, memory_order_relaxed, memory_scope_device);
           }
         }
       }
@@ -75,6 +75,7 @@ int main(int argc, char *argv[]) {
   double starttime, endtime;
 
   // Check command line args
+  opencl_runtime_args(&argc, argv);
   if (argc != 4) {
     printf("Usage: %s <graph> <workgroup size> <workgroup number>\n", argv[0]);
     return 1;
@@ -85,15 +86,11 @@ int main(int argc, char *argv[]) {
 
   // Initisatise OpenCL utilities
   device = create_device();
-
-  context = clCreateContext(NULL, 1, &device, NULL, NULL, &err);
-  if (err < 0 ) { perror("Couldn't create OpenCL context"); exit(1); }
-
-  queue = clCreateCommandQueue(context, device, 0, &err);
-  if (err < 0 ) { perror("failed create command queue barrier"); exit(1); }
+  context = opencl_runtime_context();
+  queue = opencl_runtime_queue(0);
 
   // Compile the kernel file
-  char opts[500];
+  char opts[COMPILE_OPTS_SIZE];
   get_compile_opts(opts);
   cl_program prog = build_program(context, device, CL_FILE, opts);
 
@@ -75,6 +75,7 @@ int main(int argc, char *argv[]) {
   double starttime, endtime;
 
   // Check command line args
+  opencl_runtime_args(&argc, argv);
   if (argc != 3) {
     printf("Usage: %s <graph> <workgroup_size>\n", argv[0]);
     return 1;
@@ -84,15 +85,11 @@ int main(int argc, char *argv[]) {
 
   // Initisatise OpenCL utilities
   device = create_device();
-
-  context = clCreateContext(NULL, 1, &device, NULL, NULL, &err);
-  if (err < 0 ) { perror("Couldn't create OpenCL context"); exit(1); }
-
-  queue = clCreateCommandQueue(context, device, 0, &err);
-  if (err < 0 ) { perror("failed create command queue barrier"); exit(1); }
+  context = opencl_runtime_context();
+  queue = opencl_runtime_queue(0);
 
   // Compile the kernel file
-  char opts[500];
+  char opts[COMPILE_OPTS_SIZE];
   get_compile_opts(opts);
   cl_program prog = build_program(context, device, CL_FILE, opts);
 
@@ -106,8 +103,7 @@ int main(int argc, char *argv[]) {
 
   // Create and initialise discovery protocol
   cl_mem d_gl_ctx;
-  d_gl_ctx = clCreateBuffer(context, CL_MEM_READ_WRITE, sizeof(discovery_kernel_ctx), NULL ,&err);
-  err = init_discovery_kernel_ctx(&prog, &queue, &d_gl_ctx);
+  err = create_discovery_kernel_ctx(&context, &device, &prog, &queue, &d_gl_ctx);
   if (err < 0 ) { perror("failed initialising discovery kernel context"); exit(1); }
 
   // Set kernel dimensions
@@ -195,7 +191,8 @@ int main(int argc, char *argv[]) {
   if (err < 0 ) { printf("failed setting kernel arg dfindcompmintwo %d\n", err); exit(1); }
 
   size_t local_work_active[3] =  { awgs,  1, 1};
-  size_t global_work_active[3] = { 1000 * awgs, 1,  1 };
+  // Sized to the occupancy recorded by previous runs
+  size_t global_work_active[3] = { awgs * discovery_launch_groups(&device, &dfindcompmintwo, awgs, 1000), 1,  1 };
 
   // Start kernel computations
   printf("finding mst.\n");
@@ -348,6 +345,14 @@ int main(int argc, char *argv[]) {
 
   int participating_wgs = number_of_participating_groups(&queue, &d_gl_ctx);
   printf("\tnumber of participating groups = %d\n", participating_wgs);
+  discovery_record_occupancy(&device, &dfindcompmintwo, awgs, participating_wgs);
+
+#ifdef DISCOVERY_STATS
+  discovery_run_stats stats;
+  if (discovery_stats(&queue, &d_gl_ctx, &stats) == CL_SUCCESS) {
+    print_discovery_stats(&stats);
+  }
+#endif
 
   // Free up memory and print device info
   free_host_graph(&hgraph);
@@ -73,7 +73,7 @@ foru processedge2(__global foru *dist,
 
 
   if(altdist < dstwt){
-    atomic_min(&dist[*dst], altdist);
+    atomic_fetch_min_explicit((__global atomic_int *) &dist[*dst], altdist, memory_order_relaxed, memory_scope_device);
     return 1;
   }
 
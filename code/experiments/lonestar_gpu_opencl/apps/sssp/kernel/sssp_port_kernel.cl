@@ -179,19 +179,14 @@ __kernel void drelax2(__global foru *dist,
 
       drelax(dist, graph, in, out, gather_offsets, src, scan_arr, &loc_tmp, &queue_index, iteration, gl_ctx, &local_ctx);
 
-      // Inter-workgroup barrier
-      discovery_barrier(gl_ctx, &local_ctx);
+      // Inter-workgroup barrier, emptying `in` for the next iteration
+      discovery_epoch_barrier(gl_ctx, &local_ctx, in->dindex);
 
       tmp = in;
       in = out;
       out = tmp;
 
-      *(out->dindex) = 0;
-
       iteration++;
-
-      // Inter-workgroup barrier
-      discovery_barrier(gl_ctx, &local_ctx);
     }
   }
 }
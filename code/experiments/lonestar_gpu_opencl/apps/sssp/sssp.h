@@ -31,13 +31,10 @@
 
 // Initialise the OpenCL utilities
 void init_opencl() {
-  int err;
   device = create_device();
-  context = clCreateContext(NULL, 1, &device, NULL, NULL, &err);
-  CHECK_ERR(err);
-  queue = clCreateCommandQueue(context, device, 0, &err);
-  CHECK_ERR(err);
-  char opts[500];
+  context = opencl_runtime_context();
+  queue = opencl_runtime_queue(0);
+  char opts[COMPILE_OPTS_SIZE];
   get_compile_opts_wgs(opts, wgs);
   prog = build_program(context, device, CL_FILE, opts);
 }
@@ -67,9 +64,8 @@ void print_output(const char *filename, cl_command_queue *q, cl_foru *hdist, cl_
 
 // Clean up the OpenCL utilities
 void clean_opencl() {
-  clReleaseCommandQueue(queue);
   clReleaseProgram(prog);
-  clReleaseContext(context);
+  release_opencl_runtime();
 }
 
 // Simple function to check if a value is a power of 2
@@ -97,8 +97,7 @@ void sssp(foru *hdist, cl_mem *dist, Graph *hgraph, cl_mem *dgraph, KernelConfig
 
   // Discovery protocol init
   cl_mem d_gl_ctx;
-  d_gl_ctx = clCreateBuffer(context, CL_MEM_READ_WRITE, sizeof(discovery_kernel_ctx), NULL ,&err);
-  err = init_discovery_kernel_ctx(&prog, &queue, &d_gl_ctx);
+  err = create_discovery_kernel_ctx(&context, &device, &prog, &queue, &d_gl_ctx);
   CHECK_ERR(err);
 
   // Creating and setting args for the main kernel (drelax2)
@@ -137,9 +136,10 @@ void sssp(foru *hdist, cl_mem *dist, Graph *hgraph, cl_mem *dgraph, KernelConfig
 
   CHECK_ERR(err);
 
-  // Update dimensions for the non-init launch of drelax2
+  // Update dimensions for the non-init launch of drelax2, sized to
+  // the occupancy recorded by previous runs
   local_work[0]  = kconf->wgs;
-  global_work[0] = kconf->wgs * 1000;
+  global_work[0] = kconf->wgs * discovery_launch_groups(&device, &drelax2, kconf->wgs, 1000);
 
   // Set iteration = 1 to trigger the non-init launch of drelax2
   iteration = 1;
@@ -166,6 +166,14 @@ void sssp(foru *hdist, cl_mem *dist, Graph *hgraph, cl_mem *dgraph, KernelConfig
   printf("\tapp runtime = %f ms.\n", 1000.0f * (endtime - starttime));
   int participating_wgs = number_of_participating_groups(&queue, &d_gl_ctx);
   printf("\tnumber of participating groups = %d\n", participating_wgs);
+  discovery_record_occupancy(&device, &drelax2, kconf->wgs, participating_wgs);
+
+#ifdef DISCOVERY_STATS
+  discovery_run_stats stats;
+  if (discovery_stats(&queue, &d_gl_ctx, &stats) == CL_SUCCESS) {
+    print_discovery_stats(&stats);
+  }
+#endif
 
   // Clean up device buffers
   clReleaseKernel(drelax2);
@@ -191,6 +199,7 @@ int main(int argc, char *argv[]) {
   cl_kernel init, verify;
 
   // Parse and verify args
+  opencl_runtime_args(&argc, argv);
   if (argc != 3) {
     printf("Usage: %s <graph> <workgroup size>\n", argv[0]);
     exit(1);
@@ -26,7 +26,8 @@ kernel void init_compspace(__global ComponentSpace *cs, __global uint *ncomponen
 }
 
 unsigned cs_isBoss(__global ComponentSpace *cs, unsigned element) {
-  return atomic_cmpxchg(&(cs->ele2comp[element]), element, element) == element;
+  int expected = element;
+  return atomic_compare_exchange_strong_explicit((__global atomic_int *) &(cs->ele2comp[element]), &expected, element, memory_order_relaxed, memory_order_relaxed, memory_scope_device);
 }
 
 unsigned cs_find(__global ComponentSpace *cs, unsigned lelement) {
@@ -63,8 +64,8 @@ int cs_unify(__global ComponentSpace *cs, unsigned one, unsigned two) {
       subordinate = twocomp;
     }
 
-    unsigned oldboss = atomic_cmpxchg(&(cs->ele2comp[subordinate]), subordinate, boss);
-    if (oldboss != subordinate) { // Someone else updated the boss.
+    int oldboss = subordinate;
+    if (!atomic_compare_exchange_strong_explicit((__global atomic_int *) &(cs->ele2comp[subordinate]), &oldboss, boss, memory_order_relaxed, memory_order_relaxed, memory_scope_device)) { // Someone else updated the boss.
 
       // We need not restore the ele2comp[subordinate], as union-find
       // ensures correctness and complen of subordinate doesn't
@@ -75,10 +76,10 @@ int cs_unify(__global ComponentSpace *cs, unsigned one, unsigned two) {
     }
     else {
 
-      atomic_add(&(cs->complen[boss]), cs->complen[subordinate]);
+      atomic_fetch_add_explicit((__global atomic_int *) &(cs->complen[boss]), cs->complen[subordinate], memory_order_relaxed, memory_scope_device);
 
       // A component has reduced.
-      unsigned ncomp = atomic_sub(cs->ncomponents, 1);
+      atomic_fetch_sub_explicit((__global atomic_int *) cs->ncomponents, 1, memory_order_relaxed, memory_scope_device);
       return 1;
     }
   } while (1);
@@ -7,20 +7,27 @@
 
 // Port by Tyler Sorensen (2016)
 
+// Distance, in ints, between consecutive flags. Must match the value
+// the kernels are compiled with (forwarded by get_compile_opts).
+#ifndef BAR_FLAG_STRIDE
+#define BAR_FLAG_STRIDE 1
+#endif
+
 // Call this function to create and initialise a global barrier cl_mem
 // object
 int allocate_and_init_gbar(cl_context *c, cl_command_queue *q, cl_mem *gbar_arr, int wgn) {
 
   int err;
 
-  // Create the flag array
-  *gbar_arr = clCreateBuffer(*c, CL_MEM_READ_WRITE, sizeof(cl_int)*wgn, NULL ,&err);
+  // Create the flag array, with one flag every BAR_FLAG_STRIDE ints
+  int size = wgn * BAR_FLAG_STRIDE;
+  *gbar_arr = clCreateBuffer(*c, CL_MEM_READ_WRITE, sizeof(cl_int)*size, NULL ,&err);
 
   if (err != 0) { return err; }
 
   // Initialise a host side flag array to copy to the device
-  cl_int *zero_array = (int *) malloc(sizeof(cl_int) *wgn);
-  for (int i = 0; i < wgn; i++) {
+  cl_int *zero_array = (int *) malloc(sizeof(cl_int) *size);
+  for (int i = 0; i < size; i++) {
     zero_array[i] = 0;
   }
 
@@ -29,7 +36,7 @@ int allocate_and_init_gbar(cl_context *c, cl_command_queue *q, cl_mem *gbar_arr,
                              *gbar_arr,
                              1,
                              0,
-                             sizeof(cl_int)*wgn,
+                             sizeof(cl_int)*size,
                              zero_array,
                              0,
                              0,
@@ -9,6 +9,17 @@
 
 #pragma once
 
+// For the spin policy (spin_backoff). Found through the discovery
+// protocol include directory (CL_ACTIVE_GROUP_PATH).
+#include "../locks/spin_policy.cl"
+
+// Distance, in ints, between consecutive flags. Padding the flags out
+// to a cache line stops the slaves spinning on neighbouring flags from
+// sharing a line.
+#ifndef BAR_FLAG_STRIDE
+#define BAR_FLAG_STRIDE 1
+#endif
+
 // Call this function to synchronise across all workgroups.  May
 // deadlock if the kernel is launched with more workgroups than the
 // occupancy of the GPU.
@@ -29,7 +40,10 @@ void gbar(__global atomic_int *gbar_arr) {
          peer_block += get_local_size(0)) {
 
       // Wait for the slave
-      while (atomic_load_explicit(&(gbar_arr[peer_block]), memory_order_relaxed, memory_scope_device) == 0);
+      int delay = SPIN_BACKOFF_MIN;
+      while (atomic_load_explicit(&(gbar_arr[peer_block * BAR_FLAG_STRIDE]), memory_order_relaxed, memory_scope_device) == 0) {
+        delay = spin_backoff(delay);
+      }
 
       // Synchronise
       atomic_work_item_fence(CLK_GLOBAL_MEM_FENCE, memory_order_acquire, memory_scope_device);
@@ -41,7 +55,7 @@ void gbar(__global atomic_int *gbar_arr) {
     for (int peer_block = get_local_id(0) + 1; peer_block < get_num_groups(0); peer_block += get_local_size(0)) {
 
       // Release slaves
-      atomic_store_explicit(&(gbar_arr[peer_block]), 0, memory_order_release, memory_scope_device);
+      atomic_store_explicit(&(gbar_arr[peer_block * BAR_FLAG_STRIDE]), 0, memory_order_release, memory_scope_device);
     }
   }
 
@@ -55,10 +69,13 @@ void gbar(__global atomic_int *gbar_arr) {
     if (get_local_id(0) == 0) {
 
       // Mark arrival
-      atomic_store_explicit(&(gbar_arr[id]), 1, memory_order_release, memory_scope_device);
+      atomic_store_explicit(&(gbar_arr[id * BAR_FLAG_STRIDE]), 1, memory_order_release, memory_scope_device);
 
       // Wait to be released by the master
-      while (atomic_load_explicit(&(gbar_arr[id]), memory_order_relaxed, memory_scope_device) == 1);
+      int delay = SPIN_BACKOFF_MIN;
+      while (atomic_load_explicit(&(gbar_arr[id * BAR_FLAG_STRIDE]), memory_order_relaxed, memory_scope_device) == 1) {
+        delay = spin_backoff(delay);
+      }
 
       // Synchronise
       atomic_work_item_fence(CLK_GLOBAL_MEM_FENCE, memory_order_acquire, memory_scope_device);
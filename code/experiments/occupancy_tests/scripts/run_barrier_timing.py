@@ -0,0 +1,152 @@
+# Script to compare the latency of the inter-workgroup barrier for
+# different barrier flag strides (the BAR_FLAG_STRIDE build option).
+# args are: 'number of iterations' followed by one or more 'path to
+# the executables', each path being a build configured with a
+# different BAR_FLAG_STRIDE, e.g. -DBAR_FLAG_STRIDE=1 and 16.
+
+import sys
+import os
+import re
+import subprocess
+
+EXE_PATHS = []
+ITERATIONS = 0
+INCREMENT = 8
+BARRIERS = "10000"
+
+def get_stride_occ_and_time(s):
+
+    ret = re.findall("barrier flag stride: \d+", s)
+    assert(len(ret) == 1)
+    stride = re.findall("\d+", ret[0])[0]
+
+    ret = re.findall("kernel ran with a total of \d+ workgroups", s)
+    assert(len(ret) == 1)
+    occ = re.findall("\d+", ret[0])[0]
+
+    ret = re.findall("barrier time: -?\d+.\d+", s)
+    assert(len(ret) == 1)
+    time = re.findall("-?\d+.\d+", ret[0])[0]
+
+    return stride,occ,time
+
+def my_exec(exe):
+    print "running command: " + " ".join(exe)
+    p_obj = subprocess.Popen(exe, stdout=subprocess.PIPE, stderr=subprocess.PIPE)
+    ret_code = p_obj.wait()
+    sout, serr = p_obj.communicate()
+    if (ret_code != 0):
+        print "Error running " + " ".join(exe)
+        exit(ret_code)
+
+    print serr
+    return sout
+
+def run_device_query():
+    exe = os.path.join(EXE_PATHS[0],"device_query")
+    p_obj = subprocess.Popen(exe, stdout=subprocess.PIPE, stderr=subprocess.PIPE)
+    ret_code = p_obj.wait()
+    sout, serr = p_obj.communicate()
+    print sout
+    return sout
+
+def avg(l):
+    return reduce(lambda x, y: x + y, l) / float(len(l))
+
+def avg_run_barrier_time(cmd, wgs, lms):
+    exe = [cmd, wgs, lms, BARRIERS]
+    ret = []
+    ret_occ = []
+    stride = None
+    for i in range(int(ITERATIONS)):
+        output = my_exec(exe)
+        stride,occ,time = get_stride_occ_and_time(output)
+        ret.append(float(time))
+        ret_occ.append(float(occ))
+        print "found " + occ + " workgroups"
+        print "found " + time + " us per barrier"
+    return stride,avg(ret),avg(ret_occ)
+
+def get_gpu_info():
+
+    data = run_device_query()
+
+    ret = re.findall("DEVICE_NAME: .*", data)
+    assert(len(ret) == 1)
+    device = ret[0]
+    device = " ".join(device.split(" ")[1:]).lstrip()
+
+    ret = re.findall("DEVICE_MAX_WORK_GROUP_SIZE: .*", data)
+    assert(len(ret) == 1)
+    wgs = ret[0]
+    ret2 = re.findall("\d+", wgs)
+    assert(len(ret2) == 1)
+    wgs = ret2[0]
+
+    return device,wgs
+
+def get_max_wgs(gpu_data):
+    return int(gpu_data[1])
+
+def clamp(x):
+    if x == 0:
+        return 1
+    return x
+
+def run_timing(gpu_data):
+    wgs = 0
+    ret = []
+    strides = []
+    for x in range((get_max_wgs(gpu_data)/INCREMENT)+1):
+        wgs = clamp(x * INCREMENT)
+        line = [str(wgs)]
+        strides = []
+        for path in EXE_PATHS:
+            cmd = os.path.join(path,"time_barrier")
+            stride,time,occ = avg_run_barrier_time(cmd, str(wgs), str(1))
+            strides.append(stride)
+            line.extend([str(time),str(occ)])
+        ret.append(line)
+    return strides,ret
+
+def mk_header(strides):
+    header = ["wgs"]
+    for stride in strides:
+        header.extend(["stride_" + stride + "_avg_time", "stride_" + stride + "_avg_occ"])
+    return " ".join(header)
+
+def print_to_file(gpu_data,strides,data):
+    fname = gpu_data[0].replace(" ", "_") + "_barrier_timing.txt"
+    fname = fname.replace("\r", "")
+    fname = fname.replace("(", "_")
+    fname = fname.replace(")", "_")
+
+    s1 = mk_header(strides)
+    str_list = [s1]
+    for d in data:
+        line = " ".join(d)
+        str_list.append(line)
+
+    to_write = "\n".join(str_list)
+    f = open(fname,"w")
+    f.write(to_write)
+    f.close()
+
+def main():
+
+    global EXE_PATHS
+    global ITERATIONS
+
+    if len(sys.argv) < 3:
+        print "Please provide the follwing arguments:"
+        print "iterations path_to_executables [path_to_executables ...]"
+        return 1
+
+    ITERATIONS = sys.argv[1]
+    EXE_PATHS = sys.argv[2:]
+    gpu_data = get_gpu_info()
+    strides,data = run_timing(gpu_data)
+    print_to_file(gpu_data,strides,data)
+
+if __name__ == '__main__':
+    sys.exit(main())
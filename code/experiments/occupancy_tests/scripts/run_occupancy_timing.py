@@ -76,6 +76,32 @@ def avg_run_ticket_time(cmd, wgs, lms):
         print "found " + time + " time"
     return avg(ret),avg(ret_occ)
 
+def avg_run_lock_free_time(cmd, wgs, lms):
+    exe = [cmd, "1000", wgs, lms, "2"]
+    ret = []
+    ret_occ = []
+    for i in range(int(ITERATIONS)):
+        output = my_exec(exe)
+        occ,time = get_part_group_and_time(output)
+        ret.append(float(time))
+        ret_occ.append(float(occ))
+        print "found " + occ + " workgroups"
+        print "found " + time + " time"
+    return avg(ret),avg(ret_occ)
+
+def avg_run_queue_time(cmd, wgs, lms):
+    exe = [cmd, "1000", wgs, lms, "3"]
+    ret = []
+    ret_occ = []
+    for i in range(int(ITERATIONS)):
+        output = my_exec(exe)
+        occ,time = get_part_group_and_time(output)
+        ret.append(float(time))
+        ret_occ.append(float(occ))
+        print "found " + occ + " workgroups"
+        print "found " + time + " time"
+    return avg(ret),avg(ret_occ)
+
 def avg_run_spin_time(cmd, wgs, lms):
     exe = [cmd, "1000", wgs, lms, "0"]
     ret = []
@@ -150,11 +176,13 @@ def run_timing(gpu_data):
         true_occ_est = run_ticket_max_occ(cmd, str(wgs), str(1))
         time_ticket,occ_ticket = avg_run_ticket_time(cmd, str(wgs), str(1))
         time_spin,occ_spin = avg_run_spin_time(cmd, str(wgs), str(1))
-        ret.append((str(true_occ_est),str(time_ticket),str(time_spin), str(occ_ticket),str(occ_spin)))
+        time_lock_free,occ_lock_free = avg_run_lock_free_time(cmd, str(wgs), str(1))
+        time_queue,occ_queue = avg_run_queue_time(cmd, str(wgs), str(1))
+        ret.append((str(true_occ_est),str(time_ticket),str(time_spin), str(occ_ticket),str(occ_spin),str(time_lock_free),str(occ_lock_free),str(time_queue),str(occ_queue)))
     return ret    
 
 def mk_header(gpu_data):
-    return "true_occ ticket_avg_time spin_avg_time ticket_avg_occ spin_avg_occ"
+    return "true_occ ticket_avg_time spin_avg_time ticket_avg_occ spin_avg_occ lock_free_avg_time lock_free_avg_occ queue_avg_time queue_avg_occ"
 
 def print_to_file(gpu_data,data):
     fname = gpu_data[0].replace(" ", "_") + "_timing.txt"
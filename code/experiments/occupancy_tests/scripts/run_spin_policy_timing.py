@@ -0,0 +1,188 @@
+# Script to compare the spin policies of the lock and barrier spin
+# loops (the SPIN_POLICY build option) on the current device.
+# args are: 'number of iterations' followed by one or more 'path to
+# the executables', each path being a build configured with a
+# different SPIN_POLICY, e.g. -DSPIN_POLICY=0, 1 and 2.
+# For each policy, times the discovery protocol with the ticket lock,
+# the spin lock and the queue lock (time_prot) and the barrier
+# (time_barrier), writes the averages per workgroup size to a file,
+# and reports the policy with the lowest total time for each.
+
+import sys
+import os
+import re
+import subprocess
+
+EXE_PATHS = []
+ITERATIONS = 0
+INCREMENT = 32
+BARRIERS = "10000"
+POLICY_NAMES = {"0": "plain", "1": "backoff", "2": "proportional"}
+
+# Benchmark name, executable and the arguments after the workgroup
+# size and local memory size
+BENCHMARKS = [("ticket_lock", "time_prot", ["1"]),
+              ("spin_lock", "time_prot", ["0"]),
+              ("queue_lock", "time_prot", ["3"]),
+              ("barrier", "time_barrier", [BARRIERS])]
+
+def get_policy_and_time(s, exe):
+
+    ret = re.findall("spin policy: \d+", s)
+    assert(len(ret) == 1)
+    policy = re.findall("\d+", ret[0])[0]
+
+    if exe == "time_barrier":
+        ret = re.findall("barrier time: -?\d+.\d+", s)
+    else:
+        ret = re.findall("kernel time: \d+.\d+", s)
+    if len(ret) != 1:
+        return policy,None
+    time = re.findall("-?\d+.\d+", ret[0])[0]
+
+    return policy,time
+
+def my_exec(exe):
+    print "running command: " + " ".join(exe)
+    p_obj = subprocess.Popen(exe, stdout=subprocess.PIPE, stderr=subprocess.PIPE)
+    ret_code = p_obj.wait()
+    sout, serr = p_obj.communicate()
+    if (ret_code != 0):
+        print "Error running " + " ".join(exe)
+        exit(ret_code)
+
+    print serr
+    return sout
+
+def run_device_query():
+    exe = os.path.join(EXE_PATHS[0],"device_query")
+    p_obj = subprocess.Popen(exe, stdout=subprocess.PIPE, stderr=subprocess.PIPE)
+    ret_code = p_obj.wait()
+    sout, serr = p_obj.communicate()
+    print sout
+    return sout
+
+def avg(l):
+    return reduce(lambda x, y: x + y, l) / float(len(l))
+
+def avg_run_time(path, exe, wgs, lms, args):
+    cmd = [os.path.join(path, exe)]
+    if exe == "time_prot":
+        cmd.append("1000")
+    cmd.extend([wgs, lms] + args)
+    ret = []
+    policy = None
+    for i in range(int(ITERATIONS)):
+        time = None
+        # The unfair spin lock occasionally fails to report, re-try
+        while time == None:
+            output = my_exec(cmd)
+            policy,time = get_policy_and_time(output, exe)
+        ret.append(float(time))
+        print "found " + time + " time"
+    return policy,avg(ret)
+
+def get_gpu_info():
+
+    data = run_device_query()
+
+    ret = re.findall("DEVICE_NAME: .*", data)
+    assert(len(ret) == 1)
+    device = ret[0]
+    device = " ".join(device.split(" ")[1:]).lstrip()
+
+    ret = re.findall("DEVICE_MAX_WORK_GROUP_SIZE: .*", data)
+    assert(len(ret) == 1)
+    wgs = ret[0]
+    ret2 = re.findall("\d+", wgs)
+    assert(len(ret2) == 1)
+    wgs = ret2[0]
+
+    return device,wgs
+
+def get_max_wgs(gpu_data):
+    return int(gpu_data[1])
+
+def clamp(x):
+    if x == 0:
+        return 1
+    return x
+
+# Returns the policies in the order of EXE_PATHS and, per workgroup
+# size, the average time of every benchmark for every policy
+def run_timing(gpu_data):
+    ret = []
+    policies = []
+    for x in range((get_max_wgs(gpu_data)/INCREMENT)+1):
+        wgs = clamp(x * INCREMENT)
+        line = [str(wgs)]
+        policies = []
+        for path in EXE_PATHS:
+            for name,exe,args in BENCHMARKS:
+                policy,time = avg_run_time(path, exe, str(wgs), str(1), args)
+                line.append(str(time))
+            policies.append(policy)
+        ret.append(line)
+    return policies,ret
+
+def policy_name(policy):
+    return POLICY_NAMES.get(policy, "policy_" + policy)
+
+def mk_header(policies):
+    header = ["wgs"]
+    for policy in policies:
+        for name,exe,args in BENCHMARKS:
+            header.append(policy_name(policy) + "_" + name + "_avg_time")
+    return " ".join(header)
+
+# The policy with the lowest time summed over the workgroup sizes,
+# for each benchmark
+def winners(policies, data):
+    ret = []
+    for b in range(len(BENCHMARKS)):
+        totals = []
+        for p in range(len(policies)):
+            column = 1 + p * len(BENCHMARKS) + b
+            totals.append(sum([float(d[column]) for d in data]))
+        best = totals.index(min(totals))
+        ret.append((BENCHMARKS[b][0], policy_name(policies[best])))
+    return ret
+
+def print_to_file(gpu_data,policies,data):
+    fname = gpu_data[0].replace(" ", "_") + "_spin_policy_timing.txt"
+    fname = fname.replace("\r", "")
+    fname = fname.replace("(", "_")
+    fname = fname.replace(")", "_")
+
+    s1 = mk_header(policies)
+    str_list = [s1]
+    for d in data:
+        line = " ".join(d)
+        str_list.append(line)
+
+    to_write = "\n".join(str_list)
+    f = open(fname,"w")
+    f.write(to_write)
+    f.close()
+
+def main():
+
+    global EXE_PATHS
+    global ITERATIONS
+
+    if len(sys.argv) < 3:
+        print "Please provide the follwing arguments:"
+        print "iterations path_to_executables [path_to_executables ...]"
+        return 1
+
+    ITERATIONS = sys.argv[1]
+    EXE_PATHS = sys.argv[2:]
+    gpu_data = get_gpu_info()
+    policies,data = run_timing(gpu_data)
+    print_to_file(gpu_data,policies,data)
+
+    for name,policy in winners(policies, data):
+        print "best spin policy for " + name + " on " + gpu_data[0] + ": " + policy
+
+if __name__ == '__main__':
+    sys.exit(main())
@@ -7,6 +7,7 @@
 
 int main(int argc, char **argv) {
 
+  opencl_runtime_args(&argc, argv);
   print_device_info();
   
   return 0;
@@ -0,0 +1,358 @@
+// Benchmark suite for the discovery protocol and the inter-workgroup
+// barrier. Sweeps the number of groups launched, the workgroup size,
+// the amount of local memory, the mutex (spin lock, ticket lock, queue
+// lock or lock-free protocol) and the barrier (XF or combining tree).
+// The kernels are rebuilt for each mutex and barrier, so one run covers
+// them all. For each point it reports the protocol latency, the
+// latency of a barrier (the barrier kernel time minus the protocol
+// time, per barrier) and barriers per second, over a number of timed
+// runs that follow some warm-up runs. Results are written as JSON or
+// CSV.
+//
+// Options, all optional (lists are comma separated):
+//   -g groups launched        (default 8,64,1000)
+//   -w workgroup sizes        (default 64,256)
+//   -l local memory sizes     (default 1)
+//   -m mutexes                (spin,ticket,queue,lock_free)
+//   -b barriers               (xf,tree)
+//   -n barriers per run       (default 1000)
+//   -r timed runs             (default 10)
+//   -u warm-up runs           (default 2)
+//   -f output format          (json or csv, default json)
+//   -o output file            (default stdout)
+//
+// The device is selected with --platform, --device and --device-type
+// or the matching environment variables, e.g. --device-type cpu to run
+// on a CPU OpenCL implementation (see get_opencl_runtime in
+// my_opencl.h).
+
+#include "stdio.h"
+#include "stdlib.h"
+#include <math.h>
+
+#include "my_opencl.h"
+#include "discovery.h"
+
+#define BENCH_MAX_VALUES 32
+
+char * CL_FILE= STRINGIFY(KERNEL_DIR) "occupancy_test.cl";
+
+// A build variant of the kernels and the options selecting it
+typedef struct {
+  const char *name;
+  const char *opts;
+} bench_variant;
+
+// A build with QUEUE_LOCK always uses the queue lock (or the lock-free
+// protocol), and one with LOCK_FREE_PROTOCOL the lock-free protocol
+bench_variant mutexes[] = {
+#if defined(LOCK_FREE_PROTOCOL)
+  {"lock_free", ""},
+#elif !defined(QUEUE_LOCK)
+  {"spin", " -DSPIN_LOCK"},
+  {"ticket", ""},
+  {"queue", " -DQUEUE_LOCK"},
+  {"lock_free", " -DLOCK_FREE_PROTOCOL"},
+#else
+  {"queue", ""},
+  {"lock_free", " -DLOCK_FREE_PROTOCOL"},
+#endif
+};
+
+// A build with TREE_BARRIER always uses the tree barrier
+bench_variant barriers[] = {
+#if !defined(TREE_BARRIER)
+  {"xf", ""},
+#endif
+  {"tree", " -DTREE_BARRIER"},
+};
+
+#define NUM_VARIANTS(v) (sizeof(v) / sizeof(bench_variant))
+
+// Mean, minimum and standard deviation of a set of timings
+typedef struct {
+  double mean;
+  double min;
+  double stddev;
+} bench_summary;
+
+// Parses a comma separated list of ints into `values`. Returns the
+// number of values.
+int parse_int_list(char *list, int *values) {
+  int count = 0;
+  for (char *value = strtok(list, ","); value != NULL && count < BENCH_MAX_VALUES; value = strtok(NULL, ",")) {
+    values[count++] = parse_int(value);
+  }
+  return count;
+}
+
+// Returns 1 if `name` is in the comma separated `list`
+int in_list(const char *list, const char *name) {
+  size_t length = strlen(name);
+  for (const char *p = strstr(list, name); p != NULL; p = strstr(p + 1, name)) {
+    if ((p == list || p[-1] == ',') && (p[length] == ',' || p[length] == '\0')) {
+      return 1;
+    }
+  }
+  return 0;
+}
+
+bench_summary summarise(double *times, int n) {
+  bench_summary s = {0, times[0], 0};
+  for (int i = 0; i < n; i++) {
+    s.mean += times[i] / n;
+    if (times[i] < s.min) { s.min = times[i]; }
+  }
+  for (int i = 0; i < n; i++) {
+    s.stddev += (times[i] - s.mean) * (times[i] - s.mean) / n;
+  }
+  s.stddev = sqrt(s.stddev);
+  return s;
+}
+
+// Runs `kernel` with `groups` groups of `wgs` threads on a freshly
+// initialised context for `capacity` groups and returns the kernel
+// time in ns in `time`
+int time_kernel(cl_program *p, cl_command_queue *q, cl_kernel *k, int groups, int wgs, cl_mem *gl_ctx, cl_int capacity, double *time) {
+  int err;
+
+  err = init_discovery_kernel_ctx_capacity(p, q, gl_ctx, 0, capacity);
+  if (err < 0) { return err; }
+
+  const size_t global_size = groups * wgs;
+  const size_t local_size = wgs;
+  cl_event event;
+
+  err = clEnqueueNDRangeKernel(*q, *k, 1, NULL, &global_size, &local_size, 0, 0, &event);
+  if (err < 0) { return err; }
+  err = clWaitForEvents(1, &event);
+  if (err < 0) { return err; }
+
+  cl_ulong time_start, time_end;
+
+  clGetEventProfilingInfo(event, CL_PROFILING_COMMAND_START, sizeof(time_start), &time_start, NULL);
+  clGetEventProfilingInfo(event, CL_PROFILING_COMMAND_END, sizeof(time_end), &time_end, NULL);
+  *time = time_end - time_start;
+
+  clReleaseEvent(event);
+  return CL_SUCCESS;
+}
+
+// Warms up then times `runs` runs of `kernel`, in us
+int time_runs(cl_program *p, cl_command_queue *q, cl_kernel *k, int groups, int wgs, cl_mem *gl_ctx, cl_int capacity, int warm_up, int runs, double *times) {
+  double time;
+  int err;
+
+  for (int i = 0; i < warm_up; i++) {
+    err = time_kernel(p, q, k, groups, wgs, gl_ctx, capacity, &time);
+    if (err < 0) { return err; }
+  }
+  for (int i = 0; i < runs; i++) {
+    err = time_kernel(p, q, k, groups, wgs, gl_ctx, capacity, &time);
+    if (err < 0) { return err; }
+    times[i] = time / 1000.0;
+  }
+  return CL_SUCCESS;
+}
+
+void write_header(FILE *fp, int csv, cl_device_id device) {
+  char name[256], driver[256];
+  clGetDeviceInfo(device, CL_DEVICE_NAME, sizeof(name), name, NULL);
+  clGetDeviceInfo(device, CL_DRIVER_VERSION, sizeof(driver), driver, NULL);
+
+  if (csv) {
+    fprintf(fp, "device,driver,mutex,barrier,groups,wgs,lms,participating_groups,"
+            "protocol_us_mean,protocol_us_min,protocol_us_stddev,"
+            "barrier_us_mean,barrier_us_min,barrier_us_stddev,barriers_per_second\n");
+  }
+  else {
+    fprintf(fp, "{\n\"device\": \"%s\",\n\"driver\": \"%s\",\n\"results\": [", name, driver);
+  }
+}
+
+void write_result(FILE *fp, int csv, int *first, cl_device_id device, const char *mutex, const char *barrier,
+                  int groups, int wgs, int lms, int participating, bench_summary prot, bench_summary bar) {
+  double per_second = bar.mean > 0 ? 1000000.0 / bar.mean : 0;
+
+  if (csv) {
+    char name[256], driver[256];
+    clGetDeviceInfo(device, CL_DEVICE_NAME, sizeof(name), name, NULL);
+    clGetDeviceInfo(device, CL_DRIVER_VERSION, sizeof(driver), driver, NULL);
+    fprintf(fp, "\"%s\",\"%s\",%s,%s,%d,%d,%d,%d,%f,%f,%f,%f,%f,%f,%f\n",
+            name, driver, mutex, barrier, groups, wgs, lms, participating,
+            prot.mean, prot.min, prot.stddev, bar.mean, bar.min, bar.stddev, per_second);
+  }
+  else {
+    fprintf(fp, "%s\n  {\"mutex\": \"%s\", \"barrier\": \"%s\", \"groups\": %d, \"wgs\": %d, \"lms\": %d, "
+            "\"participating_groups\": %d, "
+            "\"protocol_us\": {\"mean\": %f, \"min\": %f, \"stddev\": %f}, "
+            "\"barrier_us\": {\"mean\": %f, \"min\": %f, \"stddev\": %f}, "
+            "\"barriers_per_second\": %f}",
+            *first ? "" : ",", mutex, barrier, groups, wgs, lms, participating,
+            prot.mean, prot.min, prot.stddev, bar.mean, bar.min, bar.stddev, per_second);
+  }
+  *first = 0;
+}
+
+int main(int argc, char **argv) {
+
+  char group_list[256] = "8,64,1000", wgs_list[256] = "64,256", lms_list[256] = "1";
+  const char *mutex_list = "spin,ticket,queue,lock_free", *barrier_list = "xf,tree";
+  const char *format = "json", *output = NULL;
+  int iterations = 1000, runs = 10, warm_up = 2;
+  int err;
+
+  opencl_runtime_args(&argc, argv);
+  for (int i = 1; i + 1 < argc; i += 2) {
+    switch (argv[i][0] == '-' ? argv[i][1] : 0) {
+    case 'g': strncpy(group_list, argv[i + 1], sizeof(group_list) - 1); break;
+    case 'w': strncpy(wgs_list, argv[i + 1], sizeof(wgs_list) - 1); break;
+    case 'l': strncpy(lms_list, argv[i + 1], sizeof(lms_list) - 1); break;
+    case 'm': mutex_list = argv[i + 1]; break;
+    case 'b': barrier_list = argv[i + 1]; break;
+    case 'n': iterations = parse_int(argv[i + 1]); break;
+    case 'r': runs = parse_int(argv[i + 1]); break;
+    case 'u': warm_up = parse_int(argv[i + 1]); break;
+    case 'f': format = argv[i + 1]; break;
+    case 'o': output = argv[i + 1]; break;
+    default:
+      fprintf(stderr, "unknown option %s, see the top of discovery_bench.c\n", argv[i]);
+      return 1;
+    }
+  }
+  if (argc % 2 == 0) {
+    fprintf(stderr, "option %s needs a value\n", argv[argc - 1]);
+    return 1;
+  }
+  if (runs < 1 || iterations < 1) {
+    fprintf(stderr, "need at least one run and one barrier per run\n");
+    return 1;
+  }
+
+  int groups[BENCH_MAX_VALUES], wgs[BENCH_MAX_VALUES], lms[BENCH_MAX_VALUES];
+  int num_groups = parse_int_list(group_list, groups);
+  int num_wgs = parse_int_list(wgs_list, wgs);
+  int num_lms = parse_int_list(lms_list, lms);
+  int csv = strcmp(format, "csv") == 0;
+
+  FILE *fp = stdout;
+  if (output != NULL) {
+    fp = fopen(output, "w");
+    if (fp == NULL) { perror("Couldn't open the output file"); exit(1); }
+  }
+
+  cl_device_id device = create_device();
+  cl_context context = opencl_runtime_context();
+
+  cl_command_queue queue = opencl_runtime_queue(CL_QUEUE_PROFILING_ENABLE);
+
+  cl_ulong max_lms;
+  size_t max_wgs;
+  clGetDeviceInfo(device, CL_DEVICE_LOCAL_MEM_SIZE, sizeof(max_lms), &max_lms, NULL);
+  clGetDeviceInfo(device, CL_DEVICE_MAX_WORK_GROUP_SIZE, sizeof(max_wgs), &max_wgs, NULL);
+
+  // Room for every launched group, as in time_prot, and for the slots
+  // of the queue lock if it is benchmarked. Every variant is
+  // initialised with the same capacity.
+  cl_int capacity = discovery_default_capacity(device);
+  for (int i = 0; i < num_groups; i++) {
+    if (capacity < groups[i]) { capacity = groups[i]; }
+  }
+  int queue_lock = strstr(mutex_list, "queue") != NULL;
+  size_t ctx_size = discovery_kernel_ctx_size_arrays(capacity, discovery_group_arrays(queue_lock));
+  cl_mem d_gl_ctx = clCreateBuffer(context, CL_MEM_READ_WRITE, ctx_size, NULL, &err);
+  if (err < 0 ) { perror("Couldn't create buffer"); exit(1); }
+
+  double *prot_times = (double *) malloc(runs * sizeof(double));
+  double *bar_times = (double *) malloc(runs * sizeof(double));
+
+  write_header(fp, csv, device);
+  int first = 1;
+
+  for (size_t m = 0; m < NUM_VARIANTS(mutexes); m++) {
+    if (!in_list(mutex_list, mutexes[m].name)) { continue; }
+
+    for (size_t b = 0; b < NUM_VARIANTS(barriers); b++) {
+      if (!in_list(barrier_list, barriers[b].name)) { continue; }
+
+      char opts[COMPILE_OPTS_SIZE];
+      get_compile_opts(opts);
+      strcat(opts, mutexes[m].opts);
+      strcat(opts, barriers[b].opts);
+      fprintf(stderr, "building %s mutex, %s barrier: %s\n", mutexes[m].name, barriers[b].name, opts);
+
+      cl_program program = build_program(context, device, CL_FILE, opts);
+
+      cl_kernel prot_kernel = clCreateKernel(program, "run_prot", &err);
+      if (err < 0 ) { perror("Couldn't get kernel run_prot"); exit(1); }
+      cl_kernel bar_kernel = clCreateKernel(program, "run_barrier", &err);
+      if (err < 0 ) { perror("Couldn't get kernel run_barrier"); exit(1); }
+
+      size_t kernel_wgs;
+      clGetKernelWorkGroupInfo(bar_kernel, device, CL_KERNEL_WORK_GROUP_SIZE, sizeof(kernel_wgs), &kernel_wgs, NULL);
+      if (kernel_wgs > max_wgs) { kernel_wgs = max_wgs; }
+
+      for (int w = 0; w < num_wgs; w++) {
+        if (wgs[w] < 1 || (size_t) wgs[w] > kernel_wgs) {
+          fprintf(stderr, "skipping workgroup size %d\n", wgs[w]);
+          continue;
+        }
+
+        for (int l = 0; l < num_lms; l++) {
+          if (lms[l] < 1 || (cl_ulong) lms[l] > max_lms) {
+            fprintf(stderr, "skipping local memory size %d\n", lms[l]);
+            continue;
+          }
+
+          err = clSetKernelArg(prot_kernel, 0, sizeof(cl_mem), &d_gl_ctx);
+          err |= clSetKernelArg(prot_kernel, 1, lms[l], NULL);
+          err |= clSetKernelArg(bar_kernel, 0, sizeof(cl_mem), &d_gl_ctx);
+          err |= clSetKernelArg(bar_kernel, 1, lms[l], NULL);
+          err |= clSetKernelArg(bar_kernel, 2, sizeof(cl_int), &iterations);
+          if (err < 0 ) { fprintf(stderr, "error setting kernel args %d\n", err); exit(1); }
+
+          for (int g = 0; g < num_groups; g++) {
+            fprintf(stderr, "running %d groups of %d threads, %d bytes of local memory\n", groups[g], wgs[w], lms[l]);
+
+            err = time_runs(&program, &queue, &prot_kernel, groups[g], wgs[w], &d_gl_ctx, capacity, warm_up, runs, prot_times);
+            if (err < 0 ) { fprintf(stderr, "error running run_prot %d\n", err); exit(1); }
+            bench_summary prot = summarise(prot_times, runs);
+
+            err = time_runs(&program, &queue, &bar_kernel, groups[g], wgs[w], &d_gl_ctx, capacity, warm_up, runs, bar_times);
+            if (err < 0 ) { fprintf(stderr, "error running run_barrier %d\n", err); exit(1); }
+            for (int i = 0; i < runs; i++) {
+              bar_times[i] = (bar_times[i] - prot.mean) / iterations;
+            }
+            bench_summary bar = summarise(bar_times, runs);
+
+            int participating = number_of_participating_groups(&queue, &d_gl_ctx);
+            write_result(fp, csv, &first, device, mutexes[m].name, barriers[b].name,
+                         groups[g], wgs[w], lms[l], participating, prot, bar);
+          }
+        }
+      }
+
+      clReleaseKernel(prot_kernel);
+      clReleaseKernel(bar_kernel);
+      clReleaseProgram(program);
+    }
+  }
+
+  if (!csv) {
+    fprintf(fp, "\n]\n}\n");
+  }
+  if (fp != stdout) {
+    fclose(fp);
+  }
+
+  // Cleanup
+  free(prot_times);
+  free(bar_times);
+
+  err = clReleaseMemObject(d_gl_ctx);
+  if (err != CL_SUCCESS) {perror("OpenCL Error"); exit(1);}
+
+  release_opencl_runtime();
+
+  return 0;
+}
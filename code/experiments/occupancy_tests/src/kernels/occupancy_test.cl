@@ -16,3 +16,42 @@ __kernel void run_prot(__global discovery_kernel_ctx *gl_ctx, __local void* loc_
   DISCOVERY_PROTOCOL(gl_ctx);
 }
 //
+
+// This kernel runs the protocol followed by a number of
+// barriers. This is for timing the barrier.
+__kernel void run_barrier(__global discovery_kernel_ctx *gl_ctx, __local void* loc_mem, int iterations) {
+  DISCOVERY_PROTOCOL(gl_ctx);
+  for (int i = 0; i < iterations; i++) {
+    discovery_barrier(gl_ctx, &local_ctx);
+  }
+}
+
+// Fills out[0 .. n - 1] with start, start + 1, ... as a stand-in for
+// the work of a query
+void fill_query(__global discovery_kernel_ctx *gl_ctx, __local discovery_local_ctx *local_ctx, __global int *out, int n, int start) {
+  DISCOVERY_FOR_EACH(gl_ctx, local_ctx, i, n) {
+    out[i] = start + i;
+  }
+}
+
+// This kernel runs one query per launch. This is for timing queries
+// that are relaunched, against run_server.
+__kernel void run_query(__global discovery_kernel_ctx *gl_ctx, __local void* loc_mem, __global int *out, int n, int start) {
+  DISCOVERY_PROTOCOL(gl_ctx);
+  fill_query(gl_ctx, &local_ctx, out, n, start);
+}
+
+#ifndef CUSTOM_ATOMICS
+
+// This kernel stays resident and serves the queries the host submits
+// to `ring` (command arg: n, slot: start). This is for timing the
+// latency of a query in server mode.
+__kernel void run_server(__global discovery_kernel_ctx *gl_ctx, __local void* loc_mem, __global discovery_command_ring *ring, __global int *out) {
+  DISCOVERY_PROTOCOL(gl_ctx);
+  discovery_command cmd;
+  DISCOVERY_SERVE(gl_ctx, &local_ctx, ring, cmd) {
+    fill_query(gl_ctx, &local_ctx, out, cmd.arg, cmd.slot);
+  }
+}
+
+#endif
@@ -1,6 +1,7 @@
 // Program to test the occupancy of the GPU.
 // Takes in the number of workgroups, size of workgroups, amount of local memory, 
-// a flag if the protocol is enabled, and a flag for which mutex to use. 
+// a flag if the protocol is enabled, and a flag for which mutex to use
+// (0: spin lock, 1: ticket lock, 2: lock-free protocol, 3: queue lock). 
 // Reports the number of discovered groups (or potentially deadlocks if the 
 // protocol is disabled and the requested resources is too much to run concurrently). 
 
@@ -20,11 +21,12 @@ char * CL_FILE= STRINGIFY(KERNEL_DIR) "occupancy_test.cl";
 
 int main(int argc, char **argv) {
 
-  int wgc, wgs, lms, prot, ticket;
+  int wgc, wgs, lms, prot, mutex;
   int err;
 
+  opencl_runtime_args(&argc, argv);
   if (argc != 6) {
-    printf("please provide number of workgroups, workgroup size, local memory size, flag for protocol, flag for ticket lock\n");
+    printf("please provide number of workgroups, workgroup size, local memory size, flag for protocol, flag for mutex type (0: spin lock, 1: ticket lock, 2: lock-free, 3: queue lock)\n");
     return 0;
   }
   
@@ -32,15 +34,14 @@ int main(int argc, char **argv) {
   wgs = parse_int(argv[2]);
   lms = parse_int(argv[3]);
   prot = parse_int(argv[4]);
-  ticket = parse_int(argv[5]);
-  printf("running with\nworkgroup count: %d\nworkgroup size: %d\nlocal memory size: %d\nprotocol enabled: %d\nusing ticket lock: %d\n", wgc, wgs,lms,prot,ticket);
+  mutex = parse_int(argv[5]);
+  printf("running with\nworkgroup count: %d\nworkgroup size: %d\nlocal memory size: %d\nprotocol enabled: %d\nmutex type: %d\n", wgc, wgs,lms,prot,mutex);
 
   device = create_device();
-  context = clCreateContext(NULL, 1, &device, NULL, NULL, &err);
-  if (err < 0 ) { perror("Couldn't create OpenCL context"); exit(1); }
+  context = opencl_runtime_context();
 
-  char opts[200];
-  get_compile_opts_occupancy_tests(opts, ticket);
+  char opts[COMPILE_OPTS_SIZE];
+  get_compile_opts_occupancy_tests(opts, mutex);
   printf("compiler options are: %s\n", opts);
 
   program = build_program(context, device, CL_FILE, opts);
@@ -49,17 +50,22 @@ int main(int argc, char **argv) {
   if (err < 0 ) { perror("Couldn't get kernel run_test_static"); exit(1); }
 
   cl_mem d_gl_ctx;
-  d_gl_ctx = clCreateBuffer(context, CL_MEM_READ_WRITE, sizeof(discovery_kernel_ctx), NULL ,&err);
+  // Every launched group takes part in the barrier when the protocol
+  // is skipped, so the context needs a flag for each of them. The
+  // queue lock keeps a per-group array of slots in it as well.
+  cl_int capacity = discovery_default_capacity(device);
+  if (capacity < wgc) { capacity = wgc; }
+  size_t ctx_size = discovery_kernel_ctx_size_arrays(capacity, discovery_group_arrays(mutex == 3));
+  d_gl_ctx = clCreateBuffer(context, CL_MEM_READ_WRITE, ctx_size, NULL ,&err);
   if (err < 0 ) { perror("Couldn't create buffer"); exit(1); }
       
-  queue = clCreateCommandQueue(context, device, CL_QUEUE_PROFILING_ENABLE, &err);
-  if (err < 0 ) { perror("failed create command queue barrier"); exit(1); }
+  queue = opencl_runtime_queue(CL_QUEUE_PROFILING_ENABLE);
 
   err = clSetKernelArg(kernel, 0, sizeof(cl_mem), &d_gl_ctx);
   err |= clSetKernelArg(kernel, 1, lms, NULL);
   if (err < 0 ) { printf("error set_arg0 %d\n", err); exit(1); }
 
-  err = init_discovery_kernel_ctx_skip(&program, &queue, &d_gl_ctx, !prot);
+  err = init_discovery_kernel_ctx_capacity(&program, &queue, &d_gl_ctx, !prot, capacity);
   if (err < 0) { perror("failed kernel context"); exit(1); }
 
   size_t global_size = wgs * wgc, local_size = wgs;
@@ -73,14 +79,10 @@ int main(int argc, char **argv) {
   err = clReleaseMemObject(d_gl_ctx);
   if (err != CL_SUCCESS) {perror("OpenCL Error"); exit(1);}
 
-  err = clReleaseCommandQueue(queue);
-  if (err != CL_SUCCESS) {perror("OpenCL Error"); exit(1);}
-
   err = clReleaseProgram(program);
   if (err != CL_SUCCESS) {perror("OpenCL Error"); exit(1);}
 
-  err = clReleaseContext(context);
-  if (err != CL_SUCCESS) {perror("OpenCL Error"); exit(1);}
+  release_opencl_runtime();
   
   printf("\n\n");
   print_device_info();
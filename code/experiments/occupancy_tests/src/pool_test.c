@@ -0,0 +1,118 @@
+// Program to test the context pool with concurrent kernels.
+// Takes in the number of workgroups, size of workgroups, amount of local memory
+// and a flag for which mutex to use (0: spin lock, 1: ticket lock,
+// 2: lock-free protocol, 3: queue lock). Runs the discovery protocol in
+// two kernels on two queues at the same time, each with a slot of a
+// context pool, and reports the number of discovered groups of each.
+// Fails if a kernel discovered no groups or more than it launched.
+
+#include "stdio.h"
+#include "stdlib.h"
+
+#include "my_opencl.h"
+#include "discovery.h"
+
+#define POOL_KERNELS 2
+
+cl_device_id device;
+cl_context context;
+cl_program program;
+cl_command_queue queues[POOL_KERNELS];
+cl_kernel kernels[POOL_KERNELS];
+
+char * CL_FILE= STRINGIFY(KERNEL_DIR) "occupancy_test.cl";
+
+int main(int argc, char **argv) {
+
+  int wgc, wgs, lms, mutex;
+  int err, i, failed = 0;
+
+  opencl_runtime_args(&argc, argv);
+  if (argc != 5) {
+    printf("please provide number of workgroups, workgroup size, local memory size, flag for mutex type (0: spin lock, 1: ticket lock, 2: lock-free, 3: queue lock)\n");
+    return 0;
+  }
+
+  wgc = parse_int(argv[1]);
+  wgs = parse_int(argv[2]);
+  lms = parse_int(argv[3]);
+  mutex = parse_int(argv[4]);
+  printf("running with\nworkgroup count: %d\nworkgroup size: %d\nlocal memory size: %d\nmutex type: %d\nkernels: %d\n", wgc, wgs, lms, mutex, POOL_KERNELS);
+
+  // Pool slots are sized for the host's options, so the queue lock
+  // needs the host to be built with it (see discovery_group_arrays).
+  if (discovery_group_arrays(mutex == 3) != discovery_group_arrays(0)) {
+    printf("the queue lock needs a build with QUEUE_LOCK=ON\n");
+    return 1;
+  }
+
+  device = create_device();
+  context = opencl_runtime_context();
+
+  char opts[COMPILE_OPTS_SIZE];
+  get_compile_opts_occupancy_tests(opts, mutex);
+  printf("compiler options are: %s\n", opts);
+
+  program = build_program(context, device, CL_FILE, opts);
+
+  // Independent queues, so the kernels can run at the same time
+  for (i = 0; i < POOL_KERNELS; i++) {
+    queues[i] = opencl_runtime_queue_index(0, i);
+  }
+
+  discovery_ctx_pool pool;
+  err = create_discovery_ctx_pool(&context, &device, &program, &queues[0], &pool, POOL_KERNELS);
+  if (err < 0) { printf("couldn't create context pool %d\n", err); exit(1); }
+
+  cl_mem *d_gl_ctx[POOL_KERNELS];
+  for (i = 0; i < POOL_KERNELS; i++) {
+    d_gl_ctx[i] = discovery_ctx_pool_acquire(&pool);
+    if (d_gl_ctx[i] == NULL) { printf("no free slot in context pool\n"); exit(1); }
+
+    kernels[i] = clCreateKernel(program, "run_prot", &err);
+    if (err < 0 ) { perror("Couldn't get kernel run_prot"); exit(1); }
+
+    err = clSetKernelArg(kernels[i], 0, sizeof(cl_mem), d_gl_ctx[i]);
+    err |= clSetKernelArg(kernels[i], 1, lms, NULL);
+    if (err < 0 ) { printf("error set_arg0 %d\n", err); exit(1); }
+  }
+
+  size_t global_size = wgs * wgc, local_size = wgs;
+  for (i = 0; i < POOL_KERNELS; i++) {
+    err = clEnqueueNDRangeKernel(queues[i], kernels[i], 1, NULL, &global_size, &local_size, 0, NULL, NULL);
+    if (err < 0 ) { printf("error launching kernel %d: %d\n", i, err); exit(1); }
+  }
+  for (i = 0; i < POOL_KERNELS; i++) {
+    err = clFinish(queues[i]);
+    if (err < 0 ) { printf("error finishing kernel %d: %d\n", i, err); exit(1); }
+  }
+
+  for (i = 0; i < POOL_KERNELS; i++) {
+    int participating_groups = number_of_participating_groups(&queues[i], d_gl_ctx[i]);
+    printf("kernel %d ran with a total of %d workgroups\n", i, participating_groups);
+    if (participating_groups <= 0 || participating_groups > wgc) {
+      printf("kernel %d: expected between 1 and %d workgroups\n", i, wgc);
+      failed = 1;
+    }
+  }
+
+  // Cleanup
+  for (i = 0; i < POOL_KERNELS; i++) {
+    discovery_ctx_pool_release(&pool, d_gl_ctx[i]);
+    err = clReleaseKernel(kernels[i]);
+    if (err != CL_SUCCESS) {perror("OpenCL Error"); exit(1);}
+  }
+
+  err = release_discovery_ctx_pool(&pool);
+  if (err != CL_SUCCESS) {perror("OpenCL Error"); exit(1);}
+
+  err = clReleaseProgram(program);
+  if (err != CL_SUCCESS) {perror("OpenCL Error"); exit(1);}
+
+  release_opencl_runtime();
+
+  printf("\n\n");
+  print_device_info();
+
+  return failed;
+}
@@ -0,0 +1,134 @@
+// Program to time the inter-workgroup barrier.
+// Takes in the size of workgroups, amount of local memory and the
+// number of barriers to run. Launches as many workgroups as time_prot,
+// runs the discovery protocol and then the barriers. The protocol is
+// timed on its own too, so that its cost can be subtracted.
+// Reports the number of discovered groups, the barrier flag stride and
+// spin policy the code was built with and the average time of a single
+// barrier.
+
+#include "stdio.h"
+#include "stdlib.h"
+
+#include "my_opencl.h"
+#include "discovery.h"
+
+// Spin policy the kernels are built with (see locks.cl)
+#ifndef SPIN_POLICY
+#define SPIN_POLICY 0
+#endif
+
+cl_device_id device;
+cl_context context;
+cl_program program;
+cl_command_queue queue;
+cl_kernel kernel;
+
+char * CL_FILE= STRINGIFY(KERNEL_DIR) "occupancy_test.cl";
+
+// Runs the run_barrier kernel with `iterations` barriers and returns
+// the kernel time in ns in `time`.
+int time_barriers(int upper_bound, int wgs, int iterations, cl_mem *gl_ctx, double *time) {
+  int err;
+
+  err = init_discovery_kernel_ctx(&program, &queue, gl_ctx);
+  if (err < 0) { return err; }
+
+  err = clSetKernelArg(kernel, 2, sizeof(cl_int), &iterations);
+  if (err < 0) { return err; }
+
+  const size_t global_size = upper_bound * wgs;
+  const size_t local_size = wgs;
+  cl_event event;
+
+  err = clEnqueueNDRangeKernel(queue, kernel, 1, NULL, &global_size, &local_size, 0, 0, &event);
+  if (err < 0) { return err; }
+  err = clWaitForEvents(1 , &event);
+  if (err < 0) { return err; }
+
+  cl_ulong time_start, time_end;
+
+  clGetEventProfilingInfo(event, CL_PROFILING_COMMAND_START, sizeof(time_start), &time_start, NULL);
+  clGetEventProfilingInfo(event, CL_PROFILING_COMMAND_END, sizeof(time_end), &time_end, NULL);
+  *time = time_end - time_start;
+
+  clReleaseEvent(event);
+  return CL_SUCCESS;
+}
+
+int main(int argc, char **argv) {
+
+  int wgs, lms, iterations;
+  int err;
+
+  opencl_runtime_args(&argc, argv);
+  if (argc != 4) {
+    printf("please provide workgroup size, local memory size, number of barriers\n");
+    return 0;
+  }
+
+  wgs = parse_int(argv[1]);
+  lms = parse_int(argv[2]);
+  iterations = parse_int(argv[3]);
+  if (iterations < 1) {
+    printf("error - need at least one barrier\n");
+    return 1;
+  }
+  printf("running with\nworkgroup size: %d\nlocal memory size: %d\nbarriers: %d\nbarrier flag stride: %d\nspin policy: %d\n", wgs, lms, iterations, BAR_FLAG_STRIDE, SPIN_POLICY);
+
+  device = create_device();
+  context = opencl_runtime_context();
+
+  char opts[COMPILE_OPTS_SIZE];
+  get_compile_opts(opts);
+  printf("compiler options are: %s\n", opts);
+
+  program = build_program(context, device, CL_FILE, opts);
+
+  kernel = clCreateKernel(program, "run_barrier",&err);
+  if (err < 0 ) { perror("Couldn't get kernel run_barrier"); exit(1); }
+
+  queue = opencl_runtime_queue(CL_QUEUE_PROFILING_ENABLE);
+
+  // Give the context room for every launched group so that the
+  // number of discovered groups is not capped by its capacity
+  cl_mem d_gl_ctx;
+  cl_int capacity = discovery_default_capacity(device);
+  if (capacity < 1000) { capacity = 1000; }
+  err = create_discovery_kernel_ctx_capacity(&context, &program, &queue, &d_gl_ctx, capacity);
+  if (err < 0 ) { perror("failed kernel context"); exit(1); }
+
+  err = clSetKernelArg(kernel, 0, sizeof(cl_mem), &d_gl_ctx);
+  err |= clSetKernelArg(kernel, 1, lms, NULL);
+  if (err < 0 ) { printf("error set_arg0 %d\n", err); exit(1); }
+
+  // Time the protocol alone, then with the barriers
+  double prot_time = 0, time = 0;
+  err = time_barriers(1000, wgs, 0, &d_gl_ctx, &prot_time);
+  if (err < 0 ) { printf("error running kernel %d\n", err); exit(1); }
+
+  err = time_barriers(1000, wgs, iterations, &d_gl_ctx, &time);
+  if (err < 0 ) { printf("error running kernel %d\n", err); exit(1); }
+
+  int participating_groups = number_of_participating_groups(&queue, &d_gl_ctx);
+  printf("kernel ran with a total of %d workgroups\n", participating_groups);
+  printf("kernel time: %f ms\n", time/1000000.0);
+  printf("barrier time: %f us\n", (time - prot_time)/(1000.0 * iterations));
+
+  // Cleanup
+  err = clReleaseMemObject(d_gl_ctx);
+  if (err != CL_SUCCESS) {perror("OpenCL Error"); exit(1);}
+
+  err = clReleaseKernel(kernel);
+  if (err != CL_SUCCESS) {perror("OpenCL Error"); exit(1);}
+
+  err = clReleaseProgram(program);
+  if (err != CL_SUCCESS) {perror("OpenCL Error"); exit(1);}
+
+  release_opencl_runtime();
+
+  printf("\n\n");
+  print_device_info();
+
+  return 0;
+}
@@ -1,7 +1,9 @@
 // Program to time the discovery protocol.
 // Takes in the number of workgroups, size of workgroups, amount of local memory, 
-// a flag if the protocol is enabled, and a flag for which mutex to use. 
-// Reports the number of discovered groups and the time for running the protocol.
+// a flag if the protocol is enabled, and a flag for which mutex to use
+// (0: spin lock, 1: ticket lock, 2: lock-free protocol, 3: queue lock). 
+// Reports the number of discovered groups, the spin policy the code was
+// built with and the time for running the protocol.
 
 #include "stdio.h"
 #include "stdlib.h"
@@ -9,6 +11,11 @@
 #include "my_opencl.h"
 #include "discovery.h"
 
+// Spin policy the kernels are built with (see locks.cl)
+#ifndef SPIN_POLICY
+#define SPIN_POLICY 0
+#endif
+
 cl_device_id device;
 cl_context context;
 cl_program program;
@@ -19,27 +26,27 @@ char * CL_FILE= STRINGIFY(KERNEL_DIR) "occupancy_test.cl";
 
 int main(int argc, char **argv) {
 
-  int wgc, wgs, lms, prot, ticket;
+  int wgc, wgs, lms, prot, mutex;
   int err;
 
+  opencl_runtime_args(&argc, argv);
   if (argc != 5) {
-    printf("please provide number of workgroups, workgroup size, local memory size, flag for ticket lock\n");
+    printf("please provide number of workgroups, workgroup size, local memory size, flag for mutex type (0: spin lock, 1: ticket lock, 2: lock-free, 3: queue lock)\n");
     return 0;
   }
   
   wgc = parse_int(argv[1]);
   wgs = parse_int(argv[2]);
   lms = parse_int(argv[3]);
-  ticket = parse_int(argv[4]);
+  mutex = parse_int(argv[4]);
   prot = 1;
-  printf("running with\nworkgroup count: %d\nworkgroup size: %d\nlocal memory size: %d\nusing ticket lock: %d\n", wgc, wgs,lms,ticket);
+  printf("running with\nworkgroup count: %d\nworkgroup size: %d\nlocal memory size: %d\nmutex type: %d\nspin policy: %d\n", wgc, wgs,lms,mutex, SPIN_POLICY);
 
   device = create_device();
-  context = clCreateContext(NULL, 1, &device, NULL, NULL, &err);
-  if (err < 0 ) { perror("Couldn't create OpenCL context"); exit(1); }
+  context = opencl_runtime_context();
 
-  char opts[200];
-  get_compile_opts_occupancy_tests(opts, ticket);
+  char opts[COMPILE_OPTS_SIZE];
+  get_compile_opts_occupancy_tests(opts, mutex);
   printf("compiler options are: %s\n", opts);
 
   program = build_program(context, device, CL_FILE, opts);
@@ -48,18 +55,23 @@ int main(int argc, char **argv) {
   if (err < 0 ) { perror("Couldn't get kernel run_prot_static"); exit(1); }
 
   cl_mem d_gl_ctx;
-  d_gl_ctx = clCreateBuffer(context, CL_MEM_READ_WRITE, sizeof(discovery_kernel_ctx), NULL ,&err);
+  // Give the context room for every launched group so that the
+  // number of discovered groups is not capped by its capacity. The
+  // queue lock keeps a per-group array of slots in it as well.
+  cl_int capacity = discovery_default_capacity(device);
+  if (capacity < 1000) { capacity = 1000; }
+  size_t ctx_size = discovery_kernel_ctx_size_arrays(capacity, discovery_group_arrays(mutex == 3));
+  d_gl_ctx = clCreateBuffer(context, CL_MEM_READ_WRITE, ctx_size, NULL ,&err);
   if (err < 0 ) { perror("Couldn't create buffer"); exit(1); }
       
-  queue = clCreateCommandQueue(context, device, CL_QUEUE_PROFILING_ENABLE, &err);
-  if (err < 0 ) { perror("failed create command queue barrier"); exit(1); }
+  queue = opencl_runtime_queue(CL_QUEUE_PROFILING_ENABLE);
 
   err = clSetKernelArg(kernel, 0, sizeof(cl_mem), &d_gl_ctx);
   err |= clSetKernelArg(kernel, 1, lms, NULL);
   if (err < 0 ) { printf("error set_arg0 %d\n", err); exit(1); }
 
   double time = 0;
-  err = time_protocol(&program, &queue, &kernel, 1000, wgs, &d_gl_ctx, &time);
+  err = time_protocol(&program, &queue, &kernel, 1000, wgs, &d_gl_ctx, capacity, &time);
 
   int participating_groups = number_of_participating_groups(&queue, &d_gl_ctx);
   printf("kernel ran with a total of %d workgroups\n", participating_groups);
@@ -69,14 +81,10 @@ int main(int argc, char **argv) {
   err = clReleaseMemObject(d_gl_ctx);
   if (err != CL_SUCCESS) {perror("OpenCL Error"); exit(1);}
 
-  err = clReleaseCommandQueue(queue);
-  if (err != CL_SUCCESS) {perror("OpenCL Error"); exit(1);}
-
   err = clReleaseProgram(program);
   if (err != CL_SUCCESS) {perror("OpenCL Error"); exit(1);}
 
-  err = clReleaseContext(context);
-  if (err != CL_SUCCESS) {perror("OpenCL Error"); exit(1);}
+  release_opencl_runtime();
   
   printf("\n\n");
   print_device_info();
@@ -0,0 +1,169 @@
+// Program to compare the latency of queries served by a persistent
+// kernel (server mode, see DISCOVERY_SERVE in discovery.cl) with that of
+// queries run by relaunching a kernel.
+// Takes in the size of workgroups, amount of local memory, the number
+// of queries and the number of items each query writes. Reports the
+// number of discovered groups and the average time of a query, from
+// submission to result, for both. Server mode needs OpenCL 2.0
+// (fine-grained SVM and the built-in atomics).
+
+#include "stdio.h"
+#include "stdlib.h"
+#include <sys/time.h>
+
+#include "my_opencl.h"
+#include "discovery.h"
+
+cl_device_id device;
+cl_context context;
+cl_program program;
+cl_command_queue queue;
+cl_kernel query_kernel;
+cl_kernel server_kernel;
+
+char * CL_FILE= STRINGIFY(KERNEL_DIR) "occupancy_test.cl";
+
+#ifdef CL_VERSION_2_0
+
+// Wall clock time in us
+double time_us() {
+  struct timeval t;
+  gettimeofday(&t, NULL);
+  return t.tv_sec * 1000000.0 + t.tv_usec;
+}
+
+// Exits if query `query` did not write its items to `out`
+void check_query(cl_int *out, int query, int size) {
+  if (out[0] != query || out[size - 1] != query + size - 1) {
+    printf("error: wrong result for query %d\n", query);
+    exit(1);
+  }
+}
+
+int main(int argc, char **argv) {
+
+  int wgs, lms, queries, size;
+  int err;
+
+  opencl_runtime_args(&argc, argv);
+  if (argc != 5) {
+    printf("please provide workgroup size, local memory size, number of queries, query size\n");
+    return 0;
+  }
+
+  wgs = parse_int(argv[1]);
+  lms = parse_int(argv[2]);
+  queries = parse_int(argv[3]);
+  size = parse_int(argv[4]);
+  printf("running with\nworkgroup size: %d\nlocal memory size: %d\nqueries: %d\nquery size: %d\n", wgs, lms, queries, size);
+
+  device = create_device();
+  context = opencl_runtime_context();
+
+  char opts[COMPILE_OPTS_SIZE];
+  get_compile_opts(opts);
+  printf("compiler options are: %s\n", opts);
+
+  // The server kernel is only built with the OpenCL 2.0 atomics
+  if (strstr(opts, "-DCUSTOM_ATOMICS") != NULL) {
+    printf("error: server mode needs an OpenCL 2.0 device, this one uses custom atomics\n");
+    exit(1);
+  }
+
+  program = build_program(context, device, CL_FILE, opts);
+
+  query_kernel = clCreateKernel(program, "run_query", &err);
+  if (err < 0 ) { perror("Couldn't get kernel run_query"); exit(1); }
+
+  server_kernel = clCreateKernel(program, "run_server", &err);
+  if (err < 0 ) { perror("Couldn't get kernel run_server"); exit(1); }
+
+  queue = opencl_runtime_queue(0);
+
+  cl_mem d_gl_ctx;
+  err = create_discovery_kernel_ctx(&context, &device, &program, &queue, &d_gl_ctx);
+  if (err < 0 ) { perror("failed kernel context"); exit(1); }
+
+  discovery_command_ring *ring;
+  err = create_discovery_command_ring(&context, &device, &ring);
+  if (err < 0 ) { printf("device does not support fine-grained SVM with atomics (%d)\n", err); exit(1); }
+
+  // Results are read while the server runs, so they are in SVM too
+  cl_int *out = (cl_int *) clSVMAlloc(context, CL_MEM_READ_WRITE | CL_MEM_SVM_FINE_GRAIN_BUFFER, size * sizeof(cl_int), 0);
+  if (out == NULL) { perror("Couldn't allocate results"); exit(1); }
+
+  const size_t local_size = wgs;
+  const size_t global_size = discovery_launch_groups(&device, &query_kernel, wgs, 1000) * wgs;
+
+  // Relaunch a kernel for every query
+  err = clSetKernelArg(query_kernel, 0, sizeof(cl_mem), &d_gl_ctx);
+  err |= clSetKernelArg(query_kernel, 1, lms, NULL);
+  err |= clSetKernelArgSVMPointer(query_kernel, 2, out);
+  err |= clSetKernelArg(query_kernel, 3, sizeof(cl_int), &size);
+  if (err < 0 ) { printf("error setting run_query args %d\n", err); exit(1); }
+
+  double start = time_us();
+  for (int i = 0; i < queries; i++) {
+    SAFE_CALL(clSetKernelArg(query_kernel, 4, sizeof(cl_int), &i));
+    SAFE_CALL(clEnqueueNDRangeKernel(queue, query_kernel, 1, NULL, &global_size, &local_size, 0, 0, NULL));
+    SAFE_CALL(clFinish(queue));
+    check_query(out, i, size);
+  }
+  double relaunch_time = (time_us() - start) / queries;
+
+  // Launch the server once and push every query to its ring
+  err = clSetKernelArg(server_kernel, 0, sizeof(cl_mem), &d_gl_ctx);
+  err |= clSetKernelArg(server_kernel, 1, lms, NULL);
+  err |= clSetKernelArgSVMPointer(server_kernel, 2, ring);
+  err |= clSetKernelArgSVMPointer(server_kernel, 3, out);
+  if (err < 0 ) { printf("error setting run_server args %d\n", err); exit(1); }
+
+  SAFE_CALL(clEnqueueNDRangeKernel(queue, server_kernel, 1, NULL, &global_size, &local_size, 0, 0, NULL));
+  SAFE_CALL(clFlush(queue));
+
+  start = time_us();
+  for (int i = 0; i < queries; i++) {
+    int index = discovery_server_submit(ring, 0, size, i);
+    discovery_server_wait(ring, index);
+    check_query(out, i, size);
+  }
+  double server_time = (time_us() - start) / queries;
+
+  discovery_server_stop(ring);
+  SAFE_CALL(clFinish(queue));
+
+  int participating_groups = number_of_participating_groups(&queue, &d_gl_ctx);
+  printf("kernel ran with a total of %d workgroups\n", participating_groups);
+  printf("relaunch query time: %f us\n", relaunch_time);
+  printf("server query time: %f us\n", server_time);
+
+  // Cleanup
+  clSVMFree(context, out);
+  release_discovery_command_ring(&context, ring);
+
+  err = clReleaseMemObject(d_gl_ctx);
+  if (err != CL_SUCCESS) {perror("OpenCL Error"); exit(1);}
+
+  err = clReleaseKernel(query_kernel);
+  err |= clReleaseKernel(server_kernel);
+  if (err != CL_SUCCESS) {perror("OpenCL Error"); exit(1);}
+
+  err = clReleaseProgram(program);
+  if (err != CL_SUCCESS) {perror("OpenCL Error"); exit(1);}
+
+  release_opencl_runtime();
+
+  printf("\n\n");
+  print_device_info();
+
+  return 0;
+}
+
+#else
+
+int main(int argc, char **argv) {
+  printf("error: server mode needs OpenCL 2.0 headers, time_server was built without them\n");
+  return 1;
+}
+
+#endif
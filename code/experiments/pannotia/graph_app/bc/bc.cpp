@@ -82,10 +82,7 @@ void print_vectorf(float *vector, int num);
 // Local OpenCL utilities
 static cl_context        context;
 static cl_command_queue  cmd_queue;
-static cl_device_type    device_type;
-static cl_device_id     *device_list;
 static cl_device_id      target_device;
-static cl_int            num_devices;
 
 int main(int argc, char **argv) {
 
@@ -101,6 +98,7 @@ int main(int argc, char **argv) {
 
   cl_int err = 0;
 
+  opencl_runtime_args(&argc, argv);
   if (argc == 4) {
     tmpchar = argv[1];           // Graph file
     file_format = atoi(argv[2]); // Graph format
@@ -127,26 +125,10 @@ int main(int argc, char **argv) {
   float *bc_h = (float *)malloc(num_nodes * sizeof(float));
   if (!bc_h) fprintf(stderr, "malloc failed bc_h\n");
 
-  // Load kernel file
-  int sourcesize = 1024 * 1024;
-  char * source = (char *) calloc(sourcesize, sizeof(char));
-  if (!source) { fprintf(stderr, "ERROR: calloc(%d) failed\n", sourcesize); return -1; }
-
-  FILE * fp = fopen(CL_FILE, "rb");
-  if (!fp) {
-    fprintf(stderr, "ERROR: unable to open '%s'\n", CL_FILE);
-    return -1;
-  }
-  fread(source + strlen(source), sourcesize, 1, fp);
-  fclose(fp);
-
   // OpenCL initialization
   if (initialize(use_gpu)) return -1;
 
-  // Create OpenCL program
-  const char * slist[2] = { source, 0 };
-
-  char opts[500];
+  char opts[COMPILE_OPTS_SIZE];
   get_compile_opts(opts);
 
   cl_program prog = build_program(context, target_device, CL_FILE, opts);
@@ -488,62 +470,25 @@ void print_vectorf(float *vector, int num) {
 }
 
 int initialize(int use_gpu) {
-  cl_int result;
-  size_t size;
-
-  // Create OpenCL context
-  cl_platform_id platform_id;
-  if (clGetPlatformIDs(1, &platform_id, NULL) != CL_SUCCESS) { printf("ERROR: clGetPlatformIDs(1,*,0) failed\n"); return -1; }
-  cl_context_properties ctxprop[] = { CL_CONTEXT_PLATFORM, (cl_context_properties) platform_id, 0};
-  device_type = use_gpu ? CL_DEVICE_TYPE_GPU : CL_DEVICE_TYPE_CPU;
-
-  context = clCreateContextFromType( ctxprop,
-                                     device_type,
-                                     NULL,
-                                     NULL,
-                                     NULL );
-
-  if (!context) { printf("ERROR: clCreateContextFromType(%s) failed\n", use_gpu ? "GPU" : "CPU"); return -1; }
-
-  // Get the list of GPUs
-  result = clGetContextInfo( context, CL_CONTEXT_DEVICES, 0, NULL, &size);
-  num_devices = (int) (size / sizeof(cl_device_id));
-  printf("num_devices = %d\n", num_devices);
-
-  if (result != CL_SUCCESS || num_devices < 1) { printf("ERROR: clGetContextInfo() failed\n"); return -1; }
-  device_list = new cl_device_id[num_devices];
-  if (!device_list) { printf("ERROR: new cl_device_id[] failed\n"); return -1; }
-  result = clGetContextInfo( context, CL_CONTEXT_DEVICES, size, device_list, NULL);
-  if (result != CL_SUCCESS) { printf("ERROR: clGetContextInfo() failed\n"); return -1; }
-
-  // Create command queue for the first device
-  cmd_queue = clCreateCommandQueue( context,
-                                    device_list[REQUESTED_DEVICE],
-                                    0,
-                                    NULL );
-
-  if (!cmd_queue) {
-    printf("ERROR: clCreateCommandQueue() failed\n");
-    return -1;
+  // The context and queue are those of the shared runtime, so that the
+  // device selection options apply (see get_opencl_runtime). Without
+  // a device type from them, use_gpu = 0 selects a CPU device.
+  if (!use_gpu && runtime_device_type_arg == NULL && getenv("DISCOVERY_DEVICE_TYPE") == NULL) {
+    runtime_device_type_arg = "cpu";
   }
-
-  target_device = device_list[REQUESTED_DEVICE];
+  context = opencl_runtime_context();
+  cmd_queue = opencl_runtime_queue(0);
+  target_device = create_device();
   return 0;
 }
 
 int shutdown() {
-
   // Release resources
-  if (cmd_queue)   clReleaseCommandQueue(cmd_queue);
-  if (context)     clReleaseContext(context);
-  if (device_list) delete device_list;
+  release_opencl_runtime();
 
   // Reset all variables
-  cmd_queue   = 0;
-  context     = 0;
-  device_list = 0;
-  num_devices = 0;
-  device_type = 0;
-
+  cmd_queue = 0;
+  context = 0;
+  target_device = 0;
   return 0;
 }
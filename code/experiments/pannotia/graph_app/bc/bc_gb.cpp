@@ -87,11 +87,8 @@ void print_vectorf(float *vector, int num);
 // Local OpenCL utilities
 static cl_context        context;
 static cl_command_queue  cmd_queue;
-static cl_device_type    device_type;
-static cl_device_id     *device_list;
 static cl_device_id      target_device;
 
-static cl_int num_devices;
 
 int main(int argc, char **argv){
 
@@ -107,6 +104,7 @@ int main(int argc, char **argv){
 
   cl_int err = 0;
 
+  opencl_runtime_args(&argc, argv);
   if (argc == 4) {
     tmpchar = argv[1];           // Graph file
     file_format = atoi(argv[2]); // Graph format
@@ -133,26 +131,10 @@ int main(int argc, char **argv){
   float *bc_h = (float *) malloc(num_nodes * sizeof(float));
   if(!bc_h) fprintf(stderr, "malloc failed bc_h\n");
 
-  // Load kernel file
-  int sourcesize = 1024 * 1024;
-  char * source = (char *) calloc(sourcesize, sizeof(char));
-  if (!source) { fprintf(stderr, "ERROR: calloc(%d) failed\n", sourcesize); return -1; }
-
-  FILE * fp = fopen(CL_FILE, "rb");
-  if (!fp) {
-    fprintf(stderr, "ERROR: unable to open '%s'\n", CL_FILE);
-    return -1;
-  }
-  fread(source + strlen(source), sourcesize, 1, fp);
-  fclose(fp);
-
   // OpenCL initialization
   if(initialize(use_gpu)) return -1;
 
-  // Create OpenCL program
-  const char * slist[2] = { source, 0 };
-
-  char opts[500];
+  char opts[COMPILE_OPTS_SIZE];
   get_compile_opts(opts);
 
   strcat(opts, " -DGB_VAR");
@@ -181,12 +163,11 @@ int main(int argc, char **argv){
   if(err != CL_SUCCESS) { fprintf(stderr, "ERROR: clCreateKernel() 5 => %d\n", err); return -1; }
 
   cl_mem d_gl_ctx;
-  d_gl_ctx = clCreateBuffer(context, CL_MEM_READ_WRITE, sizeof(discovery_kernel_ctx), NULL ,&err);
-  err = init_discovery_kernel_ctx(&prog, &cmd_queue, &d_gl_ctx);
+  err = create_discovery_kernel_ctx(&context, &target_device, &prog, &cmd_queue, &d_gl_ctx);
   if (err < 0) { perror("failed kernel context"); exit(1); }
 
   // Device-side buffers
-  cl_mem bc_d, dist_d, sigma_d, rho_d, p_d, stop_d1, stop_d2, stop_d3, rec_dist_d;
+  cl_mem bc_d, dist_d, sigma_d, rho_d, p_d, rec_dist_d;
   cl_mem row_d, col_d, row_trans_d, col_trans_d;
 
   // Create bc buffers
@@ -205,16 +186,6 @@ int main(int argc, char **argv){
   p_d = clCreateBuffer( context, CL_MEM_READ_WRITE, num_nodes * num_nodes * sizeof(int), NULL, &err);
   if(err != CL_SUCCESS) { fprintf(stderr, "ERROR: clCreateBuffer p_d (size:%d) => %d\n", num_nodes * num_nodes, err); return -1;}
 
-  // Create termination variable buffers
-  stop_d1 = clCreateBuffer(context, CL_MEM_READ_WRITE, sizeof(int), NULL, &err);
-  if(err != CL_SUCCESS) { fprintf(stderr, "ERROR: clCreateBuffer stop_d1 (size:%d) => %d\n", 1 , err); return -1;}
-
-  stop_d2 = clCreateBuffer(context, CL_MEM_READ_WRITE, sizeof(int), NULL, &err);
-  if(err != CL_SUCCESS) { fprintf(stderr, "ERROR: clCreateBuffer stop_d2 (size:%d) => %d\n", 1 , err); return -1;}
-
-  stop_d3 = clCreateBuffer(context, CL_MEM_READ_WRITE, sizeof(int), NULL, &err);
-  if(err != CL_SUCCESS) { fprintf(stderr, "ERROR: clCreateBuffer stop_d3 (size:%d) => %d\n", 1 , err); return -1;}
-
   rec_dist_d = clCreateBuffer(context, CL_MEM_READ_WRITE, sizeof(int), NULL, &err);
   if(err != CL_SUCCESS) { fprintf(stderr, "ERROR: clCreateBuffer rec_dist_d (size:%d) => %d\n", 1 , err); return -1;}
 
@@ -293,14 +264,11 @@ int main(int argc, char **argv){
   clSetKernelArg(mega_kernel, 5, sizeof(void *), (void*) &rho_d);
   clSetKernelArg(mega_kernel, 6, sizeof(void *), (void*) &sigma_d);
   clSetKernelArg(mega_kernel, 7, sizeof(void *), (void*) &p_d);
-  clSetKernelArg(mega_kernel, 8, sizeof(void *), (void*) &stop_d1);
-  clSetKernelArg(mega_kernel, 9, sizeof(void *), (void*) &stop_d2);
-  clSetKernelArg(mega_kernel, 10, sizeof(void *), (void*) &stop_d3);
-  clSetKernelArg(mega_kernel, 11, sizeof(void *), (void*) &rec_dist_d);
-  clSetKernelArg(mega_kernel, 12, sizeof(void *), (void*) &bc_d);
-  clSetKernelArg(mega_kernel, 13, sizeof(cl_int), (void*) &num_nodes);
-  clSetKernelArg(mega_kernel, 14, sizeof(cl_int), (void*) &num_edges);
-  clSetKernelArg(mega_kernel, 15, sizeof(void *), (void*) &d_gl_ctx);
+  clSetKernelArg(mega_kernel, 8, sizeof(void *), (void*) &rec_dist_d);
+  clSetKernelArg(mega_kernel, 9, sizeof(void *), (void*) &bc_d);
+  clSetKernelArg(mega_kernel, 10, sizeof(cl_int), (void*) &num_nodes);
+  clSetKernelArg(mega_kernel, 11, sizeof(cl_int), (void*) &num_edges);
+  clSetKernelArg(mega_kernel, 12, sizeof(void *), (void*) &d_gl_ctx);
 
   // clean_1d_array
   clSetKernelArg(kernel3, 1, sizeof(void *), (void*) &dist_d);
@@ -333,17 +301,10 @@ int main(int argc, char **argv){
                                0);
   if(err != CL_SUCCESS) { fprintf(stderr, "ERROR: 1  clEnqueueNDRangeKernel()=>%d failed\n", err); return -1; }
 
-  int estimate = 1000 * wgs;
+  // Launch about as many groups as previous runs found participating
+  int estimate = discovery_launch_groups(&target_device, &mega_kernel, wgs, 1000) * wgs;
   global_work[0] = estimate;
 
-  int stop = 0;
-
-  // Copy the termination variable to the device
-  err = clEnqueueWriteBuffer(cmd_queue, stop_d1, 1, 0, sizeof(int), &stop, 0, 0, 0);
-  err = clEnqueueWriteBuffer(cmd_queue, stop_d2, 1, 0, sizeof(int), &stop, 0, 0, 0);
-  err = clEnqueueWriteBuffer(cmd_queue, stop_d3, 1, 0, sizeof(int), &stop, 0, 0, 0);
-
-
   timer3 = gettime();
 
   // Launch the mega_kernel
@@ -364,6 +325,18 @@ int main(int argc, char **argv){
 
   int participating_wgs = number_of_participating_groups(&cmd_queue, &d_gl_ctx);
   printf("kernel ran with a total of %d workgroups\n", participating_wgs);
+  discovery_record_occupancy(&target_device, &mega_kernel, wgs, participating_wgs);
+
+#ifdef DISCOVERY_STATS
+  discovery_run_stats stats;
+  if (discovery_stats(&cmd_queue, &d_gl_ctx, &stats) == CL_SUCCESS) {
+    print_discovery_stats(&stats);
+  }
+#endif
+
+#ifdef DISCOVERY_TRACE
+  discovery_write_trace(&cmd_queue, &d_gl_ctx, "bc_gb_trace.json");
+#endif
 
 
   // Copy back the results for the bc array
@@ -402,9 +375,6 @@ int main(int argc, char **argv){
   clReleaseMemObject(sigma_d);
   clReleaseMemObject(rho_d);
   clReleaseMemObject(p_d);
-  clReleaseMemObject(stop_d1);
-  clReleaseMemObject(stop_d2);
-  clReleaseMemObject(stop_d3);
   clReleaseMemObject(row_d);
   clReleaseMemObject(col_d);
   clReleaseMemObject(row_trans_d);
@@ -437,57 +407,25 @@ void print_vectorf(float *vector, int num){
 
 
 int initialize(int use_gpu) {
-  cl_int result;
-  size_t size;
-
-  // Create OpenCL context
-  cl_platform_id platform_id;
-  if (clGetPlatformIDs(1, &platform_id, NULL) != CL_SUCCESS) { printf("ERROR: clGetPlatformIDs(1,*,0) failed\n"); return -1; }
-  cl_context_properties ctxprop[] = { CL_CONTEXT_PLATFORM, (cl_context_properties) platform_id, 0};
-  device_type = use_gpu ? CL_DEVICE_TYPE_GPU : CL_DEVICE_TYPE_CPU;
-
-  context = clCreateContextFromType( ctxprop,
-                                     device_type,
-                                     NULL,
-                                     NULL,
-                                     NULL );
-
-  if (!context) { printf("ERROR: clCreateContextFromType(%s) failed\n", use_gpu ? "GPU" : "CPU"); return -1; }
-
-  // Get the list of GPUs
-  result = clGetContextInfo(context, CL_CONTEXT_DEVICES, 0, NULL, &size);
-  num_devices = (int) (size / sizeof(cl_device_id));
-  printf("num_devices = %d\n", num_devices);
-
-  if (result != CL_SUCCESS || num_devices < 1) { printf("ERROR: clGetContextInfo() failed\n"); return -1; }
-  device_list = new cl_device_id[num_devices];
-  if (!device_list) { printf("ERROR: new cl_device_id[] failed\n"); return -1; }
-  result = clGetContextInfo(context, CL_CONTEXT_DEVICES, size, device_list, NULL);
-  if (result != CL_SUCCESS) { printf("ERROR: clGetContextInfo() failed\n"); return -1; }
-  target_device = device_list[REQUESTED_DEVICE];
-
-  // Create command queue for the first device
-  cmd_queue = clCreateCommandQueue( context,
-                                    target_device,
-                                    0,
-                                    NULL );
-
-  if (!cmd_queue) { printf("ERROR: clCreateCommandQueue() failed\n"); return -1; }
+  // The context and queue are those of the shared runtime, so that the
+  // device selection options apply (see get_opencl_runtime). Without
+  // a device type from them, use_gpu = 0 selects a CPU device.
+  if (!use_gpu && runtime_device_type_arg == NULL && getenv("DISCOVERY_DEVICE_TYPE") == NULL) {
+    runtime_device_type_arg = "cpu";
+  }
+  context = opencl_runtime_context();
+  cmd_queue = opencl_runtime_queue(0);
+  target_device = create_device();
   return 0;
 }
 
 int shutdown() {
   // Release resources
-  if (cmd_queue)   clReleaseCommandQueue(cmd_queue);
-  if (context)     clReleaseContext(context);
-  if (device_list) delete device_list;
+  release_opencl_runtime();
 
   // Reset all variables
-  cmd_queue   = 0;
-  context     = 0;
-  device_list = 0;
-  num_devices = 0;
-  device_type = 0;
-
+  cmd_queue = 0;
+  context = 0;
+  target_device = 0;
   return 0;
 }
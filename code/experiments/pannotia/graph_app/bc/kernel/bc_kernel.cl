@@ -73,12 +73,12 @@
 inline float atomic_add_float(__global float* const address,
                               const float value) {
 
-  uint oldval, newval, readback;
+  int oldval, newval;
 
   *(float*)&oldval = *address;
   *(float*)&newval = (*(float*)&oldval + value);
-  while ((readback = atomic_cmpxchg((__global uint *) address, oldval, newval)) != oldval) {
-    oldval = readback;
+  // A failed exchange leaves the current value in oldval
+  while (!atomic_compare_exchange_strong_explicit((__global atomic_int *) address, &oldval, newval, memory_order_relaxed, memory_order_relaxed, memory_scope_device)) {
     *(float*) &newval = (*(float*) &oldval + value);
   }
   return *(float*) &oldval;
@@ -297,29 +297,22 @@ int mega_bfs_kernel_func( __global int   *row,
                           __global int   *d,
                           __global float *rho,
                           __global int   *p,
-                          __global int   *stop1,
-                          __global int   *stop2,
-                          __global int   *stop3,
                           const    int    num_nodes,
                           const    int    num_edges,
                           __global int   *global_dist,
                           __global discovery_kernel_ctx *gl_ctx,
                           __local  discovery_local_ctx  *local_ctx) {
 
-  __global int * write_stop = stop1;
-  __global int * read_stop  = stop2;
-  __global int * buff_stop  = stop3;
-  __global int * swap;
-
-  // Get participating global id and the stride
-  int tid        = p_get_global_id(gl_ctx, local_ctx);
-  int stride     = p_get_global_size(gl_ctx, local_ctx);
   int local_dist = 0;
 
   while(1) {
 
-    // The original kernels used an 'if' here. We need a 'for' loop
-    for (int i = tid; i < num_nodes; i+=stride) {
+    int stop = 0;
+
+    // The original kernels used an 'if' here. We need a 'for' loop.
+    // Vertex degrees vary widely, so the vertices are shared out by
+    // the scheduler when it is enabled
+    DISCOVERY_FOR_EACH(gl_ctx, local_ctx, i, num_nodes) {
       if (d[i] == local_dist) {
 
         // Get the starting and ending pointers
@@ -335,7 +328,7 @@ int mega_bfs_kernel_func( __global int   *row,
         for (int edge = start; edge < end; edge++) {
           int w = col[edge];
           if (d[w] < 0) {
-            *write_stop = 1;
+            stop = 1;
 
             // Traverse another layer
             d[w] = local_dist + 1;
@@ -349,22 +342,14 @@ int mega_bfs_kernel_func( __global int   *row,
       }
     }
 
-    swap       = read_stop;
-    read_stop  = write_stop;
-    write_stop = buff_stop;
-    buff_stop  = swap;
     local_dist = local_dist + 1;
 
-    // Inter-workgroup barrier
-    discovery_barrier(gl_ctx, local_ctx);
-
-    // Trick for updating the termination variables using the
-    // 'buff_stop' variable without extra barriers and avoiding
-    // data-races.
-    if (*read_stop == 0) {
+    // Inter-workgroup barrier, which also combines the termination
+    // variable of every thread. This replaces the three global
+    // termination variables that were rotated to avoid data-races.
+    if (discovery_barrier_reduce(gl_ctx, local_ctx, stop, DISCOVERY_REDUCE_OR) == 0) {
       break;
     }
-    *buff_stop = 0;
   }
 
   return local_dist;
@@ -385,14 +370,11 @@ void mega_backtrack_kernel_func(__global int   *row,
                                 __local  discovery_local_ctx  *local_ctx) {
 
 
-  // Get global participating id and stride
-  int tid        = p_get_global_id(gl_ctx, local_ctx);
-  int stride     = p_get_global_size(gl_ctx, local_ctx);
   int local_dist = dist;
 
   while (local_dist > 0) {
 
-    for (int i = tid; i < num_nodes; i += stride) {
+    DISCOVERY_FOR_EACH(gl_ctx, local_ctx, i, num_nodes) {
       if (d[i] == local_dist - 1) {
 
         int start = row[i];
@@ -436,14 +418,11 @@ __kernel void mega_bc_kernel(__global int   *row,                      // 0
                              __global float *rho,                      // 5
                              __global float *sigma,                    // 6
                              __global int   *p,                        // 7
-                             __global int   *stop1,                    // 8
-                             __global int   *stop2,                    // 9
-                             __global int   *stop3,                    // 10
-                             __global int   *global_dist,              // 11
-                             __global float *bc,                       // 12
-                             const    int    num_nodes,                // 13
-                             const    int    num_edges,                // 14
-                             __global discovery_kernel_ctx *gl_ctx  // 15
+                             __global int   *global_dist,              // 8
+                             __global float *bc,                       // 9
+                             const    int    num_nodes,                // 10
+                             const    int    num_edges,                // 11
+                             __global discovery_kernel_ctx *gl_ctx  // 12
                              ) {
   // Discovery protocol
   DISCOVERY_PROTOCOL(gl_ctx);
@@ -488,8 +467,7 @@ __kernel void mega_bc_kernel(__global int   *row,                      // 0
     // Original application --- bfs_kernel --- start
 
     int local_dist = mega_bfs_kernel_func(row, col, dist,
-                                          rho, p, stop1, stop2,
-                                          stop3, num_nodes,
+                                          rho, p, num_nodes,
                                           num_edges, global_dist,
                                           gl_ctx, &local_ctx);
 
@@ -84,10 +84,7 @@ const char * CL_FILE = STRINGIFY(KERNEL_DIR) "color_kernel.cl";
 // Local OpenCL utilities
 static cl_context       context;
 static cl_command_queue cmd_queue;
-static cl_device_type   device_type;
 static cl_device_id     target_device;
-static cl_device_id   * device_list;
-static cl_int           num_devices;
 
 int main(int argc, char **argv) {
 
@@ -102,6 +99,7 @@ int main(int argc, char **argv) {
   cl_int err = 0;
   int wgs;
 
+  opencl_runtime_args(&argc, argv);
   if(argc == 4) {
     tmpchar = argv[1];           // Graph file
     file_format = atoi(argv[2]); // Graph format
@@ -152,21 +150,11 @@ int main(int argc, char **argv) {
     node_value[i] =  i/(float)(num_nodes + 1);
   }
 
-  // Load the OpenCL kernel file
-  int sourcesize = 1024 * 1024;
-  char * source = (char *) calloc(sourcesize, sizeof(char));
-  if (!source) { fprintf(stderr, "ERROR: calloc(%d) failed\n", sourcesize); return -1; }
-
-  FILE * fp = fopen(CL_FILE, "rb");
-  if(!fp) { printf("ERROR: unable to open '%s'\n", CL_FILE); return -1; }
-  fread(source + strlen(source), sourcesize, 1, fp);
-  fclose(fp);
-
   // OpenCL initialization
   if(initialize(use_gpu)) return -1;
 
   // Create the OpenCL program
-  char opts[500];
+  char opts[COMPILE_OPTS_SIZE];
   get_compile_opts(opts);
   cl_program prog = build_program(context, target_device, CL_FILE, opts);
 
@@ -180,12 +168,11 @@ int main(int argc, char **argv) {
   // Create and initialize context for the discovery protocol and
   // inter-workgroup barrier
   cl_mem d_gl_ctx;
-  d_gl_ctx = clCreateBuffer(context, CL_MEM_READ_WRITE, sizeof(discovery_kernel_ctx), NULL, &err);
-  err = init_discovery_kernel_ctx(&prog, &cmd_queue, &d_gl_ctx);
+  err = create_discovery_kernel_ctx(&context, &target_device, &prog, &cmd_queue, &d_gl_ctx);
   if (err < 0) { perror("failed kernel context"); exit(1); }
 
   // Device buffers
-  cl_mem row_d, col_d, max_d, color_d, node_value_d, stop_d1, stop_d2;
+  cl_mem row_d, col_d, max_d, color_d, node_value_d;
 
   // Create device-side buffers for the graph
   row_d = clCreateBuffer(context, CL_MEM_READ_WRITE, num_nodes * sizeof(int), NULL, &err);
@@ -194,13 +181,6 @@ int main(int argc, char **argv) {
   col_d = clCreateBuffer(context, CL_MEM_READ_WRITE, num_edges * sizeof(int), NULL, &err);
   if (err != CL_SUCCESS) { fprintf(stderr, "ERROR: clCreateBuffer col_d (size:%d) => %d\n", num_edges, err); return -1;}
 
-  // Termination variables
-  stop_d1 = clCreateBuffer(context, CL_MEM_READ_WRITE, sizeof(int), NULL, &err);
-  if (err != CL_SUCCESS) { fprintf(stderr, "ERROR: clCreateBuffer stop_d1 (size:%d) => %d\n", 1, err); return -1;}
-
-  stop_d2 = clCreateBuffer(context, CL_MEM_READ_WRITE, sizeof(int), NULL, &err);
-  if (err != CL_SUCCESS) { fprintf(stderr, "ERROR: clCreateBuffer stop_d2 (size:%d) => %d\n", 1, err); return -1;}
-
   // Create device-side buffers for color
   color_d = clCreateBuffer(context, CL_MEM_READ_WRITE, num_nodes * sizeof(int), NULL, &err);
   if (err != CL_SUCCESS) { fprintf(stderr, "ERROR: clCreateBuffer color_d (size:%d) => %d\n", num_nodes, err); return -1;}
@@ -269,30 +249,7 @@ int main(int argc, char **argv) {
                              0);
   if (err != CL_SUCCESS) { fprintf(stderr, "ERROR: clEnqueueWriteBuffer node_value_d (size:%d) => %d\n", num_nodes, err); return -1; }
 
-  int stop = 1;
   int graph_color = 1;
-  stop = 0;
-  err = clEnqueueWriteBuffer(cmd_queue,
-                             stop_d1,
-                             1,
-                             0,
-                             sizeof(int),
-                             &stop,
-                             0,
-                             0,
-                             0);
-  if (err != CL_SUCCESS) { fprintf(stderr, "ERROR: write stop_d1 (%d)\n", err);}
-
-  err = clEnqueueWriteBuffer(cmd_queue,
-                             stop_d2,
-                             1,
-                             0,
-                             sizeof(int),
-                             &stop,
-                             0,
-                             0,
-                             0);
-  if (err != CL_SUCCESS) { fprintf(stderr, "ERROR: write stop_d2 (%d)\n", err);}
 
   // Set up kernel dimensions
   int block_size = wgs;
@@ -300,7 +257,8 @@ int main(int argc, char **argv) {
   size_t local_work[3]  = { block_size,  1, 1 };
   size_t global_work[3] = { global_size, 1, 1 };
 
-  int num_wgs = 1000;
+  // Launch about as many groups as previous runs found participating
+  int num_wgs = discovery_launch_groups(&target_device, &mega_kernel, wgs, 1000);
   num_wgs = my_min(num_wgs * wgs, global_size);
   global_work[0] = num_wgs;
 
@@ -311,12 +269,10 @@ int main(int argc, char **argv) {
   clSetKernelArg(mega_kernel, 1, sizeof(void *), (void*) &col_d);
   clSetKernelArg(mega_kernel, 2, sizeof(void *), (void*) &node_value_d);
   clSetKernelArg(mega_kernel, 3, sizeof(void *), (void*) &color_d);
-  clSetKernelArg(mega_kernel, 4, sizeof(void *), (void*) &stop_d1);
-  clSetKernelArg(mega_kernel, 5, sizeof(void *), (void*) &stop_d2);
-  clSetKernelArg(mega_kernel, 6, sizeof(void *), (void*) &max_d);
-  clSetKernelArg(mega_kernel, 7, sizeof(cl_int), (void*) &num_nodes);
-  clSetKernelArg(mega_kernel, 8, sizeof(cl_int), (void*) &num_edges);
-  clSetKernelArg(mega_kernel, 9, sizeof(void *), (void*) &d_gl_ctx);
+  clSetKernelArg(mega_kernel, 4, sizeof(void *), (void*) &max_d);
+  clSetKernelArg(mega_kernel, 5, sizeof(cl_int), (void*) &num_nodes);
+  clSetKernelArg(mega_kernel, 6, sizeof(cl_int), (void*) &num_edges);
+  clSetKernelArg(mega_kernel, 7, sizeof(void *), (void*) &d_gl_ctx);
 
   // Launch the mega-kernel
   double timer3 = gettime();
@@ -338,6 +294,18 @@ int main(int argc, char **argv) {
 
   int participating_wgs = number_of_participating_groups(&cmd_queue, &d_gl_ctx);
   printf("kernel ran with a total of %d workgroups\n", participating_wgs);
+  discovery_record_occupancy(&target_device, &mega_kernel, wgs, participating_wgs);
+
+#ifdef DISCOVERY_STATS
+  discovery_run_stats stats;
+  if (discovery_stats(&cmd_queue, &d_gl_ctx, &stats) == CL_SUCCESS) {
+    print_discovery_stats(&stats);
+  }
+#endif
+
+#ifdef DISCOVERY_TRACE
+  discovery_write_trace(&cmd_queue, &d_gl_ctx, "color_gb_trace.json");
+#endif
 
   // Copy back the color array
   err = clEnqueueReadBuffer(cmd_queue,
@@ -374,8 +342,6 @@ int main(int argc, char **argv) {
   clReleaseMemObject(max_d);
   clReleaseMemObject(color_d);
   clReleaseMemObject(node_value_d);
-  clReleaseMemObject(stop_d1);
-  clReleaseMemObject(stop_d2);
   clReleaseMemObject(d_gl_ctx);
   clReleaseProgram(prog);
 
@@ -397,60 +363,25 @@ void print_vector(int *vector, int num) {
 }
 
 int initialize(int use_gpu) {
-  cl_int result;
-  size_t size;
-
-  // Create OpenCL context
-  cl_platform_id platform_id;
-  if (clGetPlatformIDs(1, &platform_id, NULL) != CL_SUCCESS) { printf("ERROR: clGetPlatformIDs(1,*,0) failed\n"); return -1; }
-  cl_context_properties ctxprop[] = { CL_CONTEXT_PLATFORM, (cl_context_properties) platform_id, 0};
-  device_type = use_gpu ? CL_DEVICE_TYPE_GPU : CL_DEVICE_TYPE_CPU;
-
-  context = clCreateContextFromType( ctxprop,
-                                     device_type,
-                                     NULL,
-                                     NULL,
-                                     NULL );
-
-  if (!context) { fprintf(stderr, "ERROR: clCreateContextFromType(%s) failed\n", use_gpu ? "GPU" : "CPU"); return -1; }
-
-  // Get the list of GPUs
-  result = clGetContextInfo(context, CL_CONTEXT_DEVICES, 0, NULL, &size);
-  num_devices = (int) (size / sizeof(cl_device_id));
-  printf("num_devices = %d\n", num_devices);
-  if (result != CL_SUCCESS || num_devices < 1) { fprintf(stderr, "ERROR: clGetContextInfo() failed\n"); return -1; }
-
-  device_list = new cl_device_id[num_devices];
-  if (!device_list) { fprintf(stderr, "ERROR: new cl_device_id[] failed\n"); return -1; }
-
-  result = clGetContextInfo(context, CL_CONTEXT_DEVICES, size, device_list, NULL);
-  if (result != CL_SUCCESS) { fprintf(stderr, "ERROR: clGetContextInfo() failed\n"); return -1; }
-
-  target_device = device_list[REQUESTED_DEVICE];
-
-  // Create command queue for the first device
-  cmd_queue = clCreateCommandQueue( context,
-                                    target_device,
-                                    0,
-                                    NULL );
-
-  if (!cmd_queue) { fprintf(stderr, "ERROR: clCreateCommandQueue() failed\n"); return -1; }
-
+  // The context and queue are those of the shared runtime, so that the
+  // device selection options apply (see get_opencl_runtime). Without
+  // a device type from them, use_gpu = 0 selects a CPU device.
+  if (!use_gpu && runtime_device_type_arg == NULL && getenv("DISCOVERY_DEVICE_TYPE") == NULL) {
+    runtime_device_type_arg = "cpu";
+  }
+  context = opencl_runtime_context();
+  cmd_queue = opencl_runtime_queue(0);
+  target_device = create_device();
   return 0;
 }
 
 int shutdown() {
   // Release resources
-  if (cmd_queue) clReleaseCommandQueue(cmd_queue);
-  if (context) clReleaseContext(context);
-  if (device_list) delete device_list;
+  release_opencl_runtime();
 
   // Reset all variables
   cmd_queue = 0;
   context = 0;
-  device_list = 0;
-  num_devices = 0;
-  device_type = 0;
-
+  target_device = 0;
   return 0;
 }
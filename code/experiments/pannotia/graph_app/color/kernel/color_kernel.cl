@@ -160,17 +160,12 @@ __kernel void mega_kernel( __global int   *row,                        //0
                            __global int   *col,                        //1
                            __global float *node_value,                 //2
                            __global int   *color_array,                //3
-                           __global int   *stop1,                      //4
-                           __global int   *stop2,                      //5
-                           __global float *max_d,                      //6
-                           const  int num_nodes,                       //7
-                           const  int num_edges,                       //8
-                           __global discovery_kernel_ctx *gl_ctx) {    //9
+                           __global float *max_d,                      //4
+                           const  int num_nodes,                       //5
+                           const  int num_edges,                       //6
+                           __global discovery_kernel_ctx *gl_ctx) {    //7
 
   DISCOVERY_PROTOCOL(gl_ctx);
-  __global int * write_stop = stop1;
-  __global int * read_stop = stop2;
-  __global int * swap;
 
   // Get global participating group id and the stride
   int tid = p_get_global_id(gl_ctx, &local_ctx);
@@ -179,10 +174,14 @@ __kernel void mega_kernel( __global int   *row,                        //0
 
   while (1) {
 
+    int stop = 0;
+
     // Original application --- color --- start
 
-    // The original kernels used an 'if' here. We need a 'for' loop
-    for (int i = tid; i < num_nodes; i+=stride) {
+    // The original kernels used an 'if' here. We need a 'for' loop.
+    // Vertex degrees vary widely, so the vertices are shared out by
+    // the scheduler when it is enabled
+    DISCOVERY_FOR_EACH(gl_ctx, &local_ctx, i, num_nodes) {
 
       // If the vertex is still not colored
       if (color_array[i] == -1) {
@@ -202,7 +201,7 @@ __kernel void mega_kernel( __global int   *row,                        //0
 
           // Determine if the vertex value is the maximum in the neighborhood
           if (color_array[col[edge]] == -1 && start != end - 1) {
-            *write_stop = 1;
+            stop = 1;
             if (node_value[col[edge]] > maximum)
               maximum = node_value[col[edge]];
           }
@@ -212,16 +211,12 @@ __kernel void mega_kernel( __global int   *row,                        //0
       }
     }
 
-    // Two terminating variables allow us to only use 1
-    // inter-workgroup barrier and still avoid a data-race
-    swap = read_stop;
-    read_stop = write_stop;
-    write_stop = swap;
-
     // Original application --- color --- end
 
-    // Inter-workgroup barrier
-    discovery_barrier(gl_ctx, &local_ctx);
+    // Inter-workgroup barrier, which also combines the terminating
+    // variable of every thread. This replaces the two global stop
+    // variables that were swapped to avoid a data-race.
+    stop = discovery_barrier_reduce(gl_ctx, &local_ctx, stop, DISCOVERY_REDUCE_OR);
 
     // Original application --- color2 --- start
 
@@ -237,12 +232,11 @@ __kernel void mega_kernel( __global int   *row,                        //0
       }
     }
 
-    if (*read_stop == 0) {
+    if (stop == 0) {
       break;
     }
 
     graph_color = graph_color + 1;
-    *write_stop = 0;
 
     // Original application --- color2 --- end
 
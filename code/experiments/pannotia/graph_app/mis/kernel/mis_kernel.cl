@@ -224,7 +224,6 @@ __kernel void mega_kernel( __global int *row,
                            __global int *c_array,
                            __global int *cu_array,
                            __global float *min_array,
-                           __global int *stop,
                            int num_nodes,
                            int num_edges,
                            __global discovery_kernel_ctx *gl_ctx
@@ -239,6 +238,8 @@ __kernel void mega_kernel( __global int *row,
 
   while(1) {
 
+    local_stop = 0;
+
     // Original application --- mis1 --- start
 
     // The original kernels used an 'if' here. We need a 'for' loop
@@ -246,7 +247,7 @@ __kernel void mega_kernel( __global int *row,
 
       // If the vertex is not processed
       if (c_array[tid] == -1) {
-        *stop = 1;
+        local_stop = 1;
 
         // Get the start and end pointers
         int start = row[tid];
@@ -270,9 +271,10 @@ __kernel void mega_kernel( __global int *row,
 
     // Original application --- mis1 --- end
 
-    // Inter-workgroup barrier
-    discovery_barrier(gl_ctx, &local_ctx);
-    local_stop = *stop;
+    // Inter-workgroup barrier, which also combines the terminating
+    // variable of every thread instead of having them all write a
+    // global stop variable
+    local_stop = discovery_barrier_reduce(gl_ctx, &local_ctx, local_stop, DISCOVERY_REDUCE_OR);
 
     // Original application --- mis2 --- start
 
@@ -318,7 +320,6 @@ __kernel void mega_kernel( __global int *row,
     if (local_stop == 0) {
       break;
     }
-    *stop = 0;
 
     // Original application --- mis3 --- start
 
@@ -80,10 +80,7 @@ void print_vectorf(float *vector, int num);
 // Local OpenCL utilities
 static cl_context       context;
 static cl_command_queue cmd_queue;
-static cl_device_type   device_type;
 static cl_device_id     target_device;
-static cl_device_id   * device_list;
-static cl_int           num_devices;
 
 const char * CL_FILE = STRINGIFY(KERNEL_DIR) "mis_kernel.cl";
 
@@ -100,6 +97,7 @@ int main(int argc, char **argv) {
   cl_int err = 0;
   int wgs;
 
+  opencl_runtime_args(&argc, argv);
   if (argc == 4) {
     tmpchar = argv[1];           // Graph file
     file_format = atoi(argv[2]); // Graph format
@@ -146,20 +144,10 @@ int main(int argc, char **argv) {
     node_value[i] = float(i/((float)(num_nodes + 1)));
   }
 
-  // Load the OpenCL kernel file
-  int sourcesize = 1024 * 1024;
-  char * source = (char *) calloc(sourcesize, sizeof(char));
-  if (!source) { printf("ERROR: calloc(%d) failed\n", sourcesize); return -1; }
-
-  FILE * fp = fopen(CL_FILE, "rb");
-  if (!fp) { printf("ERROR: unable to open '%s'\n", CL_FILE); return -1; }
-  fread(source + strlen(source), sourcesize, 1, fp);
-  fclose(fp);
-
   // Initialize the OpenCL variables
   if (initialize(use_gpu)) return -1;
 
-  char opts[500];
+  char opts[COMPILE_OPTS_SIZE];
   get_compile_opts(opts);
   cl_program prog = build_program(context, target_device, CL_FILE, opts);
 
@@ -428,57 +416,25 @@ void print_vectorf(float *vector, int num) {
 }
 
 int initialize(int use_gpu) {
-  cl_int result;
-  size_t size;
-
-  // Create OpenCL context
-  cl_platform_id platform_id;
-  if (clGetPlatformIDs(1, &platform_id, NULL) != CL_SUCCESS) { printf("ERROR: clGetPlatformIDs(1,*,0) failed\n"); return -1; }
-  cl_context_properties ctxprop[] = { CL_CONTEXT_PLATFORM, (cl_context_properties) platform_id, 0};
-  device_type = use_gpu ? CL_DEVICE_TYPE_GPU : CL_DEVICE_TYPE_CPU;
-
-  context = clCreateContextFromType( ctxprop,
-                                     device_type,
-                                     NULL,
-                                     NULL,
-                                     NULL );
-
-  if (!context) { fprintf(stderr, "ERROR: clCreateContextFromType(%s) failed\n", use_gpu ? "GPU" : "CPU"); return -1; }
-
-  // Get the list of GPUs
-  result = clGetContextInfo( context, CL_CONTEXT_DEVICES, 0, NULL, &size);
-  num_devices = (int) (size / sizeof(cl_device_id));
-  printf("num_devices = %d\n", num_devices);
-
-  if (result != CL_SUCCESS || num_devices < 1) { fprintf(stderr, "ERROR: clGetContextInfo() failed\n"); return -1; }
-  device_list = new cl_device_id[num_devices];
-  if (!device_list) { fprintf(stderr, "ERROR: new cl_device_id[] failed\n"); return -1; }
-  result = clGetContextInfo( context, CL_CONTEXT_DEVICES, size, device_list, NULL);
-  if (result != CL_SUCCESS) { fprintf(stderr, "ERROR: clGetContextInfo() failed\n"); return -1; }
-
-  target_device = device_list[REQUESTED_DEVICE];
-
-  // Create command queue for the first device
-  cmd_queue = clCreateCommandQueue( context,
-                                    target_device,
-                                    0,
-                                    NULL );
-
-  if (!cmd_queue) { fprintf(stderr, "ERROR: clCreateCommandQueue() failed\n"); return -1; }
+  // The context and queue are those of the shared runtime, so that the
+  // device selection options apply (see get_opencl_runtime). Without
+  // a device type from them, use_gpu = 0 selects a CPU device.
+  if (!use_gpu && runtime_device_type_arg == NULL && getenv("DISCOVERY_DEVICE_TYPE") == NULL) {
+    runtime_device_type_arg = "cpu";
+  }
+  context = opencl_runtime_context();
+  cmd_queue = opencl_runtime_queue(0);
+  target_device = create_device();
   return 0;
 }
 
 int shutdown() {
   // Release resources
-  if (cmd_queue) clReleaseCommandQueue(cmd_queue);
-  if (context) clReleaseContext(context);
-  if (device_list) delete device_list;
+  release_opencl_runtime();
 
   // Reset all variables
   cmd_queue = 0;
   context = 0;
-  device_list = 0;
-  num_devices = 0;
-  device_type = 0;
+  target_device = 0;
   return 0;
 }
@@ -85,10 +85,7 @@ void print_vectorf(float *vector, int num);
 // Local OpenCL utilities
 static cl_context       context;
 static cl_command_queue cmd_queue;
-static cl_device_type   device_type;
 static cl_device_id     target_device;
-static cl_device_id   * device_list;
-static cl_int           num_devices;
 
 const char * CL_FILE = STRINGIFY(KERNEL_DIR) "mis_kernel.cl";
 
@@ -105,6 +102,7 @@ int main(int argc, char **argv) {
   cl_int err = 0;
   int wgs;
 
+  opencl_runtime_args(&argc, argv);
   if (argc == 4) {
     tmpchar = argv[1];            // Graph file
     file_format = atoi(argv[2]);  // Graph format
@@ -151,20 +149,10 @@ int main(int argc, char **argv) {
     node_value[i] = float(i/((float)(num_nodes + 1)));
   }
 
-  // Load the OpenCL kernel file
-  int sourcesize = 1024 * 1024;
-  char * source = (char *) calloc(sourcesize, sizeof(char));
-  if (!source) { printf("ERROR: calloc(%d) failed\n", sourcesize); return -1; }
-
-  FILE * fp = fopen(CL_FILE, "rb");
-  if (!fp) { printf("ERROR: unable to open '%s'\n", CL_FILE); return -1; }
-  fread(source + strlen(source), sourcesize, 1, fp);
-  fclose(fp);
-
   // Initialize the OpenCL variables
   if (initialize(use_gpu)) return -1;
 
-  char opts[500];
+  char opts[COMPILE_OPTS_SIZE];
   get_compile_opts(opts);
   cl_program prog = build_program(context, target_device, CL_FILE, opts);
 
@@ -180,14 +168,13 @@ int main(int argc, char **argv) {
 
   // Create and initialize discovery context
   cl_mem d_gl_ctx;
-  d_gl_ctx = clCreateBuffer(context, CL_MEM_READ_WRITE, sizeof(discovery_kernel_ctx), NULL, &err);
-  err = init_discovery_kernel_ctx(&prog, &cmd_queue, &d_gl_ctx);
+  err = create_discovery_kernel_ctx(&context, &target_device, &prog, &cmd_queue, &d_gl_ctx);
   if (err < 0) { perror("failed kernel context"); exit(1); }
 
 
   // Device side buffers
   cl_mem row_d, col_d, c_array_d, c_array_u_d,
-    s_array_d, node_value_d, min_array_d, stop_d;
+    s_array_d, node_value_d, min_array_d;
 
   // Allocate the device-side buffers for the graph
   row_d = clCreateBuffer(context, CL_MEM_READ_WRITE, num_nodes * sizeof(int), NULL, &err);
@@ -196,10 +183,6 @@ int main(int argc, char **argv) {
   col_d = clCreateBuffer(context, CL_MEM_READ_WRITE, num_edges * sizeof(int), NULL, &err);
   if (err != CL_SUCCESS) { fprintf(stderr, "ERROR: clCreateBuffer col_d (size:%d) => %d\n", num_edges, err); return -1;}
 
-  // Termination variable
-  stop_d = clCreateBuffer(context, CL_MEM_READ_WRITE, sizeof(int), NULL, &err);
-  if (err != CL_SUCCESS) { fprintf(stderr, "ERROR: clCreateBuffer stop_d (size:%d) => %d\n", 1, err); return -1;}
-
   // Allocate the device-side buffers for mis
   min_array_d = clCreateBuffer(context, CL_MEM_READ_WRITE, num_nodes * sizeof(float), NULL, &err);
   if (err != CL_SUCCESS) { fprintf(stderr, "ERROR: clCreateBuffer min_array_d (size:%d) => %d\n", num_nodes, err); return -1;}
@@ -285,20 +268,12 @@ int main(int argc, char **argv) {
   clSetKernelArg(mega_kernel, 4, sizeof(void *), (void*) &c_array_d);
   clSetKernelArg(mega_kernel, 5, sizeof(void *), (void*) &c_array_u_d);
   clSetKernelArg(mega_kernel, 6, sizeof(void *), (void*) &min_array_d);
-  clSetKernelArg(mega_kernel, 7, sizeof(void *), (void*) &stop_d);
-  clSetKernelArg(mega_kernel, 8, sizeof(cl_int), (void*) &num_nodes);
-  clSetKernelArg(mega_kernel, 9, sizeof(cl_int), (void*) &num_edges);
-  clSetKernelArg(mega_kernel, 10, sizeof(void *), (void*) &d_gl_ctx);
-
-
-  // Termination variable
-  int stop = 0;
+  clSetKernelArg(mega_kernel, 7, sizeof(cl_int), (void*) &num_nodes);
+  clSetKernelArg(mega_kernel, 8, sizeof(cl_int), (void*) &num_edges);
+  clSetKernelArg(mega_kernel, 9, sizeof(void *), (void*) &d_gl_ctx);
 
-  // Copy the termination variable to the device
-  err = clEnqueueWriteBuffer(cmd_queue, stop_d, 1, 0, sizeof(int), &stop, 0, 0, 0);
-  if (err != CL_SUCCESS) { fprintf(stderr, "ERROR: write stop_d variable (%d)\n", err); return -1; }
-
-  int num_wgs = 1000;
+  // Launch about as many groups as previous runs found participating
+  int num_wgs = discovery_launch_groups(&target_device, &mega_kernel, wgs, 1000);
   num_wgs = my_min(num_wgs * wgs, global_size);
   global_work[0] = num_wgs;
 
@@ -324,6 +299,18 @@ int main(int argc, char **argv) {
 
   int participating_wgs = number_of_participating_groups(&cmd_queue, &d_gl_ctx);
   printf("kernel ran with a total of %d workgroups\n", participating_wgs);
+  discovery_record_occupancy(&target_device, &mega_kernel, wgs, participating_wgs);
+
+#ifdef DISCOVERY_STATS
+  discovery_run_stats stats;
+  if (discovery_stats(&cmd_queue, &d_gl_ctx, &stats) == CL_SUCCESS) {
+    print_discovery_stats(&stats);
+  }
+#endif
+
+#ifdef DISCOVERY_TRACE
+  discovery_write_trace(&cmd_queue, &d_gl_ctx, "mis_gb_trace.json");
+#endif
 
   err = clEnqueueReadBuffer(cmd_queue,
                             s_array_d,
@@ -356,7 +343,6 @@ int main(int argc, char **argv) {
   clReleaseMemObject(s_array_d);
   clReleaseMemObject(node_value_d);
   clReleaseMemObject(min_array_d);
-  clReleaseMemObject(stop_d);
   clReleaseProgram(prog);
 
   // Clean up the OpenCL variables
@@ -389,57 +375,25 @@ void print_vectorf(float *vector, int num) {
 
 
 int initialize(int use_gpu) {
-  cl_int result;
-  size_t size;
-
-  // create OpenCL context
-  cl_platform_id platform_id;
-  if (clGetPlatformIDs(1, &platform_id, NULL) != CL_SUCCESS) { printf("ERROR: clGetPlatformIDs(1,*,0) failed\n"); return -1; }
-  cl_context_properties ctxprop[] = { CL_CONTEXT_PLATFORM, (cl_context_properties) platform_id, 0};
-  device_type = use_gpu ? CL_DEVICE_TYPE_GPU : CL_DEVICE_TYPE_CPU;
-
-  context = clCreateContextFromType( ctxprop,
-                                     device_type,
-                                     NULL,
-                                     NULL,
-                                     NULL );
-
-  if (!context) { fprintf(stderr, "ERROR: clCreateContextFromType(%s) failed\n", use_gpu ? "GPU" : "CPU"); return -1; }
-
-  // get the list of GPUs
-  result = clGetContextInfo(context, CL_CONTEXT_DEVICES, 0, NULL, &size);
-  num_devices = (int) (size / sizeof(cl_device_id));
-  printf("num_devices = %d\n", num_devices);
-
-  if (result != CL_SUCCESS || num_devices < 1) { fprintf(stderr, "ERROR: clGetContextInfo() failed\n"); return -1; }
-  device_list = new cl_device_id[num_devices];
-  if (!device_list) { fprintf(stderr, "ERROR: new cl_device_id[] failed\n"); return -1; }
-  result = clGetContextInfo(context, CL_CONTEXT_DEVICES, size, device_list, NULL);
-  if (result != CL_SUCCESS) { fprintf(stderr, "ERROR: clGetContextInfo() failed\n"); return -1; }
-
-  target_device = device_list[REQUESTED_DEVICE];
-
-  // create command queue for the first device
-  cmd_queue = clCreateCommandQueue( context,
-                                    target_device,
-                                    0,
-                                    NULL );
-
-  if (!cmd_queue) { fprintf(stderr, "ERROR: clCreateCommandQueue() failed\n"); return -1; }
+  // The context and queue are those of the shared runtime, so that the
+  // device selection options apply (see get_opencl_runtime). Without
+  // a device type from them, use_gpu = 0 selects a CPU device.
+  if (!use_gpu && runtime_device_type_arg == NULL && getenv("DISCOVERY_DEVICE_TYPE") == NULL) {
+    runtime_device_type_arg = "cpu";
+  }
+  context = opencl_runtime_context();
+  cmd_queue = opencl_runtime_queue(0);
+  target_device = create_device();
   return 0;
 }
 
 int shutdown() {
   // Release resources
-  if (cmd_queue) clReleaseCommandQueue(cmd_queue);
-  if (context) clReleaseContext(context);
-  if (device_list) delete device_list;
+  release_opencl_runtime();
 
   // Reset all variables
   cmd_queue = 0;
   context = 0;
-  device_list = 0;
-  num_devices = 0;
-  device_type = 0;
+  target_device = 0;
   return 0;
 }
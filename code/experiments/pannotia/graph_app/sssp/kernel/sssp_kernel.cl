@@ -173,10 +173,23 @@ __kernel void mega_kernel( const int num_rows,
                            __global int * data,
                            __global int * x,
                            __global int * y,
-                           __global int *stop,
-                           __global discovery_kernel_ctx *gl_ctx) {
+                           __global discovery_kernel_ctx *gl_ctx,
+                           const int source) {
 
-  DISCOVERY_PROTOCOL(gl_ctx);
+  // Groups that lose the discovery poll help with the initialisation
+  // before they exit
+  DISCOVERY_PROTOCOL_SHARED(gl_ctx);
+
+  // Original application --- vector_init --- start
+
+  DISCOVERY_SHARED_FOR_EACH(gl_ctx, &local_ctx, i, num_rows) {
+    x[i] = (i == source) ? 0 : BIG_NUM;
+    y[i] = (i == source) ? 0 : BIG_NUM;
+  }
+
+  DISCOVERY_SHARED_END(gl_ctx, &local_ctx, num_rows);
+
+  // Original application --- vector_init --- end
 
   // Get global participating group id
   int tid = p_get_global_id(gl_ctx, &local_ctx);
@@ -198,12 +211,14 @@ __kernel void mega_kernel( const int num_rows,
 
     // Original application --- spmv_min_dot_plus_kernel --- start
 
-    // This is the right place to initialize stop variable as it is
-    // the only barrier interval which doesn't use stop
-    *stop = 0;
+    // Original application --- vector_diff --- is folded into this
+    // loop: y[it] differs from x[it] only if the minimum was lowered
+    int changed = 0;
 
-    // The original kernels used an 'if' here. We need a 'for' loop
-    for (int it = tid; it < num_rows; it+=stride) {
+    // The original kernels used an 'if' here. We need a 'for' loop.
+    // Rows have very different lengths, so they are shared out by
+    // the scheduler when it is enabled
+    DISCOVERY_FOR_EACH(gl_ctx, &local_ctx, it, num_rows) {
 
       // Get the start and end pointers
       int row_start = row[it];
@@ -216,28 +231,17 @@ __kernel void mega_kernel( const int num_rows,
           min = data[j] + x[col[j]];
       }
       y[it] = min;
-    }
 
-    // Original application --- spmv_min_dot_plus_kernel --- end
-
-    // Inter-workgroup barrier
-    discovery_barrier(gl_ctx, &local_ctx);
-
-    // Original application --- vector_diff --- start
-
-    // The original kernels used an 'if' here. We need a 'for' loop
-    for (int i = tid; i < num_rows; i+=stride) {
-      if (y[i] != x[i])
-        *stop = 1;
+      if (min != x[it])
+        changed = 1;
     }
 
-    // Original application --- vector_diff --- end
-
-    // Inter-workgroup barrier
-    discovery_barrier(gl_ctx, &local_ctx);
+    // Original application --- spmv_min_dot_plus_kernel --- end
 
-    // Check terminating condition before continuing
-    if (*stop == 0) {
+    // Inter-workgroup barrier, which also tells every group whether
+    // any distance changed, i.e. the terminating condition. This
+    // replaces the global stop variable and a barrier.
+    if (discovery_barrier_reduce(gl_ctx, &local_ctx, changed, DISCOVERY_REDUCE_OR) == 0) {
       break;
     }
   }
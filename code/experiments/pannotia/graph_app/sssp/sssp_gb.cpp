@@ -82,10 +82,7 @@ void print_vector(int *vector, int num);
 // Local OpenCL utilities
 static cl_context       context;
 static cl_command_queue cmd_queue;
-static cl_device_type   device_type;
 static cl_device_id     target_device;
-static cl_device_id   * device_list;
-static cl_int           num_devices;
 
 const char * CL_FILE = STRINGIFY(KERNEL_DIR) "sssp_kernel.cl";
 
@@ -102,6 +99,7 @@ int main(int argc, char **argv) {
   cl_int err = 0;
   const char *which_kernel = "mega_kernel";
 
+  opencl_runtime_args(&argc, argv);
   if (argc == 4) {
     tmpchar = argv[1];           // Graph file
     file_format = atoi(argv[2]); // Graph format
@@ -138,20 +136,10 @@ int main(int argc, char **argv) {
   // Set the cost array to zero
   for(int i = 0; i < num_nodes; i++) cost_array[i] = 0;
 
-  // Load OpenCL kernel file
-  int sourcesize = 1024 * 1024;
-  char * source = (char *) calloc(sourcesize, sizeof(char));
-  if (!source) { printf("ERROR: calloc(%d) failed\n", sourcesize); return -1; }
-
-  FILE * fp = fopen(CL_FILE, "rb");
-  if (!fp) { printf("ERROR: unable to open '%s'\n", CL_FILE); return -1; }
-  fread(source + strlen(source), sourcesize, 1, fp);
-  fclose(fp);
-
   // OpenCL initialization
   if (initialize(use_gpu)) return -1;
 
-  char opts[500];
+  char opts[COMPILE_OPTS_SIZE];
   get_compile_opts(opts);
   strcat(opts, " -DNAIVE_SSSP");
 
@@ -159,18 +147,13 @@ int main(int argc, char **argv) {
   cl_program prog = build_program(context, target_device, CL_FILE, opts);
 
   // Create OpenCL kernels
-  cl_kernel kernel1, mega_kernel;
-  const char * kernelsssp1  = "vector_init";
-
-  kernel1 = clCreateKernel(prog, kernelsssp1, &err);
-  if (err != CL_SUCCESS) { fprintf(stderr, "ERROR: clCreateKernel() 1 => %d\n", err); return -1; }
+  cl_kernel mega_kernel;
 
   mega_kernel = clCreateKernel(prog, which_kernel, &err);
   if (err != CL_SUCCESS) { fprintf(stderr, "ERROR: clCreateKernel() 1 => %d\n", err); return -1; }
 
   // Device buffers
-  cl_mem row_d, col_d, data_d, vector_d1, vector_d2,
-    stop0_d;
+  cl_mem row_d, col_d, data_d, vector_d1, vector_d2;
 
   // Create the device-side graph structure
   row_d = clCreateBuffer(context, CL_MEM_READ_WRITE, (num_nodes + 1) * sizeof(int), NULL, &err);
@@ -182,10 +165,6 @@ int main(int argc, char **argv) {
   data_d = clCreateBuffer(context, CL_MEM_READ_WRITE, num_edges * sizeof(int), NULL, &err);
   if (err != CL_SUCCESS) { fprintf(stderr, "ERROR: clCreateBuffer data_d (size:%d) => %d\n", num_edges, err); return -1;}
 
-  // Termination variables
-  stop0_d = clCreateBuffer(context, CL_MEM_READ_WRITE, sizeof(int), NULL, &err);
-  if (err != CL_SUCCESS) { fprintf(stderr, "ERROR: clCreateBuffer stop0_d (size:%d) => %d\n", 1, err); return -1;}
-
   // Create the buffers for sssp
   vector_d1 = clCreateBuffer(context, CL_MEM_READ_WRITE, num_nodes * sizeof(int), NULL, &err);
   if (err != CL_SUCCESS) { fprintf(stderr, "ERROR: clCreateBuffer vector_d1 (size:%d) => %d\n", 1, err); return -1;}
@@ -235,35 +214,16 @@ int main(int argc, char **argv) {
 
   // Create and initialise the discovery context
   cl_mem d_gl_ctx;
-  d_gl_ctx = clCreateBuffer(context, CL_MEM_READ_WRITE, sizeof(discovery_kernel_ctx), NULL, &err);
-  err = init_discovery_kernel_ctx(&prog, &cmd_queue, &d_gl_ctx);
+  err = create_discovery_kernel_ctx(&context, &target_device, &prog, &cmd_queue, &d_gl_ctx);
   if (err < 0) { perror("failed kernel context"); exit(1); }
 
   size_t local_work[3]   = { block_size,  1, 1};
-  size_t global_work[3]  = { global_size, 1, 1};
 
   // Source vertex 0;
   int sourceVertex = 0;
 
-  // --Initialise
-
-  // Set kernel args for init kernel
-  clSetKernelArg(kernel1, 0, sizeof(void *), (void*) &vector_d1);
-  clSetKernelArg(kernel1, 1, sizeof(void *), (void*) &vector_d2);
-  clSetKernelArg(kernel1, 2, sizeof(cl_int), (void*) &sourceVertex);
-  clSetKernelArg(kernel1, 3, sizeof(cl_int), (void*) &num_nodes);
-
-  // Launch the initialization kernel
-  err = clEnqueueNDRangeKernel(cmd_queue,
-                               kernel1,
-                               1,
-                               NULL,
-                               global_work,
-                               local_work,
-                               0,
-                               0,
-                               0);
-  if (err != CL_SUCCESS) { fprintf(stderr, "ERROR: kernel1  clEnqueueNDRangeKernel()=>%d failed\n", err); return -1; }
+  // The distances are initialised by the mega kernel, with the help
+  // of the groups that do not participate
 
   // --Set up kernel args
 
@@ -274,16 +234,11 @@ int main(int argc, char **argv) {
   clSetKernelArg(mega_kernel, 3, sizeof(void *), (void*) &data_d);
   clSetKernelArg(mega_kernel, 4, sizeof(void *), (void*) &vector_d1);
   clSetKernelArg(mega_kernel, 5, sizeof(void *), (void*) &vector_d2);
-  clSetKernelArg(mega_kernel, 6, sizeof(void *), (void*) &stop0_d);
-  clSetKernelArg(mega_kernel, 7, sizeof(void *), (void*) &d_gl_ctx);
-
-  int stop = 0;
+  clSetKernelArg(mega_kernel, 6, sizeof(void *), (void*) &d_gl_ctx);
+  clSetKernelArg(mega_kernel, 7, sizeof(cl_int), (void*) &sourceVertex);
 
-  // Copy termination variables to the device
-  err = clEnqueueWriteBuffer(cmd_queue, stop0_d, 1, 0, sizeof(int), &stop, 0, 0, 0);
-  if (err != CL_SUCCESS) { fprintf(stderr, "ERROR: write stop_d (%d)\n", err); return -1; }
-
-  int num_wgs = 1000;
+  // Launch about as many groups as previous runs found participating
+  int num_wgs = discovery_launch_groups(&target_device, &mega_kernel, wgs, 1000);
   num_wgs = my_min(num_wgs * wgs, global_size);
   size_t global_active_work[3] = { num_wgs, 1, 1};
   clFinish(cmd_queue);
@@ -313,6 +268,18 @@ int main(int argc, char **argv) {
 
   int participating_wgs = number_of_participating_groups(&cmd_queue, &d_gl_ctx);
   printf("kernel ran with a total of %d workgroups\n", participating_wgs);
+  discovery_record_occupancy(&target_device, &mega_kernel, wgs, participating_wgs);
+
+#ifdef DISCOVERY_STATS
+  discovery_run_stats stats;
+  if (discovery_stats(&cmd_queue, &d_gl_ctx, &stats) == CL_SUCCESS) {
+    print_discovery_stats(&stats);
+  }
+#endif
+
+#ifdef DISCOVERY_TRACE
+  discovery_write_trace(&cmd_queue, &d_gl_ctx, "sssp_gb_trace.json");
+#endif
 
   // Print the timing into
   printf("kernel + memcpy time = %lf ms\n", (timer2 - timer1) * 1000);
@@ -330,7 +297,6 @@ int main(int argc, char **argv) {
   clReleaseMemObject(row_d);
   clReleaseMemObject(col_d);
   clReleaseMemObject(data_d);
-  clReleaseMemObject(stop0_d);
   clReleaseMemObject(vector_d1);
   clReleaseMemObject(vector_d2);
   clReleaseMemObject(d_gl_ctx);
@@ -354,59 +320,25 @@ void print_vector(int *vector, int num) {
 }
 
 int initialize(int use_gpu) {
-  cl_int result;
-  size_t size;
-
-  // Create OpenCL context
-  cl_platform_id platform_id;
-  if (clGetPlatformIDs(1, &platform_id, NULL) != CL_SUCCESS) { printf("ERROR: clGetPlatformIDs(1,*,0) failed\n"); return -1; }
-  cl_context_properties ctxprop[] = { CL_CONTEXT_PLATFORM, (cl_context_properties) platform_id, 0};
-  device_type = use_gpu ? CL_DEVICE_TYPE_GPU : CL_DEVICE_TYPE_CPU;
-
-  context = clCreateContextFromType( ctxprop,
-                                     device_type,
-                                     NULL,
-                                     NULL,
-                                     NULL );
-
-  if (!context) { fprintf(stderr, "ERROR: clCreateContextFromType(%s) failed\n", use_gpu ? "GPU" : "CPU"); return -1; }
-
-  // Get the list of GPUs
-  result = clGetContextInfo(context, CL_CONTEXT_DEVICES, 0, NULL, &size);
-  num_devices = (int) (size / sizeof(cl_device_id));
-  printf("num_devices = %d\n", num_devices);
-  if (result != CL_SUCCESS || num_devices < 1) { fprintf(stderr, "ERROR: clGetContextInfo() failed\n"); return -1; }
-
-  device_list = new cl_device_id[num_devices];
-  if (!device_list) { fprintf(stderr, "ERROR: new cl_device_id[] failed\n"); return -1; }
-
-  result = clGetContextInfo(context, CL_CONTEXT_DEVICES, size, device_list, NULL);
-  if (result != CL_SUCCESS) { fprintf(stderr, "ERROR: clGetContextInfo() failed\n"); return -1; }
-  target_device = device_list[REQUESTED_DEVICE];
-
-  // Create command queue for the first device
-  cmd_queue = clCreateCommandQueue( context,
-                                    target_device,
-                                    0,
-                                    NULL );
-
-  if (!cmd_queue) { fprintf(stderr, "ERROR: clCreateCommandQueue() failed\n"); return -1; }
-
+  // The context and queue are those of the shared runtime, so that the
+  // device selection options apply (see get_opencl_runtime). Without
+  // a device type from them, use_gpu = 0 selects a CPU device.
+  if (!use_gpu && runtime_device_type_arg == NULL && getenv("DISCOVERY_DEVICE_TYPE") == NULL) {
+    runtime_device_type_arg = "cpu";
+  }
+  context = opencl_runtime_context();
+  cmd_queue = opencl_runtime_queue(0);
+  target_device = create_device();
   return 0;
 }
 
 int shutdown() {
-
   // Release resources
-  if (cmd_queue) clReleaseCommandQueue(cmd_queue);
-  if (context) clReleaseContext(context);
-  if (device_list) delete device_list;
+  release_opencl_runtime();
 
   // Reset all variables
   cmd_queue = 0;
   context = 0;
-  device_list = 0;
-  num_devices = 0;
-  device_type = 0;
+  target_device = 0;
   return 0;
 }